@@ -0,0 +1,510 @@
+/* Benchmarks of leptjson over generated corpora. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "leptjson.h"
+
+/* growable text buffer used to generate corpora */
+typedef struct {
+    char* s;
+    size_t len, cap;
+} bench_buffer;
+
+static void buffer_append(bench_buffer* b, const char* s, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        while (b->len + len + 1 > b->cap)
+            b->cap = b->cap ? b->cap * 2 : 4096;
+        b->s = (char*)realloc(b->s, b->cap);
+    }
+    memcpy(b->s + b->len, s, len);
+    b->len += len;
+    b->s[b->len] = '\0';
+}
+
+#define APPEND(b, lit) buffer_append(b, lit, sizeof(lit) - 1)
+
+static void buffer_printf(bench_buffer* b, const char* format, double n) {
+    char tmp[64];
+    buffer_append(b, tmp, (size_t)sprintf(tmp, format, n));
+}
+
+/* xorshift, reseeded per corpus so every build and filter benchmarks the same documents */
+#define RNG_SEED 88172645463325252ULL
+static unsigned long long rng_state = RNG_SEED;
+
+static unsigned long long rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double rng_double(double lo, double hi) {
+    return lo + (hi - lo) * (double)(rng() >> 11) / 9007199254740992.0;
+}
+
+/* a corpus is one or more documents (several for NDJSON) */
+typedef struct {
+    const char* name;
+    char** docs;
+    size_t count, bytes;
+} bench_corpus;
+
+static void corpus_add(bench_corpus* c, bench_buffer* b) {
+    c->docs = (char**)realloc(c->docs, (c->count + 1) * sizeof(char*));
+    c->docs[c->count++] = b->s;
+    c->bytes += b->len;
+    b->s = NULL;
+    b->len = b->cap = 0;
+}
+
+/* number-heavy polygons, shaped like GeoJSON */
+static void generate_geo(bench_corpus* c) {
+    bench_buffer b = { NULL, 0, 0 };
+    int i, j;
+    APPEND(&b, "{\"type\":\"FeatureCollection\",\"features\":[");
+    for (i = 0; i < 20; i++) {
+        if (i > 0) APPEND(&b, ",");
+        APPEND(&b, "{\"type\":\"Feature\",\"properties\":{\"name\":\"region\"},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[");
+        for (j = 0; j < 2000; j++) {
+            if (j > 0) APPEND(&b, ",");
+            buffer_printf(&b, "[%.15g,", rng_double(-180.0, 180.0));
+            buffer_printf(&b, "%.15g]", rng_double(-90.0, 90.0));
+        }
+        APPEND(&b, "]]}}");
+    }
+    APPEND(&b, "]}");
+    corpus_add(c, &b);
+}
+
+/* string-heavy status messages with escapes and non-ASCII text */
+static void generate_tweets(bench_corpus* c) {
+    static const char* words[] = {
+        "lorem", "ipsum", "dolor", "sit", "amet", "\\u00e9t\\u00e9", "\\\"quoted\\\"",
+        "caf\xC3\xA9", "\xE6\x97\xA5\xE6\x9C\xAC", "line\\nbreak", "tab\\tbed", "\\ud83d\\ude00"
+    };
+    bench_buffer b = { NULL, 0, 0 };
+    int i, j;
+    APPEND(&b, "{\"statuses\":[");
+    for (i = 0; i < 2000; i++) {
+        if (i > 0) APPEND(&b, ",");
+        APPEND(&b, "{\"id_str\":\"");
+        buffer_printf(&b, "%.0f", (double)(rng() >> 12));
+        APPEND(&b, "\",\"lang\":\"en\",\"text\":\"");
+        for (j = 0; j < 20; j++) {
+            const char* w = words[rng() % (sizeof(words) / sizeof(words[0]))];
+            buffer_append(&b, w, strlen(w));
+            APPEND(&b, " ");
+        }
+        APPEND(&b, "\",\"user\":{\"screen_name\":\"user");
+        buffer_printf(&b, "%.0f", (double)i);
+        APPEND(&b, "\",\"description\":\"just another account on the internet\",\"verified\":false},\"entities\":{\"hashtags\":[],\"urls\":[\"https:\\/\\/example.com\\/a\"]}}");
+    }
+    APPEND(&b, "]}");
+    corpus_add(c, &b);
+}
+
+/* deeply nested arrays and objects */
+static void generate_nested(bench_corpus* c) {
+    bench_buffer b = { NULL, 0, 0 };
+    int i, k;
+    APPEND(&b, "[");
+    for (k = 0; k < 50; k++) {
+        if (k > 0) APPEND(&b, ",");
+        for (i = 0; i < 500; i++)
+            APPEND(&b, "{\"a\":[");
+        APPEND(&b, "true");
+        for (i = 0; i < 500; i++)
+            APPEND(&b, "]}");
+    }
+    APPEND(&b, "]");
+    corpus_add(c, &b);
+}
+
+/* one object with many members */
+static void generate_wide(bench_corpus* c) {
+    bench_buffer b = { NULL, 0, 0 };
+    int i;
+    APPEND(&b, "{");
+    for (i = 0; i < 20000; i++) {
+        if (i > 0) APPEND(&b, ",");
+        buffer_printf(&b, "\"key_%.0f\":", (double)i);
+        buffer_printf(&b, "%.0f", (double)(rng() % 100000));
+    }
+    APPEND(&b, "}");
+    corpus_add(c, &b);
+}
+
+/* newline-delimited small records, each parsed as its own document */
+static void generate_ndjson(bench_corpus* c) {
+    int i;
+    for (i = 0; i < 5000; i++) {
+        bench_buffer b = { NULL, 0, 0 };
+        APPEND(&b, "{\"ts\":");
+        buffer_printf(&b, "%.0f", 1700000000.0 + i);
+        APPEND(&b, ",\"level\":\"info\",\"msg\":\"request served\",\"latency_ms\":");
+        buffer_printf(&b, "%.3f", rng_double(0.1, 250.0));
+        APPEND(&b, ",\"tags\":[\"api\",\"v2\"],\"ok\":true}\n");
+        corpus_add(c, &b);
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* operations, each runs once over the whole corpus */
+typedef struct {
+    const char* name;
+    /* returns the time spent in the measured part, setup excluded */
+    double (*run)(const bench_corpus* c, lept_value* parsed, lept_value* scratch);
+} bench_op;
+
+static double op_parse(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t = now_ns();
+    size_t i;
+    for (i = 0; i < c->count; i++) {
+        lept_parse(&scratch[i], c->docs[i]);
+        lept_free(&scratch[i]);
+    }
+    return now_ns() - t;
+}
+
+static double op_parse_strict_utf8(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    lept_parse_options opts;
+    double t = now_ns();
+    size_t i;
+    lept_parse_options_init(&opts);
+    opts.strict_utf8 = 1;
+    for (i = 0; i < c->count; i++) {
+        lept_parse_ex(&scratch[i], c->docs[i], &opts);
+        lept_free(&scratch[i]);
+    }
+    return now_ns() - t;
+}
+
+static double op_parse_packed(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    lept_parse_options opts;
+    double t = now_ns();
+    size_t i;
+    lept_parse_options_init(&opts);
+    opts.pack_numbers = 1;
+    for (i = 0; i < c->count; i++) {
+        lept_parse_ex(&scratch[i], c->docs[i], &opts);
+        lept_free(&scratch[i]);
+    }
+    return now_ns() - t;
+}
+
+/* pass-through: parse and write back, numbers converted twice or kept as their literal */
+static double parse_stringify(const bench_corpus* c, lept_value* scratch, int lazy_numbers) {
+    lept_parse_options opts;
+    double t = now_ns();
+    size_t i;
+    lept_parse_options_init(&opts);
+    opts.lazy_numbers = lazy_numbers;
+    for (i = 0; i < c->count; i++) {
+        lept_parse_ex(&scratch[i], c->docs[i], &opts);
+        lept_free_string(lept_stringify(&scratch[i], NULL));
+        lept_free(&scratch[i]);
+    }
+    return now_ns() - t;
+}
+
+static double op_parse_stringify(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    return parse_stringify(c, scratch, 0);
+}
+
+static double op_parse_stringify_lazy(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    return parse_stringify(c, scratch, 1);
+}
+
+static double op_validate(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t = now_ns();
+    size_t i, valid = 0;
+    for (i = 0; i < c->count; i++)
+        valid += lept_validate(c->docs[i], strlen(c->docs[i]), NULL) == LEPT_PARSE_OK;
+    (void)valid;
+    return now_ns() - t;
+}
+
+/* a few fields of each corpus, as a fan-out worker would read them */
+static double op_parse_projected(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    static const char* const paths[] = { "/statuses/id_str", "/statuses/user/screen_name", "/features/properties/name", "/ts", "/level" };
+    lept_field_mask* mask = lept_field_mask_compile(paths, sizeof(paths) / sizeof(paths[0]));
+    double t = now_ns(), spent;
+    size_t i;
+    for (i = 0; i < c->count; i++) {
+        lept_parse_projected(&scratch[i], c->docs[i], mask);
+        lept_free(&scratch[i]);
+    }
+    spent = now_ns() - t;
+    lept_field_mask_free(mask);
+    return spent;
+}
+
+static double op_stringify(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t = now_ns();
+    size_t i, length;
+    for (i = 0; i < c->count; i++)
+        lept_free_string(lept_stringify(&parsed[i], &length));
+    return now_ns() - t;
+}
+
+/* the parsed documents again, through the streaming writer */
+static void write_value(lept_writer* w, const lept_value* v) {
+    lept_value tmp;
+    size_t i;
+    switch (lept_get_type(v)) {
+        case LEPT_NULL:   lept_writer_null(w); break;
+        case LEPT_FALSE:  lept_writer_bool(w, 0); break;
+        case LEPT_TRUE:   lept_writer_bool(w, 1); break;
+        case LEPT_NUMBER: lept_writer_number(w, lept_get_number(v)); break;
+        case LEPT_STRING: lept_writer_string(w, lept_get_string(v), lept_get_string_length(v)); break;
+        case LEPT_ARRAY:
+            lept_writer_begin_array(w);
+            for (i = 0; i < lept_get_array_size(v); i++)
+                write_value(w, lept_peek_array_element(v, i, &tmp));
+            lept_writer_end_array(w);
+            break;
+        case LEPT_OBJECT:
+            lept_writer_begin_object(w);
+            for (i = 0; i < lept_get_object_size(v); i++) {
+                lept_writer_key(w, lept_get_object_key(v, i), lept_get_object_key_length(v, i));
+                write_value(w, lept_peek_object_value(v, i));
+            }
+            lept_writer_end_object(w);
+            break;
+    }
+}
+
+static double op_writer(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t = now_ns();
+    lept_writer w;
+    size_t i;
+    lept_writer_init(&w, NULL, 0);
+    for (i = 0; i < c->count; i++) {
+        lept_writer_reset(&w);
+        write_value(&w, &parsed[i]);
+        lept_writer_result(&w, NULL);
+    }
+    lept_writer_free(&w);
+    return now_ns() - t;
+}
+
+static double op_copy(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t = now_ns(), spent;
+    size_t i;
+    for (i = 0; i < c->count; i++)
+        lept_copy(&scratch[i], &parsed[i]);
+    spent = now_ns() - t;
+    for (i = 0; i < c->count; i++)
+        lept_free(&scratch[i]);
+    return spent;
+}
+
+static double op_is_equal(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t, spent;
+    size_t i;
+    int equal = 1;
+    /* a second parse, copies share their blocks and would compare in O(1) */
+    for (i = 0; i < c->count; i++)
+        lept_parse(&scratch[i], c->docs[i]);
+    t = now_ns();
+    for (i = 0; i < c->count; i++)
+        equal &= lept_is_equal(&scratch[i], &parsed[i]);
+    spent = now_ns() - t;
+    for (i = 0; i < c->count; i++)
+        lept_free(&scratch[i]);
+    if (!equal)
+        fprintf(stderr, "%s: second parse is not equal to the first\n", c->name);
+    return spent;
+}
+
+static double op_hash(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t = now_ns();
+    size_t i;
+    uint64_t h = 0;
+    for (i = 0; i < c->count; i++)
+        h ^= lept_hash(&parsed[i]);
+    (void)h;
+    return now_ns() - t;
+}
+
+static double op_find(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t = now_ns();
+    size_t i, j, found = 0;
+    for (i = 0; i < c->count; i++) {
+        const lept_value* v = &parsed[i];
+        if (lept_get_type(v) != LEPT_OBJECT)
+            continue;
+        /* look every member of the root object up by key, only reading */
+        for (j = 0; j < lept_get_object_size(v); j++)
+            found += lept_peek_find_object_value(v, lept_get_object_key(v, j), lept_get_object_key_length(v, j)) != NULL;
+    }
+    (void)found;
+    return now_ns() - t;
+}
+
+/* the same lookups on frozen copies, freezing is setup */
+static double op_find_frozen(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t, spent;
+    size_t i, j, found = 0;
+    lept_snapshot** frozen = (lept_snapshot**)malloc(c->count * sizeof(lept_snapshot*));
+    for (i = 0; i < c->count; i++)
+        frozen[i] = lept_freeze(&parsed[i]);
+    t = now_ns();
+    for (i = 0; i < c->count; i++) {
+        const lept_snapshot_node* n;
+        if (frozen[i] == NULL || lept_snapshot_get_type(n = lept_snapshot_root(frozen[i])) != LEPT_OBJECT)
+            continue;
+        for (j = 0; j < lept_snapshot_get_object_size(n); j++)
+            found += lept_snapshot_find_object_value(n, lept_snapshot_get_object_key(n, j), lept_snapshot_get_object_key_length(n, j)) != NULL;
+    }
+    spent = now_ns() - t;
+    (void)found;
+    for (i = 0; i < c->count; i++)
+        lept_snapshot_close(frozen[i]);
+    free(frozen);
+    return spent;
+}
+
+static double op_free(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t;
+    size_t i;
+    for (i = 0; i < c->count; i++)
+        lept_parse(&scratch[i], c->docs[i]);
+    t = now_ns();
+    for (i = 0; i < c->count; i++)
+        lept_free(&scratch[i]);
+    return now_ns() - t;
+}
+
+/* the cost left on the calling thread, the reclaimer is drained outside the measurement */
+static double op_free_deferred(const bench_corpus* c, lept_value* parsed, lept_value* scratch) {
+    double t, spent;
+    size_t i;
+    for (i = 0; i < c->count; i++)
+        lept_parse(&scratch[i], c->docs[i]);
+    t = now_ns();
+    for (i = 0; i < c->count; i++)
+        lept_free_deferred(&scratch[i]);
+    spent = now_ns() - t;
+    lept_reclaim_flush();
+    return spent;
+}
+
+static const bench_op ops[] = {
+    { "parse", op_parse },
+    { "parse_strict_utf8", op_parse_strict_utf8 },
+    { "parse_packed", op_parse_packed },
+    { "parse_projected", op_parse_projected },
+    { "parse_stringify", op_parse_stringify },
+    { "parse_stringify_lazy", op_parse_stringify_lazy },
+    { "validate", op_validate },
+    { "stringify", op_stringify },
+    { "writer", op_writer },
+    { "copy", op_copy },
+    { "is_equal", op_is_equal },
+    { "hash", op_hash },
+    { "find_object_value", op_find },
+    { "find_frozen", op_find_frozen },
+    { "free", op_free },
+    { "free_deferred", op_free_deferred }
+};
+
+int main(int argc, char** argv) {
+    bench_corpus corpora[5];
+    void (*generators[5])(bench_corpus*) = { generate_geo, generate_tweets, generate_nested, generate_wide, generate_ndjson };
+    const char* names[5] = { "geo", "tweets", "nested", "wide", "ndjson" };
+    const char* filter = NULL, *threads = "1", *t;
+    double min_time_ns = 2e8;
+    int json = 0, first = 1, i;
+    size_t k, j;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0)
+            json = 1;
+        else if (strcmp(argv[i], "--min-time-ms") == 0 && i + 1 < argc)
+            min_time_ns = atof(argv[++i]) * 1e6;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [--json] [--min-time-ms N] [--filter CORPUS] [--threads N[,N...]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (json)
+        printf("{\"benchmarks\":[");
+    else
+        printf("%-8s %-18s %7s %12s %10s %12s\n", "corpus", "op", "threads", "bytes", "MB/s", "ns/op");
+    for (k = 0; k < 5; k++) {
+        bench_corpus* c = &corpora[k];
+        lept_value* parsed, *scratch;
+        c->name = names[k];
+        c->docs = NULL;
+        c->count = c->bytes = 0;
+        if (filter != NULL && strcmp(filter, c->name) != 0)
+            continue;
+        rng_state = RNG_SEED;
+        generators[k](c);
+        parsed = (lept_value*)malloc(c->count * sizeof(lept_value));
+        scratch = (lept_value*)malloc(c->count * sizeof(lept_value));
+        for (j = 0; j < c->count; j++) {
+            lept_init(&parsed[j]);
+            lept_init(&scratch[j]);
+            if (lept_parse(&parsed[j], c->docs[j]) != LEPT_PARSE_OK)
+                fprintf(stderr, "%s: document %lu does not parse\n", c->name, (unsigned long)j);
+        }
+        /* every op once per thread count of the comma-separated list, to show the speedup */
+        for (t = threads; *t != '\0'; t += strcspn(t, ","), t += *t == ',') {
+            unsigned long n = strtoul(t, NULL, 10);
+            if (lept_set_threads(n) != 0) {
+                fprintf(stderr, "cannot start %lu threads\n", n);
+                continue;
+            }
+            for (j = 0; j < sizeof(ops) / sizeof(ops[0]); j++) {
+                double spent = 0, ns_per_op, mb_per_s;
+                unsigned long iterations = 0;
+                /* warm up, then repeat until the measured time is long enough */
+                ops[j].run(c, parsed, scratch);
+                while (spent < min_time_ns) {
+                    spent += ops[j].run(c, parsed, scratch);
+                    iterations++;
+                }
+                ns_per_op = spent / iterations;
+                mb_per_s = c->bytes / (ns_per_op / 1e9) / (1024.0 * 1024.0);
+                if (json)
+                    printf("%s\n{\"corpus\":\"%s\",\"op\":\"%s\",\"threads\":%lu,\"bytes\":%lu,\"iterations\":%lu,\"ns_per_op\":%.0f,\"mb_per_s\":%.2f}",
+                        first ? "" : ",", c->name, ops[j].name, n, (unsigned long)c->bytes, iterations, ns_per_op, mb_per_s);
+                else
+                    printf("%-8s %-18s %7lu %12lu %10.2f %12.0f\n", c->name, ops[j].name, n, (unsigned long)c->bytes, mb_per_s, ns_per_op);
+                first = 0;
+            }
+        }
+        lept_set_threads(0);
+        for (j = 0; j < c->count; j++) {
+            lept_free(&parsed[j]);
+            free(c->docs[j]);
+        }
+        free(c->docs);
+        free(parsed);
+        free(scratch);
+    }
+    if (json)
+        printf("\n]}\n");
+    lept_reclaim_shutdown();
+    lept_parse_cleanup();
+    return 0;
+}
@@ -4,9 +4,21 @@
 #include <stdlib.h>  /* NULL, malloc(), realloc(), free(), strtod() */
 #include <assert.h>  /* assert() */
 #include <errno.h>   /* errno, ERANGE */
+#include <float.h>   /* FLT_MAX */
 #include <math.h>    /* HUGE_VAL */
 #include <stdio.h>   /* sprintf() */
 #include <string.h>  /* memcpy() */
+#include <stdint.h>  /* uint8_t, uint16_t, uint32_t, uint64_t, uintptr_t */
+#if defined(__unix__) || defined(__APPLE__)
+#define LEPT_HAVE_MMAP
+#include <fcntl.h>    /* open() */
+#include <sys/mman.h> /* mmap(), munmap() */
+#include <sys/stat.h> /* fstat() */
+#include <unistd.h>   /* close() */
+#define LEPT_HAVE_THREADS
+#include <pthread.h>  /* pthread_create(), pthread_mutex_lock() */
+#include <sched.h>    /* sched_yield() */
+#endif
 
 /**************************************************************
 JSON-text: ws value ws
@@ -54,6 +66,47 @@ JSON-text: ws value ws
 #define LEPT_PARSE_STACK_INIT_SIZE 256
 #endif
 
+/* The max nesting depth of lept_parse() and of lept_parse_options_init(), the values are freed,
+   copied and written recursively */
+#ifndef LEPT_PARSE_MAX_DEPTH
+#define LEPT_PARSE_MAX_DEPTH 1024
+#endif
+
+/* The max nesting depth accepted by the binary decoders */
+#ifndef LEPT_DECODE_MAX_DEPTH
+#define LEPT_DECODE_MAX_DEPTH 1024
+#endif
+
+/* Containers with fewer elements than this are walked by the calling thread alone */
+#ifndef LEPT_PARALLEL_GRAIN
+#define LEPT_PARALLEL_GRAIN 4096
+#endif
+
+/* The max number of tasks a container is split into */
+#ifndef LEPT_PARALLEL_MAX_TASKS
+#define LEPT_PARALLEL_MAX_TASKS 64
+#endif
+
+/* The max number of documents waiting for the reclaimer thread */
+#ifndef LEPT_RECLAIM_QUEUE_SIZE
+#define LEPT_RECLAIM_QUEUE_SIZE 1024
+#endif
+
+/* The nesting depth lept_validate() tracks without allocating */
+#ifndef LEPT_VALIDATE_STACK_DEPTH
+#define LEPT_VALIDATE_STACK_DEPTH 4096
+#endif
+
+/* Objects with at most this many members are checked for duplicate keys without a hash table */
+#ifndef LEPT_DEDUPE_SCAN_MAX
+#define LEPT_DEDUPE_SCAN_MAX 8
+#endif
+
+/* Snapshot objects with at least this many members get an index of their keys */
+#ifndef LEPT_SNAPSHOT_INDEX_MIN
+#define LEPT_SNAPSHOT_INDEX_MIN 8
+#endif
+
 /* The initial allocated string size */
 #ifndef LEPT_PARSE_STRINGIFY_INIT_SIZE
 #define LEPT_PARSE_STRINGIFY_INIT_SIZE 256
@@ -67,10 +120,15 @@ JSON-text: ws value ws
 #define ISDIGIT1TO9(ch) ((ch) >= '1' && (ch) <= '9')
 /* Determine if it‘s a hex number */
 #define ISHEX(ch) (ISDIGIT(ch) || ((ch) >= 'A' && (ch) <= 'F') || ((ch) >= 'a' && (ch) <= 'f'))
-/* push single character onto the stack */
-#define PUTC(c, ch) do { *(char*)lept_context_push(c, sizeof(char)) = (ch); } while(0)
+/* nonzero if a byte of the word is zero / below n (n <= 128) / not ASCII, eight bytes at a time */
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HAS_ZERO(x) (((x) - SWAR_ONES) & ~(x) & (SWAR_ONES * 0x80))
+#define SWAR_HAS_LESS(x, n) (((x) - SWAR_ONES * (n)) & ~(x) & (SWAR_ONES * 0x80))
+#define SWAR_HAS_HIGH(x) ((x) & (SWAR_ONES * 0x80))
+/* push single character onto the stack, nothing is pushed once the stack is out of memory */
+#define PUTC(c, ch) do { char* top_ = (char*)lept_context_push(c, sizeof(char)); if (top_) *top_ = (ch); } while(0)
 /* push string onto the stack */
-#define PUTS(c, s, len) memcpy(lept_context_push(c, len), s, len)
+#define PUTS(c, s, len) do { void* top_ = lept_context_push(c, len); if (top_) memcpy(top_, s, len); } while(0)
 
 /* string error */
 #define STRING_ERROR(ret) do { c->top = head; return ret; } while(0)
@@ -81,32 +139,211 @@ typedef struct {
     /* input output buffers (dynamic stack) */
     char* stack;
     size_t size, top;
+    /* allocator of the stack, set when a push could not grow the stack */
+    const lept_allocator* alloc;
+    int oom;
+    /* offset of the innermost open container frame on the stack */
+    size_t frame;
+    /* number of open containers, number of values parsed so far */
+    size_t depth, nodes;
+    /* parse limits */
+    const lept_parse_options* opts;
+    /* schema checked while parsing, required members seen in the object just closed */
+    const lept_schema* schema;
+    uint64_t seen;
+    /* members to build, the others are only validated */
+    const lept_field_mask* fields;
 } lept_context;
 
+/* Open container, kept on the stack below its elements */
+typedef struct {
+    size_t prev;      /* offset of the enclosing frame */
+    size_t size;      /* elements or members pushed so far */
+    lept_type type;   /* LEPT_ARRAY or LEPT_OBJECT */
+    char* k; size_t klen; /* pending member key of an object */
+    size_t node, child;   /* schema nodes of the container and of its next element or member */
+    uint64_t seen;        /* required members seen so far */
+    size_t mask, mchild;  /* field mask nodes of the container and of its next element or member */
+} lept_frame;
+
+/* there is no open container */
+#define LEPT_NO_FRAME ((size_t)-1)
+/* innermost open container, the stack may move so do not keep the pointer across pushes */
+#define FRAME(c) ((lept_frame*)((c)->stack + (c)->frame))
+
+/* no limits but the depth */
+static const lept_parse_options lept_default_options = { LEPT_PARSE_MAX_DEPTH, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, 0, LEPT_DUPLICATE_KEEP_ALL, 0, 0 };
+
+/* record a block allocated for the document being parsed, header included */
+#define STATS_ALLOC(c, bytes) do { if ((c)->opts->stats) { (c)->opts->stats->allocations++; (c)->opts->stats->bytes_allocated += sizeof(lept_block) + (bytes); } } while(0)
+/* record the scratch stack use before it shrinks */
+#define STATS_PEAK(c) do { if ((c)->opts->stats && (c)->top > (c)->opts->stats->stack_high_water) (c)->opts->stats->stack_high_water = (c)->top; } while(0)
+
+#if defined(_MSC_VER)
+#define LEPT_THREAD_LOCAL __declspec(thread)
+#else
+#define LEPT_THREAD_LOCAL _Thread_local
+#endif
+
+/* default parser of the calling thread, used by lept_parse() */
+static LEPT_THREAD_LOCAL lept_parser lept_default_parser;
+
+/* the C library allocator */
+static void* lept_std_malloc(void* ctx, size_t size) { return malloc(size); }
+static void* lept_std_realloc(void* ctx, void* ptr, size_t old_size, size_t size) { return realloc(ptr, size); }
+static void lept_std_free(void* ctx, void* ptr) { free(ptr); }
+static const lept_allocator lept_std_allocator = { lept_std_malloc, lept_std_realloc, lept_std_free, NULL };
+
+/* allocator of new blocks: the one used by the calling thread if any, else the global one */
+static const lept_allocator* lept_global_allocator = &lept_std_allocator;
+static LEPT_THREAD_LOCAL const lept_allocator* lept_thread_allocator;
+#define CURRENT_ALLOCATOR() (lept_thread_allocator ? lept_thread_allocator : lept_global_allocator)
+
+/* Header in front of every block owned by a value, so it is freed by the allocator that made it */
+typedef struct {
+    const lept_allocator* alloc;
+    size_t size; /* bytes after the header */
+    size_t refs; /* values sharing the block, see lept_copy() */
+    uint64_t hash; /* lept_hash() of the string / container of the block, or the bits of a converted
+                      number literal, 0 until computed */
+} lept_block;
+
+#define BLOCK_OF(p) ((lept_block*)(p) - 1)
+
+/* hash of a container block an element pointer to write through was handed out of, such a block
+   may be written behind its back for as long as it lives, so its hash is never kept */
+#define LEPT_HASH_OPEN 1
+
+/* reference counts may be dropped by several threads holding copies of one document */
+#if defined(__GNUC__) || defined(__clang__)
+#define REF_LOAD(r) __atomic_load_n(&(r), __ATOMIC_ACQUIRE)
+#define REF_INC(r) __atomic_add_fetch(&(r), 1, __ATOMIC_RELAXED)
+#define REF_DEC(r) __atomic_sub_fetch(&(r), 1, __ATOMIC_ACQ_REL)
+/* cached hashes of shared blocks may be filled in by several readers at once, all with the same value */
+#define HASH_LOAD(h) __atomic_load_n(&(h), __ATOMIC_RELAXED)
+#define HASH_STORE(h, x) __atomic_store_n(&(h), (x), __ATOMIC_RELAXED)
+#else
+#define REF_LOAD(r) (r)
+#define REF_INC(r) (++(r))
+#define REF_DEC(r) (--(r))
+#define HASH_LOAD(h) (h)
+#define HASH_STORE(h, x) ((h) = (x))
+#endif
+/* the block is referenced by more than one value and must not be written */
+#define BLOCK_SHARED(p) ((p) != NULL && REF_LOAD(BLOCK_OF(p)->refs) > 1)
+
+/* allocate a block, returns the memory after the header or NULL */
+static void* lept_block_alloc(const lept_allocator* a, size_t size) {
+    lept_block* b = (lept_block*)a->malloc(a->ctx, sizeof(lept_block) + size);
+    if (b == NULL)
+        return NULL;
+    b->alloc = a;
+    b->size = size;
+    b->refs = 1;
+    b->hash = 0;
+    return b + 1;
+}
+
+/* resize an unshared block with its own allocator, p is left untouched on failure */
+static void* lept_block_realloc(void* p, size_t size) {
+    lept_block* b = BLOCK_OF(p);
+    const lept_allocator* a = b->alloc;
+    if ((b = (lept_block*)a->realloc(a->ctx, b, sizeof(lept_block) + b->size, sizeof(lept_block) + size)) == NULL)
+        return NULL;
+    b->size = size;
+    return b + 1;
+}
+
+static void lept_block_free(void* p) {
+    if (p != NULL) {
+        lept_block* b = BLOCK_OF(p);
+        b->alloc->free(b->alloc->ctx, b);
+    }
+}
+
+/* take one more reference to a block */
+static void lept_block_retain(void* p) {
+    if (p != NULL)
+        REF_INC(BLOCK_OF(p)->refs);
+}
+
+/* drop a reference, returns nonzero when it was the last one and the caller frees the block */
+static int lept_block_release(void* p) {
+    /* nobody else can take a reference to a block only we hold */
+    return p != NULL && (REF_LOAD(BLOCK_OF(p)->refs) == 1 || REF_DEC(BLOCK_OF(p)->refs) == 0);
+}
+
+/* drop a reference to a string or key block */
+static void lept_block_drop(void* p) {
+    if (lept_block_release(p))
+        lept_block_free(p);
+}
+
+/* element i of an array for reading, the one of a packed array is made up in *tmp */
+static const lept_value* lept_array_at(const lept_value* v, size_t i, lept_value* tmp) {
+    if (!v->packed)
+        return &v->a.e[i];
+    tmp->type = LEPT_NUMBER;
+    tmp->literal = 0;
+    tmp->n = v->p.d[i];
+    return tmp;
+}
+
+/* copy len bytes into a NUL-terminated block */
+static char* lept_block_strdup(const lept_allocator* a, const char* s, size_t len) {
+    char* k = (char*)lept_block_alloc(a, len + 1);
+    if (k != NULL) {
+        if (len > 0)
+            memcpy(k, s, len);
+        k[len] = '\0';
+    }
+    return k;
+}
+
+/* start an empty output stack */
+static void lept_context_init(lept_context* c, const lept_allocator* a) {
+    c->stack = NULL;
+    c->size = c->top = 0;
+    c->alloc = a;
+    c->oom = 0;
+}
+
+/* hand the output stack over to the caller, NULL if a push failed on the way */
+static char* lept_context_finish(lept_context* c) {
+    if (c->oom) {
+        if (c->stack != NULL)
+            c->alloc->free(c->alloc->ctx, c->stack);
+        return NULL;
+    }
+    return c->stack;
+}
+
 /* return the memory address of the top of the stack */
 static void* lept_context_push(lept_context* c, size_t size) {
+    void* ret;
     /* check the stack size */
     assert(size > 0);
-    void* ret;
     /* check the stack size */
     if (c->top + size >= c->size) {
-        /* double the stack size */
-        if (c->size == 0) {
-            c->size = LEPT_PARSE_STACK_INIT_SIZE;
+        size_t new_size = c->size;
+        char *tmp;
+        /* grow the stack size by 1.5x until the new data fits */
+        if (new_size == 0) {
+            new_size = LEPT_PARSE_STACK_INIT_SIZE;
         }
-        while (c->top + size >= c->size) {
-            c->size += c->size >> 1;  /* c->size * 1.5 */
+        while (c->top + size >= new_size) {
+            new_size += new_size >> 1;  /* new_size * 1.5 */
         }
-        /* allocate memory */
-        char *tmp;
-        if (!(tmp = (char*)realloc(c->stack, c->size))) {
-            /* reallocation failed, free previously allocated memory and exit */
-            free(c->stack);
-            fprintf(stderr, "Error: unable to allocate memory\n");
-            exit(EXIT_FAILURE);
+        /* allocate memory, realloc releases the old block by itself on success */
+        tmp = c->stack == NULL ? (char*)c->alloc->malloc(c->alloc->ctx, new_size)
+                               : (char*)c->alloc->realloc(c->alloc->ctx, c->stack, c->size, new_size);
+        if (tmp == NULL) {
+            /* keep the old stack, the caller reports the failure */
+            c->oom = 1;
+            return NULL;
         }
-        free(c->stack);
         c->stack = tmp;
+        c->size = new_size;
     }
     /* returns the memory address of the top of the stack */
     ret = c->stack + c->top;
@@ -122,6 +359,415 @@ static void* lept_context_pop(lept_context* c, size_t size) {
     return c->stack + (c->top -= size);
 }
 
+/* Schema node: the checks of one (sub)schema */
+typedef struct {
+    unsigned types;           /* 1 << lept_type of every accepted type */
+    int flags;                /* LEPT_SCHEMA_* */
+    double minimum, maximum;
+    size_t max_length;        /* in code points */
+    lept_value enumeration;   /* array of accepted values */
+    size_t props, nprops;     /* members described by properties or required, in lept_schema::props */
+    uint64_t required;        /* bit i set when props + i is required */
+    size_t items;             /* node of the elements */
+} lept_schema_node;
+
+typedef struct {
+    const char* k; size_t klen; /* points into lept_schema::source */
+    size_t node;
+} lept_schema_prop;
+
+struct lept_schema {
+    const lept_allocator* alloc;
+    lept_value source;        /* shared copy of the schema, keeps keys alive */
+    lept_schema_node* nodes; size_t count, capacity;
+    lept_schema_prop* props; size_t pcount, pcapacity;
+};
+
+#define LEPT_SCHEMA_INTEGER    0x01
+#define LEPT_SCHEMA_MINIMUM    0x02
+#define LEPT_SCHEMA_MAXIMUM    0x04
+#define LEPT_SCHEMA_MAX_LENGTH 0x08
+#define LEPT_SCHEMA_ENUM       0x10
+/* no constraint, and the bits of every type */
+#define LEPT_SCHEMA_NONE ((size_t)-1)
+#define LEPT_SCHEMA_ANY_TYPE ((1u << (LEPT_OBJECT + 1)) - 1)
+
+/* grow one of the arrays of a schema, returns 0 when out of memory */
+static int lept_schema_grow(const lept_allocator* a, void** p, size_t* capacity, size_t count, size_t size) {
+    size_t n = *capacity;
+    void* q;
+    if (count <= n)
+        return 1;
+    while (n < count)
+        n = n ? n + (n >> 1) : 8;
+    if ((q = *p ? a->realloc(a->ctx, *p, *capacity * size, n * size) : a->malloc(a->ctx, n * size)) == NULL)
+        return 0;
+    *p = q;
+    *capacity = n;
+    return 1;
+}
+
+static const lept_value* lept_schema_keyword(const lept_value* schema, const char* key) {
+    size_t i = lept_find_object_index(schema, key, strlen(key));
+    return i != LEPT_KEY_NOT_EXIST ? &schema->o.m[i].v : NULL;
+}
+
+/* type bits of a type name */
+static unsigned lept_schema_type(const lept_value* t, int* integer) {
+    static const struct { const char* name; unsigned bits; } names[] = {
+        { "null", 1u << LEPT_NULL }, { "boolean", (1u << LEPT_FALSE) | (1u << LEPT_TRUE) },
+        { "number", 1u << LEPT_NUMBER }, { "integer", 1u << LEPT_NUMBER }, { "string", 1u << LEPT_STRING },
+        { "array", 1u << LEPT_ARRAY }, { "object", 1u << LEPT_OBJECT }
+    };
+    size_t i;
+    if (t->type == LEPT_STRING)
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+            if (strlen(names[i].name) == t->s.len && memcmp(names[i].name, t->s.s, t->s.len) == 0) {
+                *integer = i == 3;
+                return names[i].bits;
+            }
+    return 0;
+}
+
+/* whole number test without libm, every finite double beyond 2^53 is whole */
+static int lept_schema_integral(double d) {
+    if (d > -9007199254740992.0 && d < 9007199254740992.0)
+        return d == (double)(int64_t)d;
+    return d - d == 0.0;
+}
+
+/* compile one (sub)schema, returns its node or LEPT_SCHEMA_NONE when it is malformed */
+static size_t lept_schema_compile_node(lept_schema* s, const lept_value* schema) {
+    const lept_value* kw, *props, *required;
+    lept_value tmp;
+    lept_schema_node* n;
+    size_t index = s->count, i, j, first;
+    unsigned bits;
+    int integer, any_number = 0;
+    if (!lept_schema_grow(s->alloc, (void**)&s->nodes, &s->capacity, s->count + 1, sizeof(lept_schema_node)))
+        return LEPT_SCHEMA_NONE;
+    n = &s->nodes[s->count++];
+    memset(n, 0, sizeof(*n));
+    lept_init(&n->enumeration);
+    n->types = LEPT_SCHEMA_ANY_TYPE;
+    n->items = LEPT_SCHEMA_NONE;
+    /* true accepts anything, false nothing */
+    if (schema->type == LEPT_TRUE || schema->type == LEPT_FALSE) {
+        n->types = schema->type == LEPT_TRUE ? LEPT_SCHEMA_ANY_TYPE : 0;
+        return index;
+    }
+    if (schema->type != LEPT_OBJECT)
+        return LEPT_SCHEMA_NONE;
+    if ((kw = lept_schema_keyword(schema, "type")) != NULL) {
+        n->types = 0;
+        if (kw->type == LEPT_ARRAY) {
+            for (i = 0; i < kw->a.size; i++) {
+                if ((bits = lept_schema_type(lept_array_at(kw, i, &tmp), &integer)) == 0)
+                    return LEPT_SCHEMA_NONE;
+                n->types |= bits;
+                any_number |= (bits == 1u << LEPT_NUMBER && !integer);
+                if (integer)
+                    n->flags |= LEPT_SCHEMA_INTEGER;
+            }
+        }
+        else if ((n->types = lept_schema_type(kw, &integer)) == 0)
+            return LEPT_SCHEMA_NONE;
+        else if (integer)
+            n->flags |= LEPT_SCHEMA_INTEGER;
+        /* "number" accepts what "integer" would reject */
+        if (any_number)
+            n->flags &= ~LEPT_SCHEMA_INTEGER;
+    }
+    if ((kw = lept_schema_keyword(schema, "minimum")) != NULL) {
+        if (kw->type != LEPT_NUMBER)
+            return LEPT_SCHEMA_NONE;
+        n->flags |= LEPT_SCHEMA_MINIMUM;
+        n->minimum = lept_get_number(kw);
+    }
+    if ((kw = lept_schema_keyword(schema, "maximum")) != NULL) {
+        if (kw->type != LEPT_NUMBER)
+            return LEPT_SCHEMA_NONE;
+        n->flags |= LEPT_SCHEMA_MAXIMUM;
+        n->maximum = lept_get_number(kw);
+    }
+    if ((kw = lept_schema_keyword(schema, "maxLength")) != NULL) {
+        if (kw->type != LEPT_NUMBER || lept_get_number(kw) < 0 || !lept_schema_integral(lept_get_number(kw)))
+            return LEPT_SCHEMA_NONE;
+        n->flags |= LEPT_SCHEMA_MAX_LENGTH;
+        n->max_length = lept_get_number(kw) >= (double)LEPT_SCHEMA_NONE ? LEPT_SCHEMA_NONE : (size_t)lept_get_number(kw);
+    }
+    if ((kw = lept_schema_keyword(schema, "enum")) != NULL) {
+        if (kw->type != LEPT_ARRAY)
+            return LEPT_SCHEMA_NONE;
+        n->flags |= LEPT_SCHEMA_ENUM;
+        lept_copy(&n->enumeration, kw);
+    }
+    /* one slot per property and per required member, so presence is tracked by slot */
+    props = lept_schema_keyword(schema, "properties");
+    required = lept_schema_keyword(schema, "required");
+    if ((props && props->type != LEPT_OBJECT) || (required && required->type != LEPT_ARRAY))
+        return LEPT_SCHEMA_NONE;
+    first = s->pcount;
+    if (props) {
+        if (!lept_schema_grow(s->alloc, (void**)&s->props, &s->pcapacity, s->pcount + props->o.size, sizeof(lept_schema_prop)))
+            return LEPT_SCHEMA_NONE;
+        for (i = 0; i < props->o.size; i++) {
+            s->props[s->pcount].k = props->o.m[i].k;
+            s->props[s->pcount].klen = props->o.m[i].klen;
+            s->props[s->pcount++].node = LEPT_SCHEMA_NONE;
+        }
+    }
+    if (required) {
+        for (i = 0; i < required->a.size; i++) {
+            const lept_value* r = lept_array_at(required, i, &tmp);
+            if (r->type != LEPT_STRING)
+                return LEPT_SCHEMA_NONE;
+            for (j = first; j < s->pcount; j++)
+                if (s->props[j].klen == r->s.len && memcmp(s->props[j].k, r->s.s, r->s.len) == 0)
+                    break;
+            if (j == s->pcount) {
+                if (!lept_schema_grow(s->alloc, (void**)&s->props, &s->pcapacity, s->pcount + 1, sizeof(lept_schema_prop)))
+                    return LEPT_SCHEMA_NONE;
+                s->props[s->pcount].k = r->s.s;
+                s->props[s->pcount].klen = r->s.len;
+                s->props[s->pcount++].node = LEPT_SCHEMA_NONE;
+            }
+            /* presence is a 64-bit mask */
+            if (j - first >= 64)
+                return LEPT_SCHEMA_NONE;
+            s->nodes[index].required |= (uint64_t)1 << (j - first);
+        }
+    }
+    s->nodes[index].props = first;
+    s->nodes[index].nprops = s->pcount - first;
+    /* the subschemas are appended after the slots of this node */
+    if (props)
+        for (i = 0; i < props->o.size; i++) {
+            size_t child = lept_schema_compile_node(s, &props->o.m[i].v);
+            if (child == LEPT_SCHEMA_NONE)
+                return LEPT_SCHEMA_NONE;
+            s->props[first + i].node = child;
+        }
+    if ((kw = lept_schema_keyword(schema, "items")) != NULL) {
+        size_t child = lept_schema_compile_node(s, kw);
+        if (child == LEPT_SCHEMA_NONE)
+            return LEPT_SCHEMA_NONE;
+        s->nodes[index].items = child;
+    }
+    return index;
+}
+
+lept_schema* lept_schema_compile(const lept_value* schema) {
+    const lept_allocator* a = CURRENT_ALLOCATOR();
+    lept_schema* s;
+    assert(schema != NULL);
+    if ((s = (lept_schema*)a->malloc(a->ctx, sizeof(lept_schema))) == NULL)
+        return NULL;
+    s->alloc = a;
+    lept_init(&s->source);
+    lept_copy(&s->source, schema);
+    s->nodes = NULL;
+    s->props = NULL;
+    s->count = s->capacity = s->pcount = s->pcapacity = 0;
+    if (lept_schema_compile_node(s, &s->source) == LEPT_SCHEMA_NONE) {
+        lept_schema_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void lept_schema_free(lept_schema* s) {
+    size_t i;
+    if (s == NULL)
+        return;
+    for (i = 0; i < s->count; i++)
+        lept_free(&s->nodes[i].enumeration);
+    lept_free(&s->source);
+    if (s->nodes)
+        s->alloc->free(s->alloc->ctx, s->nodes);
+    if (s->props)
+        s->alloc->free(s->alloc->ctx, s->props);
+    s->alloc->free(s->alloc->ctx, s);
+}
+
+/* node of the member key of an object node and its slot, LEPT_SCHEMA_NONE for both if it is not described */
+static size_t lept_schema_member(const lept_schema* s, size_t node, const char* k, size_t klen, size_t* slot) {
+    const lept_schema_node* n;
+    size_t i;
+    *slot = LEPT_SCHEMA_NONE;
+    if (node == LEPT_SCHEMA_NONE)
+        return LEPT_SCHEMA_NONE;
+    n = &s->nodes[node];
+    for (i = 0; i < n->nprops; i++) {
+        const lept_schema_prop* p = &s->props[n->props + i];
+        if (p->klen == klen && memcmp(p->k, k, klen) == 0) {
+            *slot = i;
+            return p->node;
+        }
+    }
+    return LEPT_SCHEMA_NONE;
+}
+
+/* check a complete value against a node, returns the violated keyword or NULL */
+static const char* lept_schema_check(const lept_schema* s, size_t node, const lept_value* v, uint64_t seen) {
+    const lept_schema_node* n;
+    lept_value tmp;
+    size_t i, len;
+    if (node == LEPT_SCHEMA_NONE)
+        return NULL;
+    n = &s->nodes[node];
+    if (!(n->types & (1u << v->type)))
+        return "type";
+    switch (v->type) {
+        case LEPT_NUMBER:
+            if ((n->flags & LEPT_SCHEMA_INTEGER) && !lept_schema_integral(lept_get_number(v)))
+                return "type";
+            if ((n->flags & LEPT_SCHEMA_MINIMUM) && lept_get_number(v) < n->minimum)
+                return "minimum";
+            if ((n->flags & LEPT_SCHEMA_MAXIMUM) && lept_get_number(v) > n->maximum)
+                return "maximum";
+            break;
+        case LEPT_STRING:
+            if (n->flags & LEPT_SCHEMA_MAX_LENGTH) {
+                /* count code points, not continuation bytes */
+                for (i = len = 0; i < v->s.len; i++)
+                    len += ((unsigned char)v->s.s[i] & 0xC0) != 0x80;
+                if (len > n->max_length)
+                    return "maxLength";
+            }
+            break;
+        case LEPT_OBJECT:
+            if ((seen & n->required) != n->required)
+                return "required";
+            break;
+        default: break;
+    }
+    if (n->flags & LEPT_SCHEMA_ENUM) {
+        for (i = 0; i < n->enumeration.a.size; i++)
+            if (lept_is_equal(v, lept_array_at(&n->enumeration, i, &tmp)))
+                return NULL;
+        return "enum";
+    }
+    return NULL;
+}
+
+/* node of a field mask, a trie of the selected paths */
+typedef struct {
+    char* k; size_t klen;   /* decoded reference token, NULL for the root */
+    size_t child, next;     /* first child and next sibling */
+    int all;                /* a path ends here, the whole value is selected */
+} lept_mask_node;
+
+struct lept_field_mask {
+    const lept_allocator* alloc;
+    lept_mask_node* nodes; size_t count, capacity;
+};
+
+/* the member is not selected / the whole value is selected */
+#define LEPT_MASK_NONE ((size_t)-1)
+#define LEPT_MASK_ALL ((size_t)-2)
+
+/* child of node named by the reference token tok[0, n), added if it is not there yet */
+static size_t lept_mask_add(lept_field_mask* m, size_t node, const char* tok, size_t n) {
+    lept_mask_node* child;
+    char* k;
+    size_t i, j;
+    if ((k = (char*)lept_block_alloc(m->alloc, n + 1)) == NULL)
+        return LEPT_MASK_NONE;
+    for (i = j = 0; i < n; i++, j++) {
+        if (tok[i] != '~')
+            k[j] = tok[i];
+        else if (i + 1 < n && (tok[i + 1] == '0' || tok[i + 1] == '1'))
+            k[j] = tok[++i] == '0' ? '~' : '/';
+        else {
+            lept_block_free(k);
+            return LEPT_MASK_NONE;
+        }
+    }
+    k[j] = '\0';
+    for (i = m->nodes[node].child; i != LEPT_MASK_NONE; i = m->nodes[i].next)
+        if (m->nodes[i].klen == j && memcmp(m->nodes[i].k, k, j) == 0) {
+            lept_block_free(k);
+            return i;
+        }
+    if (!lept_schema_grow(m->alloc, (void**)&m->nodes, &m->capacity, m->count + 1, sizeof(lept_mask_node))) {
+        lept_block_free(k);
+        return LEPT_MASK_NONE;
+    }
+    child = &m->nodes[m->count];
+    child->k = k;
+    child->klen = j;
+    child->child = LEPT_MASK_NONE;
+    child->next = m->nodes[node].child;
+    child->all = 0;
+    m->nodes[node].child = m->count;
+    return m->count++;
+}
+
+lept_field_mask* lept_field_mask_compile(const char* const* paths, size_t count) {
+    const lept_allocator* a = CURRENT_ALLOCATOR();
+    lept_field_mask* m;
+    size_t i, node, n;
+    const char* p;
+    assert(paths != NULL || count == 0);
+    if ((m = (lept_field_mask*)a->malloc(a->ctx, sizeof(lept_field_mask))) == NULL)
+        return NULL;
+    m->alloc = a;
+    m->nodes = NULL;
+    m->count = m->capacity = 0;
+    if (!lept_schema_grow(a, (void**)&m->nodes, &m->capacity, 1, sizeof(lept_mask_node))) {
+        lept_field_mask_free(m);
+        return NULL;
+    }
+    m->nodes[0].k = NULL;
+    m->nodes[0].klen = 0;
+    m->nodes[0].child = m->nodes[0].next = LEPT_MASK_NONE;
+    m->nodes[0].all = 0;
+    m->count = 1;
+    for (i = 0; i < count; i++) {
+        for (p = paths[i], node = 0; *p == '/'; p += n) {
+            n = strcspn(++p, "/");
+            if ((node = lept_mask_add(m, node, p, n)) == LEPT_MASK_NONE) {
+                lept_field_mask_free(m);
+                return NULL;
+            }
+        }
+        /* a path is empty or starts with '/' */
+        if (*p != '\0') {
+            lept_field_mask_free(m);
+            return NULL;
+        }
+        m->nodes[node].all = 1;
+    }
+    return m;
+}
+
+void lept_field_mask_free(lept_field_mask* m) {
+    size_t i;
+    if (m == NULL)
+        return;
+    for (i = 1; i < m->count; i++)
+        lept_block_free(m->nodes[i].k);
+    if (m->nodes)
+        m->alloc->free(m->alloc->ctx, m->nodes);
+    m->alloc->free(m->alloc->ctx, m);
+}
+
+/* node selecting the member key of node, LEPT_MASK_NONE when the member is not selected */
+static size_t lept_mask_member(const lept_field_mask* m, size_t node, const char* k, size_t klen) {
+    size_t i;
+    if (node == LEPT_MASK_ALL)
+        return LEPT_MASK_ALL;
+    for (i = m->nodes[node].child; i != LEPT_MASK_NONE; i = m->nodes[i].next)
+        if (m->nodes[i].klen == klen && memcmp(m->nodes[i].k, k, klen) == 0)
+            return m->nodes[i].all ? LEPT_MASK_ALL : i;
+    return LEPT_MASK_NONE;
+}
+
+/* field mask node of the value about to be parsed, arrays pass the node of the array on to every element */
+#define MASK_NODE(c) ((c)->frame != LEPT_NO_FRAME ? FRAME(c)->mchild :\
+    (c)->fields == NULL || (c)->fields->nodes[0].all ? LEPT_MASK_ALL : 0)
+
 /* parse whitespace between the context */
 static void lept_parse_whitespace(lept_context* c) {
     const char* p = c->json;
@@ -151,9 +797,10 @@ static int lept_parse_literal(lept_context* c, lept_value* v, const char* litera
     return LEPT_PARSE_OK;
 }
 
-/* parse number */
+/* parse number, only checking it when v is NULL */
 static int lept_parse_number(lept_context* c, lept_value* v) {
     const char* p = c->json;
+    double n;
     /* validate minus('-') */
     if (*p == '-') p++;
     /* ignore the number '0' if it is the first character */
@@ -177,15 +824,34 @@ static int lept_parse_number(lept_context* c, lept_value* v) {
         if (!ISDIGIT(*p)) return LEPT_PARSE_INVALID_VALUE;
         for (p++; ISDIGIT(*p); p++);
     }
+    /* keep the literal, lept_get_number() converts it; a skipped literal is never copied */
+    if (c->opts->lazy_numbers && v == NULL) {
+        c->json = p;
+        return LEPT_PARSE_OK;
+    }
+    if (c->opts->lazy_numbers) {
+        if ((v->l.t = lept_block_strdup(CURRENT_ALLOCATOR(), c->json, (size_t)(p - c->json))) == NULL)
+            return LEPT_PARSE_OUT_OF_MEMORY;
+        STATS_ALLOC(c, (size_t)(p - c->json) + 1);
+        v->l.len = (size_t)(p - c->json);
+        v->type = LEPT_NUMBER;
+        v->literal = 1;
+        c->json = p;
+        return LEPT_PARSE_OK;
+    }
     errno = 0;
     /* convert string to double */
-    v->n = strtod(c->json, NULL);
+    n = strtod(c->json, NULL);
     /* check the range of the number */
-    if (errno == ERANGE && (v->n == HUGE_VAL || v->n == -HUGE_VAL)) {
+    if (errno == ERANGE && (n == HUGE_VAL || n == -HUGE_VAL)) {
         return LEPT_PARSE_NUMBER_TOO_BIG;
     }
     /* set the value's type */
-    v->type = LEPT_NUMBER;
+    if (v != NULL) {
+        v->n = n;
+        v->type = LEPT_NUMBER;
+        v->literal = 0;
+    }
     /* update the json string */
     c->json = p;
     return LEPT_PARSE_OK;
@@ -243,10 +909,57 @@ static void lept_encode_utf8(lept_context* c, unsigned u) {
     }
 }
 
+/* well-formed UTF-8 (Unicode table 3-7): no overlong forms, surrogates, code points above U+10FFFF
+   or truncated sequences */
+static int lept_utf8_valid(const char* str, size_t len) {
+    const unsigned char* s = (const unsigned char*)str, *end = s + len;
+    unsigned lo, hi;
+    size_t n;
+    while (s < end) {
+        /* skip ASCII eight bytes at a time */
+        while (end - s >= 8) {
+            uint64_t w;
+            memcpy(&w, s, 8);
+            if (SWAR_HAS_HIGH(w))
+                break;
+            s += 8;
+        }
+        if (s == end)
+            break;
+        if (*s < 0x80) {
+            s++;
+            continue;
+        }
+        /* the range of the second byte depends on the lead byte */
+        lo = 0x80, hi = 0xBF;
+        if (*s >= 0xC2 && *s <= 0xDF) n = 1;
+        else if (*s >= 0xE0 && *s <= 0xEF) {
+            n = 2;
+            if (*s == 0xE0) lo = 0xA0;
+            if (*s == 0xED) hi = 0x9F;
+        }
+        else if (*s >= 0xF0 && *s <= 0xF4) {
+            n = 3;
+            if (*s == 0xF0) lo = 0x90;
+            if (*s == 0xF4) hi = 0x8F;
+        }
+        else
+            return 0;
+        if ((size_t)(end - s) <= n || s[1] < lo || s[1] > hi)
+            return 0;
+        for (s += 2; --n; s++)
+            if ((*s & 0xC0) != 0x80)
+                return 0;
+    }
+    return 1;
+}
+
 /* parse raw string */
 static int lept_parse_string_raw(lept_context* c, char** str, size_t* len) {
     /* set the head of the string */
     size_t head = c->top;
+    /* the string is too long once it grows past limit */
+    size_t limit = c->opts->max_string_length ? c->opts->max_string_length : (size_t)-1;
     /* temporary storage of surrogates */
     unsigned u, u2;
     const char* p;
@@ -255,14 +968,26 @@ static int lept_parse_string_raw(lept_context* c, char** str, size_t* len) {
     p = c->json;
     /* loop to find the end of the string */
     for(;;) {
+        /* stop as soon as the limit is passed instead of buffering the rest */
+        if (c->top - head > limit)
+            STRING_ERROR(LEPT_PARSE_STRING_TOO_LONG);
         /* When this statement is executed,
         ch is assigned the value p,and p = p+1 after execution */
         char ch = *p++;
         switch (ch) {
             case '\"':
+                /* a push failed somewhere in the string */
+                if (c->oom)
+                    STRING_ERROR(LEPT_PARSE_OUT_OF_MEMORY);
                 /* get the length of the string */
                 *len = c->top - head;
+                if (*len > limit)
+                    STRING_ERROR(LEPT_PARSE_STRING_TOO_LONG);
+                /* checked once over the decoded string, which also catches escaped lone surrogates */
+                if (c->opts->strict_utf8 && !lept_utf8_valid(c->stack + head, *len))
+                    STRING_ERROR(LEPT_PARSE_INVALID_UTF8);
                 /* copy the string from the stack */
+                STATS_PEAK(c);
                 *str = lept_context_pop(c, *len);
                 /* update the json string */
                 c->json = p;
@@ -327,164 +1052,578 @@ static int lept_parse_string(lept_context* c, lept_value* v) {
     /* parse string */
     if ((ret = lept_parse_string_raw(c, &s, &len)) == LEPT_PARSE_OK) {
         lept_set_string(v, s, len);
+        if (v->type != LEPT_STRING)
+            return LEPT_PARSE_OUT_OF_MEMORY;
+        STATS_ALLOC(c, len + 1);
+        if (c->opts->stats)
+            c->opts->stats->string_bytes += len;
     }
     return ret;
 }
 
-/* forward declaration */
-static int lept_parse_value(lept_context* c, lept_value* v);
+/* open a container checked against a schema node and filtered by a field mask node, its elements are pushed on top of the frame */
+static int lept_parse_push_frame(lept_context* c, lept_type type, size_t node, size_t mask) {
+    lept_frame* f = (lept_frame*)lept_context_push(c, sizeof(lept_frame));
+    if (f == NULL)
+        return LEPT_PARSE_OUT_OF_MEMORY;
+    f->prev = c->frame;
+    f->size = 0;
+    f->type = type;
+    f->k = NULL;
+    f->klen = 0;
+    f->node = node;
+    f->child = type == LEPT_ARRAY && node != LEPT_SCHEMA_NONE ? c->schema->nodes[node].items : LEPT_SCHEMA_NONE;
+    f->seen = 0;
+    f->mask = f->mchild = mask;
+    c->frame = (size_t)((char*)f - c->stack);
+    c->depth++;
+    if (c->opts->stats && c->depth > c->opts->stats->max_depth)
+        c->opts->stats->max_depth = c->depth;
+    return LEPT_PARSE_OK;
+}
+
+static uint64_t lept_hash_bytes(const char* s, size_t len);
 
-/* parse array */
-static int lept_parse_array(lept_context* c, lept_value* v) {
-    int ret;
-    size_t size = 0, i;
-    EXPECT(c, '[');
-    lept_parse_whitespace(c);
-    /* empty array */
-    if (*c->json == ']') {
-        c->json++;
-        lept_set_array(v, 0);
+#define SAME_KEY(a, b) ((a).klen == (b).klen && memcmp((a).k, (b).k, (a).klen) == 0)
+
+/* apply the duplicate key policy to the members of the innermost object, in place on the stack */
+static int lept_parse_dedupe(lept_context* c) {
+    int policy = c->opts->duplicate_keys;
+    size_t n = FRAME(c)->size, base = c->top - n * sizeof(lept_member);
+    size_t cap = 0, i, j, k, out, *slots = NULL;
+    lept_member* m;
+    if (policy == LEPT_DUPLICATE_KEEP_ALL || n < 2)
         return LEPT_PARSE_OK;
+    /* larger objects go through an open addressing table of kept member indexes, pushed above them */
+    if (n > LEPT_DEDUPE_SCAN_MAX) {
+        for (cap = 16; cap < n * 2; cap <<= 1)
+            ;
+        if ((slots = (size_t*)lept_context_push(c, cap * sizeof(size_t))) == NULL)
+            return LEPT_PARSE_OUT_OF_MEMORY;
+        for (k = 0; k < cap; k++)
+            slots[k] = LEPT_KEY_NOT_EXIST;
     }
-    /* parse elements */
-    for (;;) {
-        lept_value e;
-        lept_init(&e);
-        /* parse element */
-        if ((ret = lept_parse_value(c, &e)) != LEPT_PARSE_OK)
-            break;
-        /* store the element to stack */
-        memcpy(lept_context_push(c, sizeof(lept_value)), &e, sizeof(lept_value));
-        size++;
-        lept_parse_whitespace(c);
-        /* check the next character */
-        if (*c->json == ',') {
-            c->json++;
-            lept_parse_whitespace(c);
+    m = (lept_member*)(c->stack + base);
+    for (i = out = 0; i < n; i++) {
+        /* look for a kept member with the same key */
+        j = LEPT_KEY_NOT_EXIST;
+        if (slots != NULL) {
+            k = (size_t)lept_hash_bytes(m[i].k, m[i].klen) & (cap - 1);
+            while (slots[k] != LEPT_KEY_NOT_EXIST && !SAME_KEY(m[slots[k]], m[i]))
+                k = (k + 1) & (cap - 1);
+            if (slots[k] == LEPT_KEY_NOT_EXIST)
+                slots[k] = out;
+            else
+                j = slots[k];
         }
-        /* end of array */
-        else if (*c->json == ']') {
-            c->json++;
-            lept_set_array(v, size);
-            /* copy the elements from the stack */
-            memcpy(v->a.e, lept_context_pop(c, size * sizeof(lept_value)), size * sizeof(lept_value));
-            v->a.size = size;
-            return LEPT_PARSE_OK;
+        else
+            for (k = 0; k < out; k++)
+                if (SAME_KEY(m[k], m[i])) {
+                    j = k;
+                    break;
+                }
+        if (j == LEPT_KEY_NOT_EXIST) {
+            m[out++] = m[i];
+            continue;
         }
-        else {
-            ret = LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
-            break;
+        /* nothing has moved yet, the frame still owns every member */
+        if (policy == LEPT_DUPLICATE_REJECT) {
+            if (slots != NULL)
+                lept_context_pop(c, cap * sizeof(size_t));
+            return LEPT_PARSE_DUPLICATE_KEY;
         }
+        if (policy == LEPT_DUPLICATE_KEEP_LAST) {
+            lept_free(&m[j].v);
+            m[j].v = m[i].v;
+        }
+        else
+            lept_free(&m[i].v);
+        lept_block_drop(m[i].k);
     }
-    /* pop and free the elements on the stack */
+    if (slots != NULL)
+        lept_context_pop(c, cap * sizeof(size_t));
+    lept_context_pop(c, (n - out) * sizeof(lept_member));
+    FRAME(c)->size = out;
+    return LEPT_PARSE_OK;
+}
+
+/* the size elements on top of the stack are all converted numbers */
+static int lept_parse_all_numbers(lept_context* c, size_t size) {
+    const lept_value* e = (const lept_value*)(c->stack + c->top - size * sizeof(lept_value));
+    size_t i;
     for (i = 0; i < size; i++)
-        lept_free((lept_value*)lept_context_pop(c, sizeof(lept_value)));
-    return ret;
+        if (e[i].type != LEPT_NUMBER || e[i].literal)
+            return 0;
+    return 1;
 }
 
-/* parse object */
-static int lept_parse_object(lept_context* c, lept_value* v) {
-    size_t i, size;
-    lept_member m;
+/* close the innermost container, moving its elements from the stack into v */
+static int lept_parse_pop_frame(lept_context* c, lept_value* v) {
+    lept_frame f;
     int ret;
-    EXPECT(c, '{');
-    lept_parse_whitespace(c);
-    /* empty array */
-    if (*c->json == '}') {
-        c->json++;
-        lept_set_object(v, 0);
-        return LEPT_PARSE_OK;
+    /* repeated keys are resolved while the members are still on the stack */
+    if (FRAME(c)->type == LEPT_OBJECT && (ret = lept_parse_dedupe(c)) != LEPT_PARSE_OK)
+        return ret;
+    f = *FRAME(c);
+    /* v may still hold a value whose ownership has moved to the stack */
+    lept_init(v);
+    STATS_PEAK(c);
+    c->seen = f.seen;
+    if (f.type == LEPT_ARRAY && c->opts->pack_numbers && f.size > 0 && lept_parse_all_numbers(c, f.size)) {
+        const lept_value* e;
+        size_t i;
+        double* d = (double*)lept_block_alloc(CURRENT_ALLOCATOR(), f.size * sizeof(double));
+        if (d == NULL)
+            return LEPT_PARSE_OUT_OF_MEMORY;
+        STATS_ALLOC(c, f.size * sizeof(double));
+        e = (const lept_value*)lept_context_pop(c, f.size * sizeof(lept_value));
+        for (i = 0; i < f.size; i++)
+            d[i] = e[i].n;
+        v->type = LEPT_ARRAY;
+        v->packed = 1;
+        v->p.d = d;
+        v->a.size = v->a.capacity = f.size;
     }
-    /* initialize the member */
-    m.k = NULL;
-    size = 0;
-    /* parse member */
-    for (;;) {
-        char *str;
-        lept_init(&m.v);
-        /* parse member::key */
-        if (*c->json != '"') {
-            ret = LEPT_PARSE_MISS_KEY;
-            break;
+    else if (f.type == LEPT_ARRAY) {
+        /* the frame stays open, so the error path frees the elements */
+        if (lept_set_array(v, f.size) != 0)
+            return LEPT_PARSE_OUT_OF_MEMORY;
+        STATS_ALLOC(c, f.size * sizeof(lept_value));
+        /* copy the elements from the stack */
+        memcpy(v->a.e, lept_context_pop(c, f.size * sizeof(lept_value)), f.size * sizeof(lept_value));
+        v->a.size = f.size;
+    }
+    else {
+        if (lept_set_object(v, f.size) != 0)
+            return LEPT_PARSE_OUT_OF_MEMORY;
+        /* every member may have been skipped by the field mask */
+        if (f.size) {
+            STATS_ALLOC(c, f.size * sizeof(lept_member));
+            /* copy the members from the stack */
+            memcpy(v->o.m, lept_context_pop(c, f.size * sizeof(lept_member)), f.size * sizeof(lept_member));
         }
-        if ((ret = lept_parse_string_raw(c, &str, &m.klen)) != LEPT_PARSE_OK)
-            break;
-        /* copy the key from stack */
-        memcpy(m.k = (char*) malloc(m.klen + 1), str, m.klen);
-        m.k[m.klen] = '\0';
-        /* parse ws colon ws */
-        lept_parse_whitespace(c);
-        if (*c->json != ':') {
-            ret = LEPT_PARSE_MISS_COLON;
-            break;
+        v->o.size = f.size;
+    }
+    lept_context_pop(c, sizeof(lept_frame));
+    c->frame = f.prev;
+    c->depth--;
+    return LEPT_PARSE_OK;
+}
+
+/* drop the innermost container, freeing the elements parsed so far */
+static void lept_parse_discard_frame(lept_context* c) {
+    lept_frame f = *FRAME(c);
+    size_t i;
+    if (f.type == LEPT_ARRAY) {
+        for (i = 0; i < f.size; i++)
+            lept_free((lept_value*)lept_context_pop(c, sizeof(lept_value)));
+    }
+    else {
+        /* free the pending key */
+        lept_block_drop(f.k);
+        for (i = 0; i < f.size; i++) {
+            lept_member* m = (lept_member*)lept_context_pop(c, sizeof(lept_member));
+            lept_block_drop(m->k);
+            lept_free(&m->v);
+        }
+    }
+    lept_context_pop(c, sizeof(lept_frame));
+    c->frame = f.prev;
+    c->depth--;
+}
+
+/* parse member::key and the colon without keeping the key */
+static int lept_parse_skip_key(lept_context* c) {
+    char* str;
+    size_t klen;
+    int ret;
+    if (*c->json != '"')
+        return LEPT_PARSE_MISS_KEY;
+    if ((ret = lept_parse_string_raw(c, &str, &klen)) != LEPT_PARSE_OK)
+        return ret;
+    lept_parse_whitespace(c);
+    if (*c->json != ':')
+        return LEPT_PARSE_MISS_COLON;
+    c->json++;
+    lept_parse_whitespace(c);
+    return LEPT_PARSE_OK;
+}
+
+/* validate a value without building it, its open containers are kept as single bytes on the stack */
+static int lept_parse_skip_value(lept_context* c) {
+    size_t head = c->top, depth = 0, len;
+    lept_value e;
+    char* s;
+    char open;
+    int ret;
+    for (;;) {
+        switch (*c->json) {
+            case 'n':  ret = lept_parse_literal(c, &e, "null", LEPT_NULL); break;
+            case 'f':  ret = lept_parse_literal(c, &e, "false", LEPT_FALSE); break;
+            case 't':  ret = lept_parse_literal(c, &e, "true", LEPT_TRUE); break;
+            case '"':  ret = lept_parse_string_raw(c, &s, &len); break;
+            case '\0': ret = LEPT_PARSE_EXPECT_VALUE; break;
+            case '[':
+            case '{':
+                if (c->opts->max_depth && c->depth + depth >= c->opts->max_depth) {
+                    ret = LEPT_PARSE_TOO_DEEP;
+                    break;
+                }
+                open = *c->json++;
+                lept_parse_whitespace(c);
+                /* empty array or object */
+                if (*c->json == (open == '[' ? ']' : '}')) {
+                    c->json++;
+                    ret = LEPT_PARSE_OK;
+                    break;
+                }
+                if ((s = (char*)lept_context_push(c, 1)) == NULL) {
+                    ret = LEPT_PARSE_OUT_OF_MEMORY;
+                    break;
+                }
+                *s = open;
+                depth++;
+                if (open == '{' && (ret = lept_parse_skip_key(c)) != LEPT_PARSE_OK)
+                    break;
+                continue;
+            default:   ret = lept_parse_number(c, NULL); break;
         }
-        c->json++;
-        lept_parse_whitespace(c);
-        /* parse member::value */
-        if ((ret = lept_parse_value(c, &m.v)) != LEPT_PARSE_OK)
+        if (ret != LEPT_PARSE_OK)
             break;
-        /* store the member to stack */
-        memcpy(lept_context_push(c, sizeof(lept_member)), &m, sizeof(lept_member));
-        size++;
-        m.k = NULL; /* ownership is transferred to member on stack */
-        /* parse ws [comma | right-curly-brace] ws */
-        lept_parse_whitespace(c);
-        if (*c->json == ',') {
-            c->json++;
+        /* close every container that ends here */
+        for (;;) {
+            if (depth == 0)
+                return LEPT_PARSE_OK;
+            open = c->stack[c->top - 1];
             lept_parse_whitespace(c);
+            if (*c->json == ',') {
+                c->json++;
+                lept_parse_whitespace(c);
+                if (open == '{' && (ret = lept_parse_skip_key(c)) != LEPT_PARSE_OK)
+                    goto error;
+                break;
+            }
+            if (*c->json != (open == '[' ? ']' : '}')) {
+                ret = open == '[' ? LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET : LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+                goto error;
+            }
+            c->json++;
+            c->top--;
+            depth--;
         }
-        /* end of object */
-        else if (*c->json == '}') {
+    }
+error:
+    c->top = head;
+    return ret;
+}
+
+/* parse member::key and the colon, the key is kept in the innermost frame;
+   members not selected by the field mask are validated and skipped, *closed is set
+   when that reaches the end of the object */
+static int lept_parse_member_key(lept_context* c, int* closed) {
+    char* str;
+    size_t klen;
+    int ret;
+    *closed = 0;
+    for (;;) {
+        lept_frame* f;
+        /* parse member::key */
+        if (*c->json != '"')
+            return LEPT_PARSE_MISS_KEY;
+        if ((ret = lept_parse_string_raw(c, &str, &klen)) != LEPT_PARSE_OK)
+            return ret;
+        f = FRAME(c);
+        /* the member value is checked against the subschema of its key */
+        if (c->schema) {
+            size_t slot;
+            f->child = lept_schema_member(c->schema, f->node, str, klen, &slot);
+            if (slot < 64)
+                f->seen |= (uint64_t)1 << slot;
+        }
+        if (c->fields && (f->mchild = lept_mask_member(c->fields, f->mask, str, klen)) == LEPT_MASK_NONE) {
+            lept_parse_whitespace(c);
+            if (*c->json != ':')
+                return LEPT_PARSE_MISS_COLON;
             c->json++;
-            lept_set_object(v, size);
-            /* copy the member from the stack */
-            memcpy(v->o.m, lept_context_pop(c, size * sizeof(lept_member)), size * sizeof(lept_member));
-            v->o.size = size;
+            lept_parse_whitespace(c);
+            if ((ret = lept_parse_skip_value(c)) != LEPT_PARSE_OK)
+                return ret;
+            lept_parse_whitespace(c);
+            if (*c->json == ',') {
+                c->json++;
+                lept_parse_whitespace(c);
+                continue;
+            }
+            if (*c->json != '}')
+                return LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+            *closed = 1;
             return LEPT_PARSE_OK;
         }
-        else {
-            ret = LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
-            break;
-        }
+        break;
     }
-    /* free the key */
-    free(m.k);
-    /* pop and free the members on the stack */
-    for (i = 0; i < size; i++) {
-        lept_member* mf = ((lept_member*)lept_context_pop(c, sizeof(lept_member)));
-        free(mf->k);
-        lept_free(&mf->v);
+    /* copy the key from stack */
+    {
+        lept_frame* f = FRAME(c);
+        if ((f->k = lept_block_strdup(CURRENT_ALLOCATOR(), str, klen)) == NULL)
+            return LEPT_PARSE_OUT_OF_MEMORY;
+        STATS_ALLOC(c, klen + 1);
+        if (c->opts->stats)
+            c->opts->stats->key_bytes += klen;
+        f->klen = klen;
     }
-    v->type = LEPT_NULL;
-    return ret;
+    /* parse ws colon ws */
+    lept_parse_whitespace(c);
+    if (*c->json != ':')
+        return LEPT_PARSE_MISS_COLON;
+    c->json++;
+    lept_parse_whitespace(c);
+    return LEPT_PARSE_OK;
 }
 
-/* parse single literal */
-static int lept_parse_value(lept_context* c, lept_value* v) {
-    switch (*c->json) {
-        case 'n':  return lept_parse_literal(c, v, "null", LEPT_NULL);
-        case 'f':  return lept_parse_literal(c, v, "false", LEPT_FALSE);
-        case 't':  return lept_parse_literal(c, v, "true", LEPT_TRUE);
-        case '"':  return lept_parse_string(c, v);
-        case '[':  return lept_parse_array(c, v);
-        case '{':  return lept_parse_object(c, v);
-        case '\0': return LEPT_PARSE_EXPECT_VALUE;
-        default:   return lept_parse_number(c, v);
+/* JSON pointer of the value being parsed, built from the open frames bottom up */
+static void lept_schema_path(lept_context* c, char* path, size_t size) {
+    size_t prev = LEPT_NO_FRAME, cur = c->frame, next, len = 0, i;
+    char token[32];
+    /* reverse the links of the frames to walk them from the root, and back again while walking */
+    while (cur != LEPT_NO_FRAME) {
+        lept_frame* f = (lept_frame*)(c->stack + cur);
+        next = f->prev;
+        f->prev = prev;
+        prev = cur;
+        cur = next;
+    }
+    for (cur = prev, prev = LEPT_NO_FRAME; cur != LEPT_NO_FRAME; prev = cur, cur = next) {
+        lept_frame* f = (lept_frame*)(c->stack + cur);
+        next = f->prev;
+        f->prev = prev;
+        if (f->type == LEPT_ARRAY) {
+            sprintf(token, "/%lu", (unsigned long)f->size);
+            for (i = 0; token[i] && len + 1 < size; i++)
+                path[len++] = token[i];
+            continue;
+        }
+        if (len + 1 < size)
+            path[len++] = '/';
+        for (i = 0; i < f->klen && len + 2 < size; i++) {
+            if (f->k[i] == '~' || f->k[i] == '/') {
+                path[len++] = '~';
+                path[len++] = f->k[i] == '~' ? '0' : '1';
+            }
+            else
+                path[len++] = f->k[i];
+        }
     }
+    path[len] = '\0';
 }
 
-/* parse complete literal */
-int lept_parse(lept_value* v, const char* json) {
-    lept_context c;
-    /* can be used to check the parse result */
-    int ret;
-    assert(v != NULL);
-    /* initialize lept_context */
-    c.json = json;
-    c.stack = NULL;
-    c.size = c.top = 0;
+/* report the first schema violation */
+static int lept_schema_violation(lept_context* c, const char* keyword) {
+    lept_schema_error* err = c->opts->schema_error;
+    if (err) {
+        err->keyword = keyword;
+        lept_schema_path(c, err->path, sizeof(err->path));
+    }
+    return LEPT_PARSE_SCHEMA_VIOLATION;
+}
+
+/* schema node of the value about to be parsed or just completed */
+#define SCHEMA_NODE(c) ((c)->schema == NULL ? LEPT_SCHEMA_NONE : (c)->frame == LEPT_NO_FRAME ? 0 : FRAME(c)->child)
+
+/* parse value without recursion, open containers are kept as frames on the stack */
+static int lept_parse_value(lept_context* c, lept_value* v) {
+    const lept_parse_options* opts = c->opts;
+    lept_value e;
+    lept_type type;
+    size_t node;
+    int ret, closed;
+    for (;;) {
+        lept_init(&e);
+        if (opts->max_nodes && ++c->nodes > opts->max_nodes) {
+            ret = LEPT_PARSE_TOO_MANY_NODES;
+            goto error;
+        }
+        switch (*c->json) {
+            case 'n':  ret = lept_parse_literal(c, &e, "null", LEPT_NULL); break;
+            case 'f':  ret = lept_parse_literal(c, &e, "false", LEPT_FALSE); break;
+            case 't':  ret = lept_parse_literal(c, &e, "true", LEPT_TRUE); break;
+            case '"':  ret = lept_parse_string(c, &e); break;
+            case '\0': ret = LEPT_PARSE_EXPECT_VALUE; break;
+            case '[':
+            case '{':
+                if (opts->max_depth && c->depth >= opts->max_depth) {
+                    ret = LEPT_PARSE_TOO_DEEP;
+                    break;
+                }
+                type = *c->json == '[' ? LEPT_ARRAY : LEPT_OBJECT;
+                /* fail before building any of a container of the wrong type */
+                node = SCHEMA_NODE(c);
+                if (node != LEPT_SCHEMA_NONE && !(c->schema->nodes[node].types & (1u << type))) {
+                    ret = lept_schema_violation(c, "type");
+                    goto error;
+                }
+                c->json++;
+                lept_parse_whitespace(c);
+                /* empty array or object */
+                if (*c->json == (type == LEPT_ARRAY ? ']' : '}')) {
+                    c->json++;
+                    if (type == LEPT_ARRAY)
+                        lept_set_array(&e, 0);
+                    else
+                        lept_set_object(&e, 0);
+                    c->seen = 0;
+                    ret = LEPT_PARSE_OK;
+                    break;
+                }
+                if ((ret = lept_parse_push_frame(c, type, node, MASK_NODE(c))) != LEPT_PARSE_OK)
+                    goto error;
+                if (type == LEPT_OBJECT) {
+                    if ((ret = lept_parse_member_key(c, &closed)) != LEPT_PARSE_OK)
+                        goto error;
+                    /* every member was skipped */
+                    if (closed) {
+                        c->json++;
+                        ret = lept_parse_pop_frame(c, &e);
+                        break;
+                    }
+                }
+                /* parse the first element or member::value */
+                continue;
+            default:   ret = lept_parse_number(c, &e); break;
+        }
+        if (ret != LEPT_PARSE_OK)
+            goto error;
+        /* store e into the enclosing containers, closing every container that ends here */
+        for (;;) {
+            lept_frame* f;
+            void* top;
+            const char* keyword;
+            if (opts->stats)
+                opts->stats->nodes[e.type]++;
+            /* check the complete value before it is stored */
+            if (c->schema && (keyword = lept_schema_check(c->schema, SCHEMA_NODE(c), &e, c->seen)) != NULL) {
+                lept_free(&e);
+                ret = lept_schema_violation(c, keyword);
+                goto error;
+            }
+            if (c->frame == LEPT_NO_FRAME) {
+                memcpy(v, &e, sizeof(lept_value));
+                return LEPT_PARSE_OK;
+            }
+            if (FRAME(c)->type == LEPT_ARRAY) {
+                /* store the element to stack */
+                if ((top = lept_context_push(c, sizeof(lept_value))) == NULL) {
+                    lept_free(&e);
+                    ret = LEPT_PARSE_OUT_OF_MEMORY;
+                    goto error;
+                }
+                memcpy(top, &e, sizeof(lept_value));
+                FRAME(c)->size++;
+                lept_parse_whitespace(c);
+                /* check the next character */
+                if (*c->json == ',') {
+                    c->json++;
+                    lept_parse_whitespace(c);
+                    break;
+                }
+                /* end of array */
+                if (*c->json != ']') {
+                    ret = LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+                    goto error;
+                }
+            }
+            else {
+                /* store the member to stack, ownership of the key is transferred to it */
+                lept_member* m;
+                if ((top = lept_context_push(c, sizeof(lept_member))) == NULL) {
+                    lept_free(&e);
+                    ret = LEPT_PARSE_OUT_OF_MEMORY;
+                    goto error;
+                }
+                m = (lept_member*)top;
+                f = FRAME(c);
+                m->k = f->k;
+                m->klen = f->klen;
+                memcpy(&m->v, &e, sizeof(lept_value));
+                f->k = NULL;
+                f->size++;
+                /* parse ws [comma | right-curly-brace] ws */
+                lept_parse_whitespace(c);
+                if (*c->json == ',') {
+                    c->json++;
+                    lept_parse_whitespace(c);
+                    if ((ret = lept_parse_member_key(c, &closed)) != LEPT_PARSE_OK)
+                        goto error;
+                    if (!closed)
+                        break;
+                }
+                /* end of object */
+                if (*c->json != '}') {
+                    ret = LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET;
+                    goto error;
+                }
+            }
+            c->json++;
+            if ((ret = lept_parse_pop_frame(c, &e)) != LEPT_PARSE_OK)
+                goto error;
+        }
+    }
+error:
+    /* pop and free everything parsed inside the open containers */
+    while (c->frame != LEPT_NO_FRAME)
+        lept_parse_discard_frame(c);
+    return ret;
+}
+
+void lept_parse_options_init(lept_parse_options* opts) {
+    assert(opts != NULL);
+    *opts = lept_default_options;
+}
+
+void lept_set_allocator(const lept_allocator* a) {
+    assert(a == NULL || (a->malloc != NULL && a->realloc != NULL && a->free != NULL));
+    lept_global_allocator = a != NULL ? a : &lept_std_allocator;
+}
+
+const lept_allocator* lept_get_allocator(void) {
+    return CURRENT_ALLOCATOR();
+}
+
+/* parse complete literal with a reusable parser */
+int lept_parser_parse(lept_parser* p, lept_value* v, const char* json, const lept_parse_options* opts) {
+    lept_context c;
+    const lept_allocator* saved;
+    /* can be used to check the parse result */
+    int ret;
+    assert(p != NULL && v != NULL && json != NULL);
     /* initialize lept_value */
     lept_init(v);
+    if (opts == NULL)
+        opts = &lept_default_options;
+    if (opts->stats)
+        memset(opts->stats, 0, sizeof(lept_parse_stats));
+    /* reject oversized input before touching it */
+    if (opts->max_input_bytes && memchr(json, '\0', opts->max_input_bytes + 1) == NULL)
+        return LEPT_PARSE_INPUT_TOO_LARGE;
+    /* blocks of the document come from the allocator of the options */
+    saved = lept_thread_allocator;
+    if (opts->allocator)
+        lept_thread_allocator = opts->allocator;
+    /* the scratch stack stays with the allocator it was first made with */
+    if (p->alloc == NULL)
+        p->alloc = CURRENT_ALLOCATOR();
+    /* initialize lept_context, borrowing the scratch stack of the parser */
+    c.json = json;
+    c.stack = p->stack;
+    c.size = p->size;
+    c.top = 0;
+    c.alloc = p->alloc;
+    c.oom = 0;
+    c.frame = LEPT_NO_FRAME;
+    c.depth = c.nodes = 0;
+    c.opts = opts;
+    c.schema = opts->schema;
+    c.seen = 0;
+    c.fields = opts->fields;
     /* parse whitespace */
     lept_parse_whitespace(&c);
     /* parse the first character */
@@ -493,23 +1632,258 @@ int lept_parse(lept_value* v, const char* json) {
         lept_parse_whitespace(&c);
         /* if the next character is not '\0', then the json string is not over */
         if (*c.json != '\0') {
-            v->type = LEPT_NULL;
+            lept_free(v);
             ret = LEPT_PARSE_ROOT_NOT_SINGULAR;
         }
     }
-    /* free the memory of lept_context */
+    /* hand the (possibly grown) stack back to the parser instead of freeing it */
     assert(c.top == 0);
-    free(c.stack);
+    p->stack = c.stack;
+    p->size = c.size;
+    lept_thread_allocator = saved;
     return ret;
 }
 
-static void lept_stringify_string(lept_context* c, const char* s, size_t len) {
-    static const char hex_digits[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
-    size_t i, size;
-    char* head, *p;
-    assert(s != NULL);
-    /* reserve the enough space */
-    p = head = lept_context_push(c, size = len * 6 + 2); /* "\u00xx..." */
+void lept_parser_free(lept_parser* p) {
+    assert(p != NULL);
+    if (p->stack != NULL)
+        p->alloc->free(p->alloc->ctx, p->stack);
+    lept_parser_init(p);
+}
+
+/* parse complete literal */
+int lept_parse(lept_value* v, const char* json) {
+    return lept_parser_parse(&lept_default_parser, v, json, NULL);
+}
+
+/* parse complete literal with limits */
+int lept_parse_ex(lept_value* v, const char* json, const lept_parse_options* opts) {
+    return lept_parser_parse(&lept_default_parser, v, json, opts);
+}
+
+/* parse complete literal, building only the members selected by fields */
+int lept_parse_projected(lept_value* v, const char* json, const lept_field_mask* fields) {
+    lept_parse_options opts = lept_default_options;
+    opts.fields = fields;
+    return lept_parser_parse(&lept_default_parser, v, json, &opts);
+}
+
+void lept_parse_cleanup(void) {
+    lept_parser_free(&lept_default_parser);
+}
+
+/* character at p, '\0' past the end of the text */
+#define VALIDATE_CH(p) ((p) < end ? *(p) : '\0')
+
+static void lept_validate_whitespace(const char** pp, const char* end) {
+    const char* p = *pp;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    *pp = p;
+}
+
+static int lept_validate_literal(const char** pp, const char* end, const char* literal, size_t len) {
+    if ((size_t)(end - *pp) < len || memcmp(*pp, literal, len) != 0)
+        return LEPT_PARSE_INVALID_VALUE;
+    *pp += len;
+    return LEPT_PARSE_OK;
+}
+
+/* number syntax of lept_parse_number, without the conversion */
+static int lept_validate_number(const char** pp, const char* end) {
+    const char* p = *pp;
+    if (VALIDATE_CH(p) == '-') p++;
+    if (VALIDATE_CH(p) == '0') p++;
+    else {
+        if (!ISDIGIT1TO9(VALIDATE_CH(p))) return LEPT_PARSE_INVALID_VALUE;
+        for (p++; ISDIGIT(VALIDATE_CH(p)); p++);
+    }
+    if (VALIDATE_CH(p) == '.') {
+        p++;
+        if (!ISDIGIT(VALIDATE_CH(p))) return LEPT_PARSE_INVALID_VALUE;
+        for (p++; ISDIGIT(VALIDATE_CH(p)); p++);
+    }
+    if (VALIDATE_CH(p) == 'e' || VALIDATE_CH(p) == 'E') {
+        p++;
+        if (VALIDATE_CH(p) == '+' || VALIDATE_CH(p) == '-') p++;
+        if (!ISDIGIT(VALIDATE_CH(p))) return LEPT_PARSE_INVALID_VALUE;
+        for (p++; ISDIGIT(VALIDATE_CH(p)); p++);
+    }
+    *pp = p;
+    return LEPT_PARSE_OK;
+}
+
+/* string syntax of lept_parse_string_raw after the opening quote, without decoding */
+static int lept_validate_string(const char** pp, const char* end) {
+    const char* p = *pp;
+    unsigned u, u2;
+    int ret;
+    for (;;) {
+        /* skip plain characters eight at a time */
+        while (end - p >= 8) {
+            uint64_t w;
+            memcpy(&w, p, 8);
+            if (SWAR_HAS_ZERO(w ^ (SWAR_ONES * '"')) | SWAR_HAS_ZERO(w ^ (SWAR_ONES * '\\')) | SWAR_HAS_LESS(w, 0x20))
+                break;
+            p += 8;
+        }
+        if (p == end) {
+            ret = LEPT_PARSE_MISS_QUOTATION_MARK;
+            break;
+        }
+        if (*p == '"') {
+            *pp = p + 1;
+            return LEPT_PARSE_OK;
+        }
+        if (*p == '\\') {
+            switch (VALIDATE_CH(p + 1)) {
+                case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                    p += 2;
+                    continue;
+                case 'u':
+                    if (end - p < 6 || !lept_parse_hex4(p + 2, &u)) {
+                        ret = LEPT_PARSE_INVALID_UNICODE_HEX;
+                        break;
+                    }
+                    p += 6;
+                    /* a high surrogate must be followed by a low one */
+                    if (u >= 0xD800 && u <= 0xDBFF) {
+                        if (VALIDATE_CH(p) != '\\' || VALIDATE_CH(p + 1) != 'u') {
+                            ret = LEPT_PARSE_INVALID_UNICODE_SURROGATE;
+                            break;
+                        }
+                        if (end - p < 6 || !lept_parse_hex4(p + 2, &u2)) {
+                            ret = LEPT_PARSE_INVALID_UNICODE_HEX;
+                            break;
+                        }
+                        if (u2 < 0xDC00 || u2 > 0xDFFF) {
+                            ret = LEPT_PARSE_INVALID_UNICODE_SURROGATE;
+                            break;
+                        }
+                        p += 6;
+                    }
+                    continue;
+                default:
+                    ret = LEPT_PARSE_INVALID_STRING_ESCAPE;
+            }
+            break;
+        }
+        if ((unsigned char)*p < 0x20) {
+            ret = LEPT_PARSE_INVALID_STRING_CHAR;
+            break;
+        }
+        p++;
+    }
+    *pp = p;
+    return ret;
+}
+
+/* member::key and the colon */
+static int lept_validate_key(const char** pp, const char* end) {
+    int ret;
+    if (VALIDATE_CH(*pp) != '"')
+        return LEPT_PARSE_MISS_KEY;
+    ++*pp;
+    if ((ret = lept_validate_string(pp, end)) != LEPT_PARSE_OK)
+        return ret;
+    lept_validate_whitespace(pp, end);
+    if (VALIDATE_CH(*pp) != ':')
+        return LEPT_PARSE_MISS_COLON;
+    ++*pp;
+    lept_validate_whitespace(pp, end);
+    return LEPT_PARSE_OK;
+}
+
+int lept_validate(const char* json, size_t len, size_t* err_offset) {
+    const char* p = json, *end = json + len;
+    /* one bit per open container, set for objects */
+    uint64_t local[LEPT_VALIDATE_STACK_DEPTH / 64], *bits = local;
+    size_t depth = 0, capacity = sizeof(local) * 8;
+    const lept_allocator* a = CURRENT_ALLOCATOR();
+    int ret, object;
+    assert(json != NULL || len == 0);
+    lept_validate_whitespace(&p, end);
+    for (;;) {
+        switch (VALIDATE_CH(p)) {
+            case 'n':  ret = lept_validate_literal(&p, end, "null", 4); break;
+            case 'f':  ret = lept_validate_literal(&p, end, "false", 5); break;
+            case 't':  ret = lept_validate_literal(&p, end, "true", 4); break;
+            case '"':  p++; ret = lept_validate_string(&p, end); break;
+            case '[':
+            case '{':
+                object = *p++ == '{';
+                lept_validate_whitespace(&p, end);
+                /* empty array or object */
+                if (VALIDATE_CH(p) == (object ? '}' : ']')) {
+                    p++;
+                    ret = LEPT_PARSE_OK;
+                    break;
+                }
+                /* only documents nested deeper than the bits on the C stack allocate */
+                if (depth == capacity) {
+                    uint64_t* grown = (uint64_t*)a->malloc(a->ctx, capacity / 4);
+                    if (grown == NULL) {
+                        ret = LEPT_PARSE_OUT_OF_MEMORY;
+                        goto error;
+                    }
+                    memcpy(grown, bits, capacity / 8);
+                    if (bits != local)
+                        a->free(a->ctx, bits);
+                    bits = grown;
+                    capacity *= 2;
+                }
+                if (object)
+                    bits[depth / 64] |= (uint64_t)1 << (depth % 64);
+                else
+                    bits[depth / 64] &= ~((uint64_t)1 << (depth % 64));
+                depth++;
+                if (object && (ret = lept_validate_key(&p, end)) != LEPT_PARSE_OK)
+                    goto error;
+                /* the first element or member::value */
+                continue;
+            case '\0': ret = p == end ? LEPT_PARSE_EXPECT_VALUE : LEPT_PARSE_INVALID_VALUE; break;
+            default:   ret = lept_validate_number(&p, end); break;
+        }
+        if (ret != LEPT_PARSE_OK)
+            goto error;
+        /* close every container that ends here */
+        for (;;) {
+            lept_validate_whitespace(&p, end);
+            if (depth == 0) {
+                ret = p == end ? LEPT_PARSE_OK : LEPT_PARSE_ROOT_NOT_SINGULAR;
+                goto error;
+            }
+            object = (bits[(depth - 1) / 64] >> ((depth - 1) % 64)) & 1;
+            if (VALIDATE_CH(p) == ',') {
+                p++;
+                lept_validate_whitespace(&p, end);
+                if (object && (ret = lept_validate_key(&p, end)) != LEPT_PARSE_OK)
+                    goto error;
+                break;
+            }
+            if (p == end || *p != (object ? '}' : ']')) {
+                ret = object ? LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET : LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET;
+                goto error;
+            }
+            p++;
+            depth--;
+        }
+    }
+error:
+    if (bits != local)
+        a->free(a->ctx, bits);
+    if (ret != LEPT_PARSE_OK && err_offset)
+        *err_offset = (size_t)(p - json);
+    return ret;
+}
+
+/* write s quoted and escaped at p, which has room for len * 6 + 2 bytes, and return the end;
+   control characters are escaped with upper case hex digits, or lower case ones as RFC 8785 requires */
+static char* lept_escape_string(char* p, const char* s, size_t len, int lower) {
+    static const char upper_digits[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
+    static const char lower_digits[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
+    const char* hex_digits = lower ? lower_digits : upper_digits;
+    size_t i;
     *p++ = '"';
     for (i = 0; i < len; i++) {
         unsigned char ch = (unsigned char)s[i];
@@ -532,12 +1906,69 @@ static void lept_stringify_string(lept_context* c, const char* s, size_t len) {
         }
     }
     *p++ = '"';
+    return p;
+}
+
+/* the exact length lept_escape_string() writes */
+static size_t lept_escaped_length(const char* s, size_t len) {
+    size_t i, size = len + 2;
+    for (i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        if (ch == '"' || ch == '\\' || ch == '\b' || ch == '\f' || ch == '\n' || ch == '\r' || ch == '\t')
+            size += 1;
+        else if (ch < 0x20)
+            size += 5;
+    }
+    return size;
+}
+
+static void lept_stringify_string(lept_context* c, const char* s, size_t len, int lower) {
+    size_t size;
+    char* head, *p;
+    assert(s != NULL);
+    /* reserve the enough space */
+    if ((head = lept_context_push(c, size = len * 6 + 2)) == NULL) /* "\u00xx..." */
+        return;
+    p = lept_escape_string(head, s, len, lower);
     /* shrink lept_context */
     c->top -= size - (p - head);
 }
 
+static void lept_stringify_value(lept_context *c, const lept_value *v, int indent_level, int spaces_per_indent);
+static void lept_stringify_children(lept_context* c, const lept_value* v, size_t n, int indent_level, int spaces_per_indent);
+
+/* stringify the elements or members [begin, end) of a container, each after its separator */
+static void lept_stringify_range(lept_context* c, const lept_value* v, size_t begin, size_t end, int indent_level, int spaces_per_indent) {
+    lept_value tmp;
+    size_t i, j;
+    for (i = begin; i < end; i++) {
+        /* add comma and newline before the element / member except the first one */
+        if (i > 0) {
+            PUTC(c, ',');
+            PUTC(c, '\n');
+        }
+        /* add indentation */
+        for (j = 0; j < indent_level * spaces_per_indent; j++)
+            PUTC(c, ' ');
+        if (v->type == LEPT_ARRAY)
+            /* stringify the element */
+            lept_stringify_value(c, lept_array_at(v, i, &tmp), indent_level + 1, spaces_per_indent);
+        else {
+            /* stringify the member::key */
+            lept_stringify_string(c, v->o.m[i].k, v->o.m[i].klen, 0);
+            /* add space before the colon */
+            PUTC(c, ' ');
+            PUTC(c, ':');
+            /* add space after the colon */
+            PUTC(c, ' ');
+            /* stringify the member::value */
+            lept_stringify_value(c, &v->o.m[i].v, indent_level + 1, spaces_per_indent);
+        }
+    }
+}
+
 static void lept_stringify_value(lept_context *c, const lept_value *v, int indent_level, int spaces_per_indent) {
-    size_t i, j, k;
+    size_t j;
     switch (v->type) {
         case LEPT_NULL:
             PUTS(c, "null", 4);break;
@@ -545,30 +1976,31 @@ static void lept_stringify_value(lept_context *c, const lept_value *v, int inden
             PUTS(c, "false", 5);break;
         case LEPT_TRUE:
             PUTS(c, "true", 4);break;
-        case LEPT_NUMBER:
+        case LEPT_NUMBER: {
+            char* buffer;
+            /* a literal goes out as it came in */
+            if (v->literal) {
+                PUTS(c, v->l.t, v->l.len);
+                break;
+            }
             /* 32 is enough to hold a double in string format */
             /* sprintf() is not safe, but we have checked the length of the buffer */
-            c->top -= 32 - sprintf(lept_context_push(c, 32), "%.17g", v->n);
+            buffer = (char*)lept_context_push(c, 32);
+            if (buffer != NULL)
+                c->top -= 32 - sprintf(buffer, "%.17g", v->n);
             break;
+        }
         case LEPT_STRING:
-            lept_stringify_string(c, v->s.s, v->s.len);break;
+            lept_stringify_string(c, v->s.s, v->s.len, 0);break;
         case LEPT_ARRAY:
             PUTC(c, '[');
-            /* stringify the elements in the array */
+            /* stringify the elements in the array, large ones in parallel */
             if (v->a.size > 0) {
                 PUTC(c, '\n');
-                for (i = 0; i < v->a.size; i++) {
-                    /* add comma and newline before the element except the first one */
-                    if (i > 0) {
-                        PUTC(c, ',');
-                        PUTC(c, '\n');
-                    }
-                    /* add indentation */
-                    for (j = 0; j < indent_level * spaces_per_indent; j++)
-                        PUTC(c, ' ');
-                    /* stringify the element */
-                    lept_stringify_value(c, &v->a.e[i], indent_level + 1, spaces_per_indent);
-                }
+                if (v->a.size >= LEPT_PARALLEL_GRAIN)
+                    lept_stringify_children(c, v, v->a.size, indent_level, spaces_per_indent);
+                else
+                    lept_stringify_range(c, v, 0, v->a.size, indent_level, spaces_per_indent);
                 PUTC(c, '\n');
                 /* add indentation */
                 for (j = 0; j < (indent_level - 1) * spaces_per_indent; j++)
@@ -578,28 +2010,13 @@ static void lept_stringify_value(lept_context *c, const lept_value *v, int inden
             break;
         case LEPT_OBJECT:
             PUTC(c, '{');
-            /* stringify the members in the object */
+            /* stringify the members in the object, large ones in parallel */
             if (v->o.size > 0) {
                 PUTC(c, '\n');
-                for (i = 0; i < v->o.size; i++) {
-                    /* add comma and newline before the member except the first one */
-                    if (i > 0) {
-                        PUTC(c, ',');
-                        PUTC(c, '\n');
-                    }
-                    /* add indentation */
-                    for (j = 0; j < indent_level * spaces_per_indent; j++)
-                        PUTC(c, ' ');
-                    /* stringify the member::key */
-                    lept_stringify_string(c, v->o.m[i].k, v->o.m[i].klen);
-                    /* add space before the colon */
-                    PUTC(c, ' ');
-                    PUTC(c, ':');
-                    /* add space after the colon */
-                    PUTC(c, ' ');
-                    /* stringify the member::value */
-                    lept_stringify_value(c, &v->o.m[i].v, indent_level + 1, spaces_per_indent);
-                }
+                if (v->o.size >= LEPT_PARALLEL_GRAIN)
+                    lept_stringify_children(c, v, v->o.size, indent_level, spaces_per_indent);
+                else
+                    lept_stringify_range(c, v, 0, v->o.size, indent_level, spaces_per_indent);
                 PUTC(c, '\n');
                 /* add indentation */
                 for (j = 0; j < (indent_level - 1) * spaces_per_indent; j++)
@@ -618,7 +2035,8 @@ char* lept_stringify(const lept_value* v, size_t* length) {
     lept_context c;
     assert(v != NULL);
     /* initialize lept_context */
-    c.stack = (char*)malloc(c.size = LEPT_PARSE_STRINGIFY_INIT_SIZE);
+    lept_context_init(&c, CURRENT_ALLOCATOR());
+    lept_context_push(&c, LEPT_PARSE_STRINGIFY_INIT_SIZE);
     c.top = 0;
     /* stringify the value, and the indent_level at least 1 */
     lept_stringify_value(&c, v, 1, 2);
@@ -626,98 +2044,1753 @@ char* lept_stringify(const lept_value* v, size_t* length) {
         *length = c.top;
     /* add '\0' to the end of the string */
     PUTC(&c, '\0');
-    return c.stack;
+    return lept_context_finish(&c);
+}
+
+void lept_free_string(char* s) {
+    const lept_allocator* a = CURRENT_ALLOCATOR();
+    if (s != NULL)
+        a->free(a->ctx, s);
+}
+
+/* room for size more bytes and the NUL, grown by the allocator unless the buffer is fixed */
+static char* lept_writer_reserve(lept_writer* w, size_t size) {
+    size_t new_size;
+    char* tmp;
+    if (w->error)
+        return NULL;
+    if (w->length + size >= w->size) {
+        if (w->alloc == NULL) {
+            w->error = 1;
+            return NULL;
+        }
+        new_size = w->size ? w->size : LEPT_PARSE_STRINGIFY_INIT_SIZE;
+        while (w->length + size >= new_size)
+            new_size += new_size >> 1;
+        tmp = w->buffer == NULL ? (char*)w->alloc->malloc(w->alloc->ctx, new_size)
+                                : (char*)w->alloc->realloc(w->alloc->ctx, w->buffer, w->size, new_size);
+        if (tmp == NULL) {
+            w->error = 1;
+            return NULL;
+        }
+        w->buffer = tmp;
+        w->size = new_size;
+    }
+    return w->buffer + w->length;
+}
+
+static void lept_writer_put(lept_writer* w, const char* s, size_t len) {
+    char* p;
+    if ((p = lept_writer_reserve(w, len)) != NULL) {
+        memcpy(p, s, len);
+        w->length += len;
+    }
+}
+
+/* the levels past 64 are not tracked, so the asserts let them through */
+#define WRITER_TRACKED(w) ((w)->depth <= 64)
+#define WRITER_IN_OBJECT(w) ((w)->depth > 0 && (((w)->objects >> ((w)->depth - 1)) & 1))
+
+/* separator before a value: inside an object it must follow a key, at the root there is only one */
+static void lept_writer_value(lept_writer* w) {
+    assert(!WRITER_TRACKED(w) || !WRITER_IN_OBJECT(w) || w->key);
+    assert(w->depth > 0 || !w->comma);
+    if (w->comma && !w->key)
+        lept_writer_put(w, ",", 1);
+    w->key = 0;
+}
+
+void lept_writer_init(lept_writer* w, char* buffer, size_t size) {
+    assert(w != NULL && (buffer != NULL || size == 0));
+    w->buffer = buffer;
+    w->size = size;
+    w->alloc = buffer == NULL ? CURRENT_ALLOCATOR() : NULL;
+    lept_writer_reset(w);
+}
+
+void lept_writer_reset(lept_writer* w) {
+    assert(w != NULL);
+    w->length = 0;
+    w->depth = 0;
+    w->objects = 0;
+    w->comma = w->key = w->error = 0;
+}
+
+void lept_writer_free(lept_writer* w) {
+    assert(w != NULL);
+    if (w->alloc != NULL && w->buffer != NULL)
+        w->alloc->free(w->alloc->ctx, w->buffer);
+    w->buffer = NULL;
+    w->size = 0;
+    lept_writer_reset(w);
+}
+
+static void lept_writer_begin(lept_writer* w, char ch, int object) {
+    lept_writer_value(w);
+    lept_writer_put(w, &ch, 1);
+    if (w->depth < 64)
+        w->objects = object ? w->objects | (uint64_t)1 << w->depth : w->objects & ~((uint64_t)1 << w->depth);
+    w->depth++;
+    w->comma = 0;
+}
+
+static void lept_writer_end(lept_writer* w, char ch, int object) {
+    assert(w->depth > 0 && !w->key);
+    assert(!WRITER_TRACKED(w) || WRITER_IN_OBJECT(w) == object);
+    lept_writer_put(w, &ch, 1);
+    w->depth--;
+    w->comma = 1;
+}
+
+void lept_writer_begin_object(lept_writer* w) {
+    assert(w != NULL);
+    lept_writer_begin(w, '{', 1);
+}
+
+void lept_writer_end_object(lept_writer* w) {
+    assert(w != NULL);
+    lept_writer_end(w, '}', 1);
+}
+
+void lept_writer_begin_array(lept_writer* w) {
+    assert(w != NULL);
+    lept_writer_begin(w, '[', 0);
+}
+
+void lept_writer_end_array(lept_writer* w) {
+    assert(w != NULL);
+    lept_writer_end(w, ']', 0);
+}
+
+/* a growing buffer reserves the worst case, a fixed one only what the escapes take */
+static void lept_writer_escaped(lept_writer* w, const char* s, size_t len) {
+    size_t size = len * 6 + 2;
+    char* p;
+    if (w->alloc == NULL && w->length + size >= w->size)
+        size = lept_escaped_length(s, len);
+    if ((p = lept_writer_reserve(w, size)) != NULL)
+        w->length = (size_t)(lept_escape_string(p, s, len, 0) - w->buffer);
+}
+
+void lept_writer_key(lept_writer* w, const char* key, size_t len) {
+    assert(w != NULL && key != NULL);
+    assert(!WRITER_TRACKED(w) || (WRITER_IN_OBJECT(w) && !w->key));
+    if (w->comma)
+        lept_writer_put(w, ",", 1);
+    lept_writer_escaped(w, key, len);
+    lept_writer_put(w, ":", 1);
+    w->key = 1;
+}
+
+void lept_writer_string(lept_writer* w, const char* s, size_t len) {
+    assert(w != NULL && s != NULL);
+    lept_writer_value(w);
+    lept_writer_escaped(w, s, len);
+    w->comma = 1;
+}
+
+void lept_writer_number(lept_writer* w, double n) {
+    /* the format of lept_stringify(), 32 is enough to hold a double */
+    char buffer[32];
+    assert(w != NULL);
+    lept_writer_value(w);
+    lept_writer_put(w, buffer, (size_t)sprintf(buffer, "%.17g", n));
+    w->comma = 1;
+}
+
+void lept_writer_int64(lept_writer* w, int64_t n) {
+    char buffer[24];
+    assert(w != NULL);
+    lept_writer_value(w);
+    lept_writer_put(w, buffer, (size_t)sprintf(buffer, "%lld", (long long)n));
+    w->comma = 1;
+}
+
+void lept_writer_bool(lept_writer* w, int b) {
+    assert(w != NULL);
+    lept_writer_value(w);
+    if (b)
+        lept_writer_put(w, "true", 4);
+    else
+        lept_writer_put(w, "false", 5);
+    w->comma = 1;
+}
+
+void lept_writer_null(lept_writer* w) {
+    assert(w != NULL);
+    lept_writer_value(w);
+    lept_writer_put(w, "null", 4);
+    w->comma = 1;
+}
+
+void lept_writer_raw(lept_writer* w, const char* json, size_t len) {
+    assert(w != NULL && json != NULL);
+    lept_writer_value(w);
+    lept_writer_put(w, json, len);
+    w->comma = 1;
+}
+
+const char* lept_writer_result(lept_writer* w, size_t* length) {
+    assert(w != NULL);
+    /* reserve keeps a byte for the NUL */
+    if (lept_writer_reserve(w, 0) == NULL)
+        return NULL;
+    w->buffer[w->length] = '\0';
+    if (length)
+        *length = w->length;
+    return w->buffer;
+}
+
+/**************************************************************
+CBOR (RFC 8949) data item: head [payload]
+    head = major type (3 bits) | additional info (5 bits) [argument]
+        info 0-23  argument is the info itself
+        info 24-27 argument follows in 1 / 2 / 4 / 8 bytes, big-endian
+    major 0 = unsigned integer     major 1 = -1 - argument
+    major 2 = byte string          major 3 = text string (argument = length)
+    major 4 = array                major 5 = map (argument = item / pair count)
+    major 6 = tag (ignored)        major 7 = false(20) true(21) null(22)
+                                             half(25) float(26) double(27)
+****************************************************************/
+#define CBOR_UINT   0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_MAP    5
+#define CBOR_TAG    6
+#define CBOR_SIMPLE 7
+
+/* push a head with the shortest argument encoding */
+static void lept_cbor_put_head(lept_context* c, unsigned major, uint64_t n) {
+    unsigned char* p;
+    major <<= 5;
+    if (n < 24) {
+        PUTC(c, (char)(major | n));
+    }
+    else if (n <= 0xFF) {
+        if ((p = (unsigned char*)lept_context_push(c, 2)) == NULL)
+            return;
+        p[0] = major | 24; p[1] = (unsigned char)n;
+    }
+    else if (n <= 0xFFFF) {
+        if ((p = (unsigned char*)lept_context_push(c, 3)) == NULL)
+            return;
+        p[0] = major | 25; p[1] = (unsigned char)(n >> 8); p[2] = (unsigned char)n;
+    }
+    else if (n <= 0xFFFFFFFFu) {
+        if ((p = (unsigned char*)lept_context_push(c, 5)) == NULL)
+            return;
+        p[0] = major | 26;
+        p[1] = (unsigned char)(n >> 24); p[2] = (unsigned char)(n >> 16);
+        p[3] = (unsigned char)(n >> 8);  p[4] = (unsigned char)n;
+    }
+    else {
+        int i;
+        if ((p = (unsigned char*)lept_context_push(c, 9)) == NULL)
+            return;
+        p[0] = major | 27;
+        for (i = 0; i < 8; i++)
+            p[1 + i] = (unsigned char)(n >> (56 - 8 * i));
+    }
+}
+
+/* integers go out as major 0/1, everything else as the narrowest exact float */
+static void lept_cbor_put_number(lept_context* c, double n) {
+    unsigned char* p;
+    int i;
+    /* 18446744073709551616.0 = 2^64 */
+    if (n >= 0 && n < 18446744073709551616.0 && (double)(uint64_t)n == n && !(n == 0 && 1 / n < 0))
+        lept_cbor_put_head(c, CBOR_UINT, (uint64_t)n);
+    /* -n is converted rather than -1 - n, which rounds near -2^64; -2^64 itself is left to the float forms */
+    else if (n < 0 && n > -18446744073709551616.0 && (double)(uint64_t)-n == -n)
+        lept_cbor_put_head(c, CBOR_NEGINT, (uint64_t)-n - 1);
+    else if (n >= -FLT_MAX && n <= FLT_MAX && (double)(float)n == n) {
+        float f = (float)n;
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        if ((p = (unsigned char*)lept_context_push(c, 5)) == NULL)
+            return;
+        p[0] = (CBOR_SIMPLE << 5) | 26;
+        for (i = 0; i < 4; i++)
+            p[1 + i] = (unsigned char)(u >> (24 - 8 * i));
+    }
+    else {
+        uint64_t u;
+        memcpy(&u, &n, sizeof(u));
+        if ((p = (unsigned char*)lept_context_push(c, 9)) == NULL)
+            return;
+        p[0] = (CBOR_SIMPLE << 5) | 27;
+        for (i = 0; i < 8; i++)
+            p[1 + i] = (unsigned char)(u >> (56 - 8 * i));
+    }
 }
 
-void lept_copy(lept_value* dst, const lept_value* src) {
+static void lept_cbor_encode_value(lept_context* c, const lept_value* v) {
+    lept_value tmp;
     size_t i;
-    assert(src != NULL && dst != NULL && src != dst);
-    /* copy to dst according to different types */
-    switch (src->type) {
+    switch (v->type) {
+        case LEPT_NULL:  PUTC(c, (char)((CBOR_SIMPLE << 5) | 22)); break;
+        case LEPT_FALSE: PUTC(c, (char)((CBOR_SIMPLE << 5) | 20)); break;
+        case LEPT_TRUE:  PUTC(c, (char)((CBOR_SIMPLE << 5) | 21)); break;
+        case LEPT_NUMBER:
+            lept_cbor_put_number(c, lept_get_number(v));
+            break;
         case LEPT_STRING:
-            lept_set_string(dst, src->s.s, src->s.len);
+            lept_cbor_put_head(c, CBOR_TEXT, v->s.len);
+            if (v->s.len > 0)
+                PUTS(c, v->s.s, v->s.len);
             break;
         case LEPT_ARRAY:
-            /* initialize dst as an array */
-            dst->type = LEPT_ARRAY;
-            dst->a.e = (lept_value*)malloc(sizeof(lept_value) * src->a.size);
-            lept_reserve_array(dst, src->a.size);
-            /* copy the elements by recursive call */
-            for (i = 0; i < src->a.size; i++)
-                lept_copy(&dst->a.e[i], &src->a.e[i]);
-            dst->a.size = src->a.size;
+            lept_cbor_put_head(c, CBOR_ARRAY, v->a.size);
+            for (i = 0; i < v->a.size; i++)
+                lept_cbor_encode_value(c, lept_array_at(v, i, &tmp));
             break;
         case LEPT_OBJECT:
-            /* initialize dst as an object */
-            dst->type = LEPT_OBJECT;
-            dst->o.m = (lept_member*)malloc(sizeof(lept_member) * src->o.size);
-            lept_reserve_object(dst, src->o.size);
-            /* copy the members */
-            for (i = 0; i < src->o.size; i++) {
-                /* copy the key */
-                lept_set_string(&dst->o.m[i].k, src->o.m[i].k, src->o.m[i].klen);
-                /* copy the value */
-                lept_copy(&dst->o.m[i].v, &src->o.m[i].v);
+            lept_cbor_put_head(c, CBOR_MAP, v->o.size);
+            for (i = 0; i < v->o.size; i++) {
+                lept_cbor_put_head(c, CBOR_TEXT, v->o.m[i].klen);
+                if (v->o.m[i].klen > 0)
+                    PUTS(c, v->o.m[i].k, v->o.m[i].klen);
+                lept_cbor_encode_value(c, &v->o.m[i].v);
             }
-            /* update the size of dst */
-            dst->o.size = src->o.size;
             break;
         default:
-            /* free the memory of dst */
-            lept_free(dst);
-            /* copy the value directly */
-            memcpy(dst, src, sizeof(lept_value));
+            assert(0 && "invalid type");
     }
 }
 
-void lept_move(lept_value* dst, lept_value* src) {
-    assert(src != NULL && dst != NULL && src != dst);
-    /* free the memory of dst */
-    lept_free(dst);
-    /* move the memory of src to dst */
-    memcpy(dst, src, sizeof(lept_value));
-    /* reset the type of src to null */
-    lept_init(src);
+char* lept_encode_cbor(const lept_value* v, size_t* length) {
+    lept_context c;
+    assert(v != NULL && length != NULL);
+    /* initialize lept_context */
+    lept_context_init(&c, CURRENT_ALLOCATOR());
+    lept_context_push(&c, LEPT_PARSE_STRINGIFY_INIT_SIZE);
+    c.top = 0;
+    lept_cbor_encode_value(&c, v);
+    *length = c.top;
+    return lept_context_finish(&c);
 }
 
-void lept_swap(lept_value* lhs, lept_value* rhs) {
-    assert(lhs != NULL && rhs != NULL);
-    /* swap the memory of lhs and rhs by using a temporary variable */
-    if (lhs != rhs) {
-        lept_value temp;
-        memcpy(&temp, lhs, sizeof(lept_value));
-        memcpy(lhs,   rhs, sizeof(lept_value));
-        memcpy(rhs, &temp, sizeof(lept_value));
+/* Input to be decoded */
+typedef struct {
+    const unsigned char* p, *end;
+    size_t depth;
+} lept_cbor_reader;
+
+/* read a head, for major 7 the raw argument bits are returned in n */
+static int lept_cbor_read_head(lept_cbor_reader* r, unsigned* major, unsigned* info, uint64_t* n) {
+    size_t i, bytes;
+    if (r->p >= r->end)
+        return LEPT_PARSE_INVALID_CBOR;
+    *major = *r->p >> 5;
+    *info = *r->p & 0x1F;
+    r->p++;
+    if (*info < 24) {
+        *n = *info;
+        return LEPT_PARSE_OK;
     }
+    /* 28-30 are reserved, 31 (indefinite length) is never produced by lept_encode_cbor */
+    if (*info > 27)
+        return LEPT_PARSE_INVALID_CBOR;
+    bytes = (size_t)1 << (*info - 24);
+    if ((size_t)(r->end - r->p) < bytes)
+        return LEPT_PARSE_INVALID_CBOR;
+    for (*n = 0, i = 0; i < bytes; i++)
+        *n = (*n << 8) | *r->p++;
+    return LEPT_PARSE_OK;
 }
 
-void lept_free(lept_value* v) {
-    assert(v != NULL);
+/* IEEE 754 half precision to double */
+static double lept_cbor_half(unsigned h) {
+    unsigned exp = (h >> 10) & 0x1F, mant = h & 0x3FF;
+    uint32_t u;
+    float f;
+    double d;
+    if (exp == 0)
+        /* zero and subnormal: mant * 2^-24 */
+        d = mant / 16777216.0;
+    else {
+        /* rebias the exponent to single precision, 31 becomes inf/nan */
+        u = ((uint32_t)(exp == 31 ? 255 : exp - 15 + 127) << 23) | ((uint32_t)mant << 13);
+        memcpy(&f, &u, sizeof(f));
+        d = f;
+    }
+    return (h & 0x8000) ? -d : d;
+}
+
+static int lept_cbor_decode_value(lept_cbor_reader* r, lept_value* v) {
+    unsigned major, info;
+    uint64_t n;
     size_t i;
-    /* free the memory */
+    int ret;
+    if ((ret = lept_cbor_read_head(r, &major, &info, &n)) != LEPT_PARSE_OK)
+        return ret;
+    switch (major) {
+        case CBOR_UINT:
+            lept_set_number(v, (double)n);
+            return LEPT_PARSE_OK;
+        case CBOR_NEGINT:
+            lept_set_number(v, -1.0 - (double)n);
+            return LEPT_PARSE_OK;
+        case CBOR_BYTES:
+        case CBOR_TEXT:
+            if (n > (uint64_t)(r->end - r->p))
+                return LEPT_PARSE_INVALID_CBOR;
+            if (lept_set_string(v, (const char*)r->p, (size_t)n) != 0)
+                return LEPT_PARSE_OUT_OF_MEMORY;
+            r->p += n;
+            return LEPT_PARSE_OK;
+        case CBOR_ARRAY:
+            /* every item takes at least one byte, reject counts the input cannot hold */
+            if (n > (uint64_t)(r->end - r->p))
+                return LEPT_PARSE_INVALID_CBOR;
+            if (++r->depth > LEPT_DECODE_MAX_DEPTH)
+                return LEPT_PARSE_TOO_DEEP;
+            if (lept_set_array(v, (size_t)n) != 0)
+                return LEPT_PARSE_OUT_OF_MEMORY;
+            for (i = 0; i < n; i++) {
+                lept_init(&v->a.e[i]);
+                v->a.size++;
+                if ((ret = lept_cbor_decode_value(r, &v->a.e[i])) != LEPT_PARSE_OK)
+                    return ret;
+            }
+            r->depth--;
+            return LEPT_PARSE_OK;
+        case CBOR_MAP:
+            if (n > (uint64_t)(r->end - r->p) / 2)
+                return LEPT_PARSE_INVALID_CBOR;
+            if (++r->depth > LEPT_DECODE_MAX_DEPTH)
+                return LEPT_PARSE_TOO_DEEP;
+            if (lept_set_object(v, (size_t)n) != 0)
+                return LEPT_PARSE_OUT_OF_MEMORY;
+            for (i = 0; i < n; i++) {
+                lept_member* m = &v->o.m[i];
+                uint64_t klen;
+                /* keys must be strings */
+                if ((ret = lept_cbor_read_head(r, &major, &info, &klen)) != LEPT_PARSE_OK)
+                    return ret;
+                if ((major != CBOR_TEXT && major != CBOR_BYTES) || klen > (uint64_t)(r->end - r->p))
+                    return LEPT_PARSE_INVALID_CBOR;
+                m->klen = (size_t)klen;
+                if ((m->k = lept_block_strdup(CURRENT_ALLOCATOR(), (const char*)r->p, m->klen)) == NULL)
+                    return LEPT_PARSE_OUT_OF_MEMORY;
+                r->p += klen;
+                lept_init(&m->v);
+                v->o.size++;
+                if ((ret = lept_cbor_decode_value(r, &m->v)) != LEPT_PARSE_OK)
+                    return ret;
+            }
+            r->depth--;
+            return LEPT_PARSE_OK;
+        case CBOR_TAG:
+            /* tags only add semantics, decode the tagged item */
+            if (++r->depth > LEPT_DECODE_MAX_DEPTH)
+                return LEPT_PARSE_TOO_DEEP;
+            ret = lept_cbor_decode_value(r, v);
+            r->depth--;
+            return ret;
+        default:
+            switch (info) {
+                case 20: lept_set_boolean(v, 0); return LEPT_PARSE_OK;
+                case 21: lept_set_boolean(v, 1); return LEPT_PARSE_OK;
+                case 22: /* null */
+                case 23: /* undefined */
+                    lept_set_null(v);
+                    return LEPT_PARSE_OK;
+                case 25:
+                    lept_set_number(v, lept_cbor_half((unsigned)n));
+                    return LEPT_PARSE_OK;
+                case 26: {
+                    uint32_t u = (uint32_t)n;
+                    float f;
+                    memcpy(&f, &u, sizeof(f));
+                    lept_set_number(v, f);
+                    return LEPT_PARSE_OK;
+                }
+                case 27: {
+                    double d;
+                    memcpy(&d, &n, sizeof(d));
+                    lept_set_number(v, d);
+                    return LEPT_PARSE_OK;
+                }
+                default:
+                    return LEPT_PARSE_INVALID_CBOR;
+            }
+    }
+}
+
+int lept_decode_cbor(lept_value* v, const char* data, size_t length) {
+    lept_cbor_reader r;
+    int ret;
+    assert(v != NULL && (data != NULL || length == 0));
+    r.p = (const unsigned char*)data;
+    r.end = r.p + length;
+    r.depth = 0;
+    lept_init(v);
+    if ((ret = lept_cbor_decode_value(&r, v)) == LEPT_PARSE_OK && r.p != r.end)
+        ret = LEPT_PARSE_ROOT_NOT_SINGULAR;
+    /* free whatever has been decoded so far */
+    if (ret != LEPT_PARSE_OK)
+        lept_free(v);
+    return ret;
+}
+
+/**************************************************************
+Snapshot image: header node-tree
+    header = "LEPTSNAP" version byte-order length root-node
+    node   = type flags size (number | offset) 24 bytes
+        string: size = length,   offset -> NUL-terminated bytes
+        array:  size = elements, offset -> size nodes
+        object: size = members,  offset -> size members [index]
+    member = key-offset key-length node        40 bytes
+    index  = size member numbers ordered by key length, then key bytes
+Offsets are relative to the node (or member) holding them, so the image
+can be mapped at any address. Everything is 8-byte aligned.
+Version 1 images have no index and are still read.
+****************************************************************/
+#define LEPT_SNAPSHOT_MAGIC "LEPTSNAP"
+#define LEPT_SNAPSHOT_VERSION 2
+/* the object node is followed by an index of its keys */
+#define LEPT_SNAPSHOT_INDEXED 0x01u
+#define LEPT_SNAPSHOT_BYTE_ORDER 0x01020304u
+/* round up to the alignment of the image */
+#define LEPT_SNAPSHOT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct lept_snapshot_node {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t size;
+    union { double n; int64_t off; } u;
+};
+
+typedef struct {
+    int64_t koff;
+    uint64_t klen;
+    lept_snapshot_node v;
+} lept_snapshot_member;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t length;
+    lept_snapshot_node root;
+} lept_snapshot_header;
+
+struct lept_snapshot {
+    const char* base;
+    size_t length;
+    int mapped; /* base comes from mmap() rather than the allocator */
+    const lept_allocator* alloc;
+};
+
+/* resolve a self-relative offset */
+#define SNAPSHOT_AT(holder, off) ((const char*)(holder) + (off))
+
+/* reserve zeroed, aligned room in the image and return its offset */
+static size_t lept_snapshot_reserve(lept_context* c, size_t size) {
+    size_t off = c->top;
+    void* p;
+    size = LEPT_SNAPSHOT_ALIGN(size);
+    if (size > 0 && (p = lept_context_push(c, size)) != NULL)
+        memset(p, 0, size);
+    return off;
+}
+
+/* order of the index: key length, then key bytes, then the member number so the first duplicate wins */
+static int lept_snapshot_compare(const void* lhs, const void* rhs) {
+    const lept_member* a = *(const lept_member* const*)lhs, *b = *(const lept_member* const*)rhs;
+    int d;
+    if (a->klen != b->klen)
+        return a->klen < b->klen ? -1 : 1;
+    if ((d = memcmp(a->k, b->k, a->klen)) != 0)
+        return d;
+    return a < b ? -1 : a > b;
+}
+
+/* append the index of the keys of v after its members */
+static void lept_snapshot_put_index(lept_context* c, size_t node_off, const lept_value* v) {
+    const lept_allocator* a = c->alloc;
+    const lept_member** order;
+    uint64_t* index;
+    size_t i, off;
+    if ((order = (const lept_member**)a->malloc(a->ctx, v->o.size * sizeof(lept_member*))) == NULL) {
+        c->oom = 1;
+        return;
+    }
+    for (i = 0; i < v->o.size; i++)
+        order[i] = &v->o.m[i];
+    qsort(order, v->o.size, sizeof(lept_member*), lept_snapshot_compare);
+    off = lept_snapshot_reserve(c, v->o.size * sizeof(uint64_t));
+    if (!c->oom) {
+        index = (uint64_t*)(c->stack + off);
+        for (i = 0; i < v->o.size; i++)
+            index[i] = (uint64_t)(order[i] - v->o.m);
+        ((lept_snapshot_node*)(c->stack + node_off))->flags |= LEPT_SNAPSHOT_INDEXED;
+    }
+    a->free(a->ctx, order);
+}
+
+/* fill the node at offset node_off and append its payload */
+static void lept_snapshot_put(lept_context* c, size_t node_off, const lept_value* v) {
+    lept_snapshot_node* node = (lept_snapshot_node*)(c->stack + node_off);
+    lept_value tmp;
+    size_t i, off;
+    node->type = (uint32_t)v->type;
     switch (v->type) {
+        case LEPT_NUMBER:
+            node->u.n = lept_get_number(v);
+            break;
         case LEPT_STRING:
-            free(v->s.s);
+            node->size = v->s.len;
+            off = lept_snapshot_reserve(c, v->s.len + 1);
+            if (c->oom)
+                return;
+            memcpy(c->stack + off, v->s.s, v->s.len);
+            ((lept_snapshot_node*)(c->stack + node_off))->u.off = (int64_t)(off - node_off);
             break;
         case LEPT_ARRAY:
-            /* free the memory of each element */
+            node->size = v->a.size;
+            off = lept_snapshot_reserve(c, v->a.size * sizeof(lept_snapshot_node));
+            if (c->oom)
+                return;
+            ((lept_snapshot_node*)(c->stack + node_off))->u.off = (int64_t)(off - node_off);
             for (i = 0; i < v->a.size; i++)
-                lept_free(&v->a.e[i]);
+                lept_snapshot_put(c, off + i * sizeof(lept_snapshot_node), lept_array_at(v, i, &tmp));
+            break;
+        case LEPT_OBJECT:
+            node->size = v->o.size;
+            off = lept_snapshot_reserve(c, v->o.size * sizeof(lept_snapshot_member));
+            if (c->oom)
+                return;
+            ((lept_snapshot_node*)(c->stack + node_off))->u.off = (int64_t)(off - node_off);
+            /* larger objects are looked up by binary search, the index directly follows the members */
+            if (v->o.size >= LEPT_SNAPSHOT_INDEX_MIN) {
+                lept_snapshot_put_index(c, node_off, v);
+                if (c->oom)
+                    return;
+            }
+            for (i = 0; i < v->o.size; i++) {
+                size_t m_off = off + i * sizeof(lept_snapshot_member);
+                size_t k_off = lept_snapshot_reserve(c, v->o.m[i].klen + 1);
+                lept_snapshot_member* m;
+                if (c->oom)
+                    return;
+                m = (lept_snapshot_member*)(c->stack + m_off);
+                memcpy(c->stack + k_off, v->o.m[i].k, v->o.m[i].klen);
+                m->koff = (int64_t)(k_off - m_off);
+                m->klen = v->o.m[i].klen;
+                lept_snapshot_put(c, m_off + offsetof(lept_snapshot_member, v), &v->o.m[i].v);
+            }
+            break;
+        default: break;
+    }
+}
+
+/* build the image of v in c->stack[0, c->top), returns 0 when out of memory */
+static int lept_snapshot_build(lept_context* c, const lept_value* v) {
+    lept_snapshot_header* h;
+    lept_context_init(c, CURRENT_ALLOCATOR());
+    lept_snapshot_reserve(c, sizeof(lept_snapshot_header));
+    if (!c->oom)
+        lept_snapshot_put(c, offsetof(lept_snapshot_header, root), v);
+    if (lept_context_finish(c) == NULL)
+        return 0;
+    h = (lept_snapshot_header*)c->stack;
+    memcpy(h->magic, LEPT_SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->version = LEPT_SNAPSHOT_VERSION;
+    h->byte_order = LEPT_SNAPSHOT_BYTE_ORDER;
+    h->length = c->top;
+    return 1;
+}
+
+int lept_snapshot_write(const lept_value* v, const char* path) {
+    lept_context c;
+    FILE* fp;
+    int ret = 0;
+    assert(v != NULL && path != NULL);
+    /* build the image in memory */
+    if (!lept_snapshot_build(&c, v))
+        return -1;
+    /* write it out in one go */
+    if ((fp = fopen(path, "wb")) == NULL)
+        ret = -1;
+    else {
+        if (fwrite(c.stack, 1, c.top, fp) != c.top)
+            ret = -1;
+        if (fclose(fp) != 0)
+            ret = -1;
+    }
+    c.alloc->free(c.alloc->ctx, c.stack);
+    return ret;
+}
+
+lept_snapshot* lept_freeze(const lept_value* v) {
+    lept_context c;
+    lept_snapshot* s;
+    char* base;
+    assert(v != NULL);
+    if (!lept_snapshot_build(&c, v))
+        return NULL;
+    if ((s = (lept_snapshot*)c.alloc->malloc(c.alloc->ctx, sizeof(lept_snapshot))) == NULL) {
+        c.alloc->free(c.alloc->ctx, c.stack);
+        return NULL;
+    }
+    /* give the slack of the stack back, a failed shrink keeps the larger block */
+    if ((base = (char*)c.alloc->realloc(c.alloc->ctx, c.stack, c.size, c.top)) != NULL)
+        c.stack = base;
+    s->base = c.stack;
+    s->length = c.top;
+    s->mapped = 0;
+    s->alloc = c.alloc;
+    return s;
+}
+
+/* check the node at node_off and the payload it owns, which has to start at *next: the writer lays payloads
+   out depth first, so this keeps every offset in bounds and rules out cycles and shared payloads */
+static int lept_snapshot_check(const char* base, size_t length, size_t node_off, size_t* next, uint32_t version, size_t depth) {
+    const lept_snapshot_node* n = (const lept_snapshot_node*)(base + node_off);
+    uint32_t flags = n->type == LEPT_OBJECT && version >= 2 ? LEPT_SNAPSHOT_INDEXED : 0;
+    size_t off = *next, room = length - off, i;
+    if (n->type > LEPT_OBJECT || (n->flags & ~flags) != 0)
+        return 0;
+    if (n->type < LEPT_STRING)
+        return 1;
+    if (depth > LEPT_DECODE_MAX_DEPTH || n->u.off <= 0 || (uint64_t)n->u.off != off - node_off)
+        return 0;
+    switch (n->type) {
+        case LEPT_STRING:
+            if (n->size >= room || base[off + n->size] != '\0')
+                return 0;
+            *next = off + LEPT_SNAPSHOT_ALIGN((size_t)n->size + 1);
+            return 1;
+        case LEPT_ARRAY:
+            if (n->size > room / sizeof(lept_snapshot_node))
+                return 0;
+            *next = off + (size_t)n->size * sizeof(lept_snapshot_node);
+            for (i = 0; i < n->size; i++)
+                if (!lept_snapshot_check(base, length, off + i * sizeof(lept_snapshot_node), next, version, depth + 1))
+                    return 0;
+            return 1;
+        default:
+            flags = n->flags & LEPT_SNAPSHOT_INDEXED;
+            if (n->size > room / (sizeof(lept_snapshot_member) + (flags ? sizeof(uint64_t) : 0)))
+                return 0;
+            *next = off + (size_t)n->size * sizeof(lept_snapshot_member);
+            if (flags) {
+                const uint64_t* index = (const uint64_t*)(base + *next);
+                for (i = 0; i < n->size; i++)
+                    if (index[i] >= n->size)
+                        return 0;
+                *next += (size_t)n->size * sizeof(uint64_t);
+            }
+            for (i = 0; i < n->size; i++) {
+                size_t m_off = off + i * sizeof(lept_snapshot_member);
+                const lept_snapshot_member* m = (const lept_snapshot_member*)(base + m_off);
+                if (m->koff <= 0 || (uint64_t)m->koff != *next - m_off || m->klen >= length - *next || base[*next + m->klen] != '\0')
+                    return 0;
+                *next += LEPT_SNAPSHOT_ALIGN((size_t)m->klen + 1);
+                if (!lept_snapshot_check(base, length, m_off + offsetof(lept_snapshot_member, v), next, version, depth + 1))
+                    return 0;
+            }
+            return 1;
+    }
+}
+
+lept_snapshot* lept_snapshot_open(const char* path) {
+    const lept_allocator* a = CURRENT_ALLOCATOR();
+    lept_snapshot* s;
+    const lept_snapshot_header* h;
+    size_t next;
+    assert(path != NULL);
+    if ((s = (lept_snapshot*)a->malloc(a->ctx, sizeof(lept_snapshot))) == NULL)
+        return NULL;
+    s->alloc = a;
+#ifdef LEPT_HAVE_MMAP
+    {
+        struct stat st;
+        void* base;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            a->free(a->ctx, s);
+            return NULL;
+        }
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(lept_snapshot_header) ||
+            (base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            close(fd);
+            a->free(a->ctx, s);
+            return NULL;
+        }
+        /* the mapping stays valid after the descriptor is closed */
+        close(fd);
+        s->base = (const char*)base;
+        s->length = (size_t)st.st_size;
+        s->mapped = 1;
+    }
+#else
+    {
+        FILE* fp = fopen(path, "rb");
+        long size;
+        char* base;
+        if (fp == NULL) {
+            a->free(a->ctx, s);
+            return NULL;
+        }
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        rewind(fp);
+        if (size < (long)sizeof(lept_snapshot_header) || (base = (char*)a->malloc(a->ctx, (size_t)size)) == NULL) {
+            fclose(fp);
+            a->free(a->ctx, s);
+            return NULL;
+        }
+        if (fread(base, 1, (size_t)size, fp) != (size_t)size) {
+            fclose(fp);
+            a->free(a->ctx, base);
+            a->free(a->ctx, s);
+            return NULL;
+        }
+        fclose(fp);
+        s->base = base;
+        s->length = (size_t)size;
+        s->mapped = 0;
+    }
+#endif
+    /* the whole image is checked once, so the getters can follow its offsets without bounds checks */
+    h = (const lept_snapshot_header*)s->base;
+    next = sizeof(lept_snapshot_header);
+    if (memcmp(h->magic, LEPT_SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->version < 1 || h->version > LEPT_SNAPSHOT_VERSION ||
+        h->byte_order != LEPT_SNAPSHOT_BYTE_ORDER || h->length != s->length || s->length % 8 != 0 ||
+        !lept_snapshot_check(s->base, s->length, offsetof(lept_snapshot_header, root), &next, h->version, 0) || next != s->length) {
+        lept_snapshot_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+void lept_snapshot_close(lept_snapshot* s) {
+    const lept_allocator* a;
+    if (s == NULL)
+        return;
+    a = s->alloc;
+#ifdef LEPT_HAVE_MMAP
+    if (s->mapped)
+        munmap((void*)s->base, s->length);
+    else
+#endif
+        a->free(a->ctx, (void*)s->base);
+    a->free(a->ctx, s);
+}
+
+const lept_snapshot_node* lept_snapshot_root(const lept_snapshot* s) {
+    assert(s != NULL);
+    return &((const lept_snapshot_header*)s->base)->root;
+}
+
+int lept_snapshot_get_type(const lept_snapshot_node* n) {
+    assert(n != NULL);
+    return (int)n->type;
+}
+
+int lept_snapshot_get_boolean(const lept_snapshot_node* n) {
+    assert(n != NULL && (n->type == LEPT_TRUE || n->type == LEPT_FALSE));
+    return n->type == LEPT_TRUE ? 1 : 0;
+}
+
+double lept_snapshot_get_number(const lept_snapshot_node* n) {
+    assert(n != NULL && n->type == LEPT_NUMBER);
+    return n->u.n;
+}
+
+const char* lept_snapshot_get_string(const lept_snapshot_node* n) {
+    assert(n != NULL && n->type == LEPT_STRING);
+    return SNAPSHOT_AT(n, n->u.off);
+}
+
+size_t lept_snapshot_get_string_length(const lept_snapshot_node* n) {
+    assert(n != NULL && n->type == LEPT_STRING);
+    return (size_t)n->size;
+}
+
+size_t lept_snapshot_get_array_size(const lept_snapshot_node* n) {
+    assert(n != NULL && n->type == LEPT_ARRAY);
+    return (size_t)n->size;
+}
+
+const lept_snapshot_node* lept_snapshot_get_array_element(const lept_snapshot_node* n, size_t index) {
+    assert(n != NULL && n->type == LEPT_ARRAY);
+    assert(index < n->size);
+    return (const lept_snapshot_node*)SNAPSHOT_AT(n, n->u.off) + index;
+}
+
+size_t lept_snapshot_get_object_size(const lept_snapshot_node* n) {
+    assert(n != NULL && n->type == LEPT_OBJECT);
+    return (size_t)n->size;
+}
+
+/* the index-th member of an object node */
+static const lept_snapshot_member* lept_snapshot_member_at(const lept_snapshot_node* n, size_t index) {
+    assert(n != NULL && n->type == LEPT_OBJECT);
+    assert(index < n->size);
+    return (const lept_snapshot_member*)SNAPSHOT_AT(n, n->u.off) + index;
+}
+
+const char* lept_snapshot_get_object_key(const lept_snapshot_node* n, size_t index) {
+    const lept_snapshot_member* m = lept_snapshot_member_at(n, index);
+    return SNAPSHOT_AT(m, m->koff);
+}
+
+size_t lept_snapshot_get_object_key_length(const lept_snapshot_node* n, size_t index) {
+    return (size_t)lept_snapshot_member_at(n, index)->klen;
+}
+
+const lept_snapshot_node* lept_snapshot_get_object_value(const lept_snapshot_node* n, size_t index) {
+    return &lept_snapshot_member_at(n, index)->v;
+}
+
+size_t lept_snapshot_find_object_index(const lept_snapshot_node* n, const char* key, size_t klen) {
+    size_t i;
+    assert(n != NULL && n->type == LEPT_OBJECT && key != NULL);
+    /* binary search for the first member with the key in the index */
+    if (n->flags & LEPT_SNAPSHOT_INDEXED) {
+        const uint64_t* index = (const uint64_t*)((const lept_snapshot_member*)SNAPSHOT_AT(n, n->u.off) + n->size);
+        size_t lo = 0, hi = (size_t)n->size;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            const lept_snapshot_member* m = lept_snapshot_member_at(n, (size_t)index[mid]);
+            int d = m->klen != klen ? (m->klen < klen ? -1 : 1) : memcmp(SNAPSHOT_AT(m, m->koff), key, klen);
+            if (d < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < n->size) {
+            const lept_snapshot_member* m = lept_snapshot_member_at(n, (size_t)index[lo]);
+            if (m->klen == klen && memcmp(SNAPSHOT_AT(m, m->koff), key, klen) == 0)
+                return (size_t)index[lo];
+        }
+        return LEPT_KEY_NOT_EXIST;
+    }
+    /* find the key */
+    for (i = 0; i < n->size; i++) {
+        const lept_snapshot_member* m = lept_snapshot_member_at(n, i);
+        if (m->klen == klen && memcmp(SNAPSHOT_AT(m, m->koff), key, klen) == 0)
+            return i;
+    }
+    return LEPT_KEY_NOT_EXIST;
+}
+
+const lept_snapshot_node* lept_snapshot_find_object_value(const lept_snapshot_node* n, const char* key, size_t klen) {
+    size_t index = lept_snapshot_find_object_index(n, key, klen);
+    /* if the key is found return the value, else return NULL */
+    return index != LEPT_KEY_NOT_EXIST ? &lept_snapshot_member_at(n, index)->v : NULL;
+}
+
+int lept_snapshot_to_value(lept_value* v, const lept_snapshot_node* n) {
+    size_t i = 0;
+    assert(v != NULL && n != NULL);
+    switch (n->type) {
+        case LEPT_NULL:   lept_set_null(v); return 0;
+        case LEPT_FALSE:  lept_set_boolean(v, 0); return 0;
+        case LEPT_TRUE:   lept_set_boolean(v, 1); return 0;
+        case LEPT_NUMBER: lept_set_number(v, n->u.n); return 0;
+        case LEPT_STRING:
+            return lept_set_string(v, SNAPSHOT_AT(n, n->u.off), (size_t)n->size);
+        case LEPT_ARRAY:
+            if (lept_set_array(v, (size_t)n->size) != 0)
+                return -1;
+            for (i = 0; i < n->size; i++) {
+                lept_init(&v->a.e[i]);
+                v->a.size++;
+                if (lept_snapshot_to_value(&v->a.e[i], lept_snapshot_get_array_element(n, i)) != 0)
+                    break;
+            }
+            break;
+        case LEPT_OBJECT:
+            if (lept_set_object(v, (size_t)n->size) != 0)
+                return -1;
+            for (i = 0; i < n->size; i++) {
+                const lept_snapshot_member* m = lept_snapshot_member_at(n, i);
+                lept_member* dst = &v->o.m[i];
+                dst->klen = (size_t)m->klen;
+                if ((dst->k = lept_block_strdup(BLOCK_OF(v->o.m)->alloc, SNAPSHOT_AT(m, m->koff), dst->klen)) == NULL)
+                    break;
+                lept_init(&dst->v);
+                v->o.size++;
+                if (lept_snapshot_to_value(&dst->v, &m->v) != 0)
+                    break;
+            }
+            break;
+        default:
+            assert(0 && "invalid type");
+            return -1;
+    }
+    /* out of memory part way: nothing partial is left behind */
+    if (i < n->size) {
+        lept_free(v);
+        return -1;
+    }
+    return 0;
+}
+
+/* take a reference to the blocks of v */
+static void lept_retain(const lept_value* v) {
+    switch (v->type) {
+        case LEPT_NUMBER: if (v->literal) lept_block_retain(v->l.t); break;
+        case LEPT_STRING: lept_block_retain(v->s.s); break;
+        case LEPT_ARRAY:  lept_block_retain(v->a.e); break;
+        case LEPT_OBJECT: lept_block_retain(v->o.m); break;
+        default: break;
+    }
+}
+
+/* give v its own copy of a shared array/object block before it is written, the elements
+   (and keys) become shared instead so only the path down to the written value is copied;
+   the cached hash of the block is dropped. returns 0 when out of memory */
+static int lept_unshare(lept_value* v) {
+    lept_value old = *v;
+    size_t i;
+    /* writers get elements to point at, so a packed array is unpacked into a block of its own */
+    if (v->type == LEPT_ARRAY && v->packed) {
+        lept_value* e = (lept_value*)lept_block_alloc(BLOCK_OF(v->p.d)->alloc, v->a.capacity * sizeof(lept_value));
+        if (e == NULL)
+            return 0;
+        for (i = 0; i < v->a.size; i++) {
+            e[i].type = LEPT_NUMBER;
+            e[i].literal = 0;
+            e[i].n = v->p.d[i];
+        }
+        lept_block_drop(v->p.d);
+        v->a.e = e;
+        v->packed = 0;
+    }
+    else if (v->type == LEPT_ARRAY && BLOCK_SHARED(v->a.e)) {
+        lept_value* e = (lept_value*)lept_block_alloc(BLOCK_OF(v->a.e)->alloc, v->a.capacity * sizeof(lept_value));
+        if (e == NULL)
+            return 0;
+        memcpy(e, v->a.e, v->a.size * sizeof(lept_value));
+        for (i = 0; i < v->a.size; i++)
+            lept_retain(&e[i]);
+        v->a.e = e;
+        lept_free(&old);
+    }
+    else if (v->type == LEPT_OBJECT && BLOCK_SHARED(v->o.m)) {
+        lept_member* m = (lept_member*)lept_block_alloc(BLOCK_OF(v->o.m)->alloc, v->o.capacity * sizeof(lept_member));
+        if (m == NULL)
+            return 0;
+        memcpy(m, v->o.m, v->o.size * sizeof(lept_member));
+        for (i = 0; i < v->o.size; i++) {
+            lept_block_retain(m[i].k);
+            lept_retain(&m[i].v);
+        }
+        v->o.m = m;
+        lept_free(&old);
+    }
+    /* every writer comes through here, and the block is ours alone now */
+    if (v->type == LEPT_ARRAY && v->a.e != NULL && BLOCK_OF(v->a.e)->hash != LEPT_HASH_OPEN)
+        BLOCK_OF(v->a.e)->hash = 0;
+    else if (v->type == LEPT_OBJECT && v->o.m != NULL && BLOCK_OF(v->o.m)->hash != LEPT_HASH_OPEN)
+        BLOCK_OF(v->o.m)->hash = 0;
+    return 1;
+}
+
+/* e points into the unshared block of v and goes to a caller who may write through it at any
+   later time, so the block never keeps a hash again */
+static lept_value* lept_handed_out(lept_value* v, lept_value* e) {
+    if (e != NULL)
+        BLOCK_OF(v->type == LEPT_ARRAY ? (void*)v->a.e : (void*)v->o.m)->hash = LEPT_HASH_OPEN;
+    return e;
+}
+
+int lept_copy(lept_value* dst, const lept_value* src) {
+    assert(src != NULL && dst != NULL && src != dst);
+    /* share the blocks of src, they are copied by the first write to either value */
+    lept_retain(src);
+    /* free the memory of dst */
+    lept_free(dst);
+    /* copy the value directly, nothing is allocated so this cannot fail */
+    memcpy(dst, src, sizeof(lept_value));
+    return 0;
+}
+
+void lept_move(lept_value* dst, lept_value* src) {
+    assert(src != NULL && dst != NULL && src != dst);
+    /* free the memory of dst */
+    lept_free(dst);
+    /* move the memory of src to dst */
+    memcpy(dst, src, sizeof(lept_value));
+    /* reset the type of src to null */
+    lept_init(src);
+}
+
+void lept_swap(lept_value* lhs, lept_value* rhs) {
+    assert(lhs != NULL && rhs != NULL);
+    /* swap the memory of lhs and rhs by using a temporary variable */
+    if (lhs != rhs) {
+        lept_value temp;
+        memcpy(&temp, lhs, sizeof(lept_value));
+        memcpy(lhs,   rhs, sizeof(lept_value));
+        memcpy(rhs, &temp, sizeof(lept_value));
+    }
+}
+
+/* A slice [begin, end) of the elements or members of a container, run by any thread of the pool */
+typedef struct lept_task {
+    struct lept_task* next, *prev; /* neighbours in a deque */
+    void (*run)(struct lept_task* t);
+    void* ctx;
+    size_t begin, end;
+    uint64_t result;
+    char* text;      /* output of tasks writing text, result holds its length */
+    size_t* pending; /* tasks of the same split still to finish */
+} lept_task;
+
+#ifdef LEPT_HAVE_THREADS
+/* tasks of one thread: it pushes and pops at the bottom, newest first, the others steal the oldest
+   from the top; each deque has a lock of its own, so threads only meet on the one they steal from */
+typedef struct {
+    pthread_mutex_t lock;
+    lept_task* top, *bottom;
+    size_t size;
+} lept_deque;
+
+/* threads helping the caller; the lock is only taken to sleep until tasks are queued or a split is done */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t* threads;
+    lept_deque* deques; /* [0] shared by the threads outside the pool, then one per thread of it */
+    size_t count;
+    size_t queued, sleepers;
+    int stop;
+} lept_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0, 0 };
+
+/* deque of the calling thread */
+static LEPT_THREAD_LOCAL size_t lept_pool_self;
+
+/* queued counts tasks in every deque, sleepers the threads about to wait; each side writes its own
+   and then reads the other one, sequentially consistent, so a wake up is never missed */
+#define POOL_ADD(x, n) __atomic_add_fetch(&(x), (n), __ATOMIC_SEQ_CST)
+#define POOL_SUB(x, n) __atomic_sub_fetch(&(x), (n), __ATOMIC_SEQ_CST)
+#define POOL_LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define POOL_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+/* number of deques, set before any thread of the pool starts */
+#define POOL_DEQUES() (BLOCK_OF(lept_pool.deques)->size / sizeof(lept_deque))
+
+/* append the chain first..last of n tasks at the bottom */
+static void lept_deque_push(lept_deque* d, lept_task* first, lept_task* last, size_t n) {
+    pthread_mutex_lock(&d->lock);
+    first->prev = d->bottom;
+    last->next = NULL;
+    if (d->bottom != NULL)
+        d->bottom->next = first;
+    else
+        d->top = first;
+    d->bottom = last;
+    POOL_ADD(d->size, n);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* take the bottom task, or the top one when stealing; NULL when the deque is empty */
+static lept_task* lept_deque_take(lept_deque* d, int steal) {
+    lept_task* t;
+    if (POOL_LOAD(d->size) == 0)
+        return NULL;
+    pthread_mutex_lock(&d->lock);
+    if ((t = steal ? d->top : d->bottom) != NULL) {
+        if (steal) {
+            if ((d->top = t->next) != NULL)
+                d->top->prev = NULL;
+            else
+                d->bottom = NULL;
+        }
+        else {
+            if ((d->bottom = t->prev) != NULL)
+                d->bottom->next = NULL;
+            else
+                d->top = NULL;
+        }
+        POOL_SUB(d->size, 1);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+/* a task of the calling thread, else one stolen from the next deque that has any */
+static lept_task* lept_pool_take(void) {
+    size_t n = POOL_DEQUES(), i;
+    lept_task* t;
+    if ((t = lept_deque_take(&lept_pool.deques[lept_pool_self], 0)) == NULL)
+        for (i = 1; i < n && t == NULL; i++)
+            t = lept_deque_take(&lept_pool.deques[(lept_pool_self + i) % n], 1);
+    if (t != NULL)
+        POOL_SUB(lept_pool.queued, 1);
+    return t;
+}
+
+/* run a task, waking whoever waits for its split after the last one */
+static void lept_pool_run(lept_task* t) {
+    t->run(t);
+    if (POOL_SUB(*t->pending, 1) == 0) {
+        pthread_mutex_lock(&lept_pool.lock);
+        pthread_cond_broadcast(&lept_pool.wake);
+        pthread_mutex_unlock(&lept_pool.lock);
+    }
+}
+
+/* sleep until a task is queued, or until *pending drops to 0 when it is given */
+static void lept_pool_sleep(const size_t* pending) {
+    pthread_mutex_lock(&lept_pool.lock);
+    POOL_ADD(lept_pool.sleepers, 1);
+    while (POOL_LOAD(lept_pool.queued) == 0 && !lept_pool.stop && (pending == NULL || POOL_LOAD(*pending) > 0))
+        pthread_cond_wait(&lept_pool.wake, &lept_pool.lock);
+    POOL_SUB(lept_pool.sleepers, 1);
+    pthread_mutex_unlock(&lept_pool.lock);
+}
+
+static void* lept_pool_worker(void* arg) {
+    lept_task* t;
+    lept_pool_self = (size_t)(uintptr_t)arg;
+    for (;;) {
+        if ((t = lept_pool_take()) != NULL)
+            lept_pool_run(t);
+        else if (POOL_LOAD(lept_pool.stop))
+            break;
+        else
+            lept_pool_sleep(NULL);
+    }
+    return NULL;
+}
+#endif
+
+/* split [0, n) into tasks run by the pool and the caller; returns the finished tasks holding
+   their results, to be released with lept_block_free(), or NULL when n is too small to be worth it */
+static lept_task* lept_parallel_for(size_t n, void (*run)(lept_task*), void* ctx, size_t* count_out) {
+#ifdef LEPT_HAVE_THREADS
+    size_t count, chunk, pending, i;
+    lept_task* tasks;
+    if (lept_pool.count == 0 || n < LEPT_PARALLEL_GRAIN)
+        return NULL;
+    /* a few tasks per thread to even out uneven subtrees */
+    count = (lept_pool.count + 1) * 4;
+    if (count > LEPT_PARALLEL_MAX_TASKS)
+        count = LEPT_PARALLEL_MAX_TASKS;
+    if (count > n / (LEPT_PARALLEL_GRAIN / 4))
+        count = n / (LEPT_PARALLEL_GRAIN / 4);
+    chunk = (n + count - 1) / count;
+    count = (n + chunk - 1) / chunk;
+    /* kept off the stack, the walks recurse once per nesting level */
+    if ((tasks = (lept_task*)lept_block_alloc(CURRENT_ALLOCATOR(), count * sizeof(lept_task))) == NULL)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        tasks[i].run = run;
+        tasks[i].ctx = ctx;
+        tasks[i].begin = i * chunk;
+        tasks[i].end = i + 1 < count ? (i + 1) * chunk : n;
+        tasks[i].result = 0;
+        tasks[i].text = NULL;
+        tasks[i].pending = &pending;
+        tasks[i].next = i + 1 < count ? &tasks[i + 1] : NULL;
+        tasks[i].prev = i > 0 ? &tasks[i - 1] : NULL;
+    }
+    pending = count - 1;
+    /* queue all but the first task, which the caller runs itself, and wake sleeping threads to steal them;
+       counted first, so queued is never below the tasks in the deques */
+    POOL_ADD(lept_pool.queued, count - 1);
+    lept_deque_push(&lept_pool.deques[lept_pool_self], &tasks[1], &tasks[count - 1], count - 1);
+    if (POOL_LOAD(lept_pool.sleepers) > 0) {
+        pthread_mutex_lock(&lept_pool.lock);
+        pthread_cond_broadcast(&lept_pool.wake);
+        pthread_mutex_unlock(&lept_pool.lock);
+    }
+    run(&tasks[0]);
+    /* run our own tasks not stolen yet, newest first, then help anyone until ours are all done */
+    while (POOL_LOAD(pending) > 0) {
+        lept_task* t = lept_pool_take();
+        if (t != NULL)
+            lept_pool_run(t);
+        else
+            lept_pool_sleep(&pending);
+    }
+    *count_out = count;
+    return tasks;
+#else
+    return NULL;
+#endif
+}
+
+int lept_set_threads(size_t count) {
+#ifdef LEPT_HAVE_THREADS
+    size_t i;
+    /* stop the current pool */
+    if (lept_pool.threads != NULL) {
+        pthread_mutex_lock(&lept_pool.lock);
+        POOL_STORE(lept_pool.stop, 1);
+        pthread_cond_broadcast(&lept_pool.wake);
+        pthread_mutex_unlock(&lept_pool.lock);
+        for (i = 0; i < lept_pool.count; i++)
+            pthread_join(lept_pool.threads[i], NULL);
+        for (i = 0; i < POOL_DEQUES(); i++)
+            pthread_mutex_destroy(&lept_pool.deques[i].lock);
+        lept_block_free(lept_pool.threads);
+        lept_block_free(lept_pool.deques);
+        lept_pool.threads = NULL;
+        lept_pool.deques = NULL;
+        lept_pool.count = 0;
+        lept_pool.stop = 0;
+    }
+    /* the calling thread is one of them */
+    if (count <= 1)
+        return 0;
+    lept_pool.threads = (pthread_t*)lept_block_alloc(CURRENT_ALLOCATOR(), (count - 1) * sizeof(pthread_t));
+    lept_pool.deques = (lept_deque*)lept_block_alloc(CURRENT_ALLOCATOR(), count * sizeof(lept_deque));
+    if (lept_pool.threads == NULL || lept_pool.deques == NULL) {
+        lept_block_free(lept_pool.threads);
+        lept_block_free(lept_pool.deques);
+        lept_pool.threads = NULL;
+        lept_pool.deques = NULL;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        pthread_mutex_init(&lept_pool.deques[i].lock, NULL);
+        lept_pool.deques[i].top = lept_pool.deques[i].bottom = NULL;
+        lept_pool.deques[i].size = 0;
+    }
+    for (i = 0; i < count - 1; i++)
+        if (pthread_create(&lept_pool.threads[i], NULL, lept_pool_worker, (void*)(uintptr_t)(i + 1)) != 0)
+            break;
+    lept_pool.count = i;
+    if (i < count - 1) {
+        lept_set_threads(0);
+        return -1;
+    }
+    return 0;
+#else
+    return count <= 1 ? 0 : -1;
+#endif
+}
+
+/* a container stringified in slices, each into a context of its own */
+typedef struct {
+    const lept_value* v;
+    int indent_level, spaces_per_indent;
+    const lept_allocator* alloc;
+} lept_stringify_job;
+
+static void lept_stringify_task(lept_task* t) {
+    const lept_stringify_job* job = (const lept_stringify_job*)t->ctx;
+    lept_context c;
+    lept_context_init(&c, job->alloc);
+    lept_stringify_range(&c, job->v, t->begin, t->end, job->indent_level, job->spaces_per_indent);
+    if ((t->text = lept_context_finish(&c)) != NULL)
+        t->result = c.top;
+}
+
+/* stringify the elements or members of a container, in parallel when it is large;
+   the slices are joined in order, so the text is the same as from one thread */
+static void lept_stringify_children(lept_context* c, const lept_value* v, size_t n, int indent_level, int spaces_per_indent) {
+    lept_stringify_job job;
+    lept_task* tasks;
+    size_t count, i;
+    char* p;
+    job.v = v;
+    job.indent_level = indent_level;
+    job.spaces_per_indent = spaces_per_indent;
+    job.alloc = c->alloc;
+    if ((tasks = lept_parallel_for(n, lept_stringify_task, &job, &count)) == NULL) {
+        lept_stringify_range(c, v, 0, n, indent_level, spaces_per_indent);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        if (tasks[i].text == NULL)
+            c->oom = 1;
+        else {
+            if ((p = (char*)lept_context_push(c, (size_t)tasks[i].result)) != NULL)
+                memcpy(p, tasks[i].text, (size_t)tasks[i].result);
+            c->alloc->free(c->alloc->ctx, tasks[i].text);
+        }
+    }
+    lept_block_free(tasks);
+}
+
+/* free the elements or members [begin, end) of a container */
+static void lept_free_range(lept_value* v, size_t begin, size_t end) {
+    size_t i;
+    if (v->type == LEPT_ARRAY)
+        for (i = begin; i < end; i++)
+            lept_free(&v->a.e[i]);
+    else
+        for (i = begin; i < end; i++) {
+            lept_block_drop(v->o.m[i].k);
+            lept_free(&v->o.m[i].v);
+        }
+}
+
+static void lept_free_task(lept_task* t) {
+    lept_free_range((lept_value*)t->ctx, t->begin, t->end);
+}
+
+/* free the elements or members of a container, in parallel when it is large */
+static void lept_free_children(lept_value* v, size_t n) {
+    size_t count;
+    lept_task* tasks = lept_parallel_for(n, lept_free_task, v, &count);
+    if (tasks == NULL)
+        lept_free_range(v, 0, n);
+    lept_block_free(tasks);
+}
+
+void lept_free(lept_value* v) {
+    assert(v != NULL);
+    size_t i;
+    /* free the memory */
+    switch (v->type) {
+        case LEPT_NUMBER:
+            if (v->literal)
+                lept_block_drop(v->l.t);
+            break;
+        case LEPT_STRING:
+            lept_block_drop(v->s.s);
+            break;
+        case LEPT_ARRAY:
+            /* a block still shared with a copy keeps its elements */
+            if (!lept_block_release(v->a.e))
+                break;
+            /* free the memory of each element, small arrays stay on this thread without extra stack frames;
+               the numbers of a packed array go with its block */
+            if (!v->packed) {
+                if (v->a.size >= LEPT_PARALLEL_GRAIN)
+                    lept_free_children(v, v->a.size);
+                else
+                    for (i = 0; i < v->a.size; i++)
+                        lept_free(&v->a.e[i]);
+            }
             /* free the memory of the array */
-            free(v->a.e);
+            lept_block_free(v->a.e);
+            break;
+        case LEPT_OBJECT:
+            if (!lept_block_release(v->o.m))
+                break;
+            /* free the memory of each member */
+            if (v->o.size >= LEPT_PARALLEL_GRAIN)
+                lept_free_children(v, v->o.size);
+            else
+                for (i = 0; i < v->o.size; i++) {
+                    lept_block_drop(v->o.m[i].k);
+                    lept_free(&v->o.m[i].v);
+                }
+            /* free the memory of the object */
+            lept_block_free(v->o.m);
+            break;
+        default: break;
+    }
+    v->type = LEPT_NULL;
+}
+
+#ifdef LEPT_HAVE_THREADS
+/* documents handed to lept_free_deferred(), freed in order by one background thread */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, space, idle;
+    pthread_t thread;
+    int running, stop;
+    lept_value queue[LEPT_RECLAIM_QUEUE_SIZE];
+    size_t head, count; /* ring buffer of waiting documents */
+    size_t busy;        /* documents being freed right now */
+} lept_reclaimer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                     0, 0, 0, { { { { NULL, 0 } }, LEPT_NULL, 0, 0 } }, 0, 0, 0 };
+
+static void* lept_reclaimer_main(void* arg) {
+    lept_value v;
+    pthread_mutex_lock(&lept_reclaimer.lock);
+    for (;;) {
+        while (lept_reclaimer.count == 0 && !lept_reclaimer.stop)
+            pthread_cond_wait(&lept_reclaimer.work, &lept_reclaimer.lock);
+        /* the queue is drained before stopping */
+        if (lept_reclaimer.count == 0)
+            break;
+        v = lept_reclaimer.queue[lept_reclaimer.head];
+        lept_reclaimer.head = (lept_reclaimer.head + 1) % LEPT_RECLAIM_QUEUE_SIZE;
+        lept_reclaimer.count--;
+        lept_reclaimer.busy++;
+        pthread_cond_signal(&lept_reclaimer.space);
+        pthread_mutex_unlock(&lept_reclaimer.lock);
+        lept_free(&v);
+        pthread_mutex_lock(&lept_reclaimer.lock);
+        if (--lept_reclaimer.busy == 0 && lept_reclaimer.count == 0)
+            pthread_cond_broadcast(&lept_reclaimer.idle);
+    }
+    pthread_mutex_unlock(&lept_reclaimer.lock);
+    return NULL;
+}
+#endif
+
+void lept_free_deferred(lept_value* v) {
+    assert(v != NULL);
+#ifdef LEPT_HAVE_THREADS
+    /* only containers are worth a trip to the reclaimer */
+    if (v->type == LEPT_ARRAY || v->type == LEPT_OBJECT) {
+        pthread_mutex_lock(&lept_reclaimer.lock);
+        if (!lept_reclaimer.running &&
+            pthread_create(&lept_reclaimer.thread, NULL, lept_reclaimer_main, NULL) == 0)
+            lept_reclaimer.running = 1;
+        if (lept_reclaimer.running) {
+            /* backpressure: wait for the reclaimer to catch up */
+            while (lept_reclaimer.count == LEPT_RECLAIM_QUEUE_SIZE)
+                pthread_cond_wait(&lept_reclaimer.space, &lept_reclaimer.lock);
+            lept_reclaimer.queue[(lept_reclaimer.head + lept_reclaimer.count) % LEPT_RECLAIM_QUEUE_SIZE] = *v;
+            lept_reclaimer.count++;
+            pthread_cond_signal(&lept_reclaimer.work);
+            pthread_mutex_unlock(&lept_reclaimer.lock);
+            /* detach, v no longer owns the tree */
+            lept_init(v);
+            return;
+        }
+        pthread_mutex_unlock(&lept_reclaimer.lock);
+    }
+#endif
+    /* no reclaimer thread, free here */
+    lept_free(v);
+}
+
+void lept_reclaim_flush(void) {
+#ifdef LEPT_HAVE_THREADS
+    pthread_mutex_lock(&lept_reclaimer.lock);
+    while (lept_reclaimer.count > 0 || lept_reclaimer.busy > 0)
+        pthread_cond_wait(&lept_reclaimer.idle, &lept_reclaimer.lock);
+    pthread_mutex_unlock(&lept_reclaimer.lock);
+#endif
+}
+
+void lept_reclaim_shutdown(void) {
+#ifdef LEPT_HAVE_THREADS
+    pthread_mutex_lock(&lept_reclaimer.lock);
+    if (!lept_reclaimer.running) {
+        pthread_mutex_unlock(&lept_reclaimer.lock);
+        return;
+    }
+    lept_reclaimer.stop = 1;
+    pthread_cond_signal(&lept_reclaimer.work);
+    pthread_mutex_unlock(&lept_reclaimer.lock);
+    pthread_join(lept_reclaimer.thread, NULL);
+    /* a lept_free_deferred() racing with the shutdown reads these under the lock */
+    pthread_mutex_lock(&lept_reclaimer.lock);
+    lept_reclaimer.running = lept_reclaimer.stop = 0;
+    pthread_mutex_unlock(&lept_reclaimer.lock);
+#endif
+}
+
+/* A document replaced under concurrent readers. Readers count themselves in the
+   counter picked by the parity of the epoch they entered in; a publisher swaps
+   the document, moves the epoch on and waits for the counter of the previous
+   parity to drain (a grace period) before freeing the old document. */
+struct lept_atomic_doc {
+    lept_value* current;  /* published document, never NULL */
+    size_t epoch;         /* bumped by every publish */
+    size_t readers[2];    /* readers inside, by parity of their epoch */
+    const lept_allocator* alloc;
+#ifdef LEPT_HAVE_THREADS
+    pthread_mutex_t publish; /* one publisher at a time */
+#endif
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define EPOCH_LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define EPOCH_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define EPOCH_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define EPOCH_EXCHANGE(x, p) __atomic_exchange_n(&(x), (p), __ATOMIC_SEQ_CST)
+#else
+#define EPOCH_LOAD(x) (x)
+#define EPOCH_INC(x) (++(x))
+#define EPOCH_DEC(x) (--(x))
+#define EPOCH_EXCHANGE(x, p) lept_epoch_exchange(&(x), (p))
+static lept_value* lept_epoch_exchange(lept_value** x, lept_value* p) { lept_value* old = *x; *x = p; return old; }
+#endif
+
+lept_atomic_doc* lept_atomic_doc_create(void) {
+    const lept_allocator* a = CURRENT_ALLOCATOR();
+    lept_atomic_doc* d;
+    if ((d = (lept_atomic_doc*)a->malloc(a->ctx, sizeof(lept_atomic_doc))) == NULL)
+        return NULL;
+    if ((d->current = (lept_value*)a->malloc(a->ctx, sizeof(lept_value))) == NULL) {
+        a->free(a->ctx, d);
+        return NULL;
+    }
+    lept_init(d->current);
+    d->epoch = 0;
+    d->readers[0] = d->readers[1] = 0;
+    d->alloc = a;
+#ifdef LEPT_HAVE_THREADS
+    pthread_mutex_init(&d->publish, NULL);
+#endif
+    return d;
+}
+
+void lept_atomic_doc_destroy(lept_atomic_doc* d) {
+    const lept_allocator* a;
+    if (d == NULL)
+        return;
+    assert(d->readers[0] == 0 && d->readers[1] == 0);
+    a = d->alloc;
+    lept_free(d->current);
+    a->free(a->ctx, d->current);
+#ifdef LEPT_HAVE_THREADS
+    pthread_mutex_destroy(&d->publish);
+#endif
+    a->free(a->ctx, d);
+}
+
+const lept_value* lept_atomic_doc_acquire(lept_atomic_doc* d, int* slot) {
+    size_t e;
+    assert(d != NULL && slot != NULL);
+    /* count in before reading the document; retry if a publish moved the epoch meanwhile,
+       its grace period may not have seen this reader */
+    for (;;) {
+        e = EPOCH_LOAD(d->epoch);
+        EPOCH_INC(d->readers[e & 1]);
+        if (EPOCH_LOAD(d->epoch) == e)
+            break;
+        EPOCH_DEC(d->readers[e & 1]);
+    }
+    *slot = (int)(e & 1);
+    return EPOCH_LOAD(d->current);
+}
+
+void lept_atomic_doc_release(lept_atomic_doc* d, int slot) {
+    assert(d != NULL && (slot == 0 || slot == 1));
+    EPOCH_DEC(d->readers[slot]);
+}
+
+int lept_atomic_doc_publish(lept_atomic_doc* d, lept_value* v) {
+    const lept_allocator* a;
+    lept_value* next, *old;
+    size_t e;
+    assert(d != NULL && v != NULL);
+    a = d->alloc;
+    if ((next = (lept_value*)a->malloc(a->ctx, sizeof(lept_value))) == NULL)
+        return -1;
+    lept_init(next);
+    lept_move(next, v);
+#ifdef LEPT_HAVE_THREADS
+    pthread_mutex_lock(&d->publish);
+#endif
+    /* readers entering from now on see the new document under the other parity */
+    old = EPOCH_EXCHANGE(d->current, next);
+    e = EPOCH_LOAD(d->epoch);
+    EPOCH_INC(d->epoch);
+    /* grace period: wait out the readers that may still hold old */
+    while (EPOCH_LOAD(d->readers[e & 1]) != 0) {
+#ifdef LEPT_HAVE_THREADS
+        sched_yield();
+#endif
+    }
+#ifdef LEPT_HAVE_THREADS
+    pthread_mutex_unlock(&d->publish);
+#endif
+    lept_free(old);
+    a->free(a->ctx, old);
+    return 0;
+}
+
+/* slot of a block in the table of lept_memory_usage() */
+#define LEPT_USAGE_SLOT(p, mask) ((size_t)(((uint64_t)(uintptr_t)(p) >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & (mask))
+
+/* blocks already counted by lept_memory_usage(), only shared blocks are kept: one held by a single
+   value cannot be met twice */
+typedef struct {
+    const void** seen; /* open addressing, NULL marks a free slot */
+    size_t count, mask;
+    size_t slack;
+    const lept_allocator* alloc; /* of the table */
+} lept_usage;
+
+/* nonzero the first time the block at p is met, a full table that cannot grow counts it again */
+static int lept_usage_first(lept_usage* u, const void* p) {
+    const lept_allocator* a = u->alloc;
+    size_t i, j;
+    if (REF_LOAD(BLOCK_OF(p)->refs) == 1)
+        return 1;
+    if (u->count * 2 >= u->mask) {
+        size_t mask = u->mask ? u->mask * 2 + 1 : 63;
+        const void** seen = (const void**)a->malloc(a->ctx, (mask + 1) * sizeof(const void*));
+        if (seen == NULL)
+            return 1;
+        memset((void*)seen, 0, (mask + 1) * sizeof(const void*));
+        for (i = 0; u->seen != NULL && i <= u->mask; i++)
+            if (u->seen[i] != NULL) {
+                for (j = LEPT_USAGE_SLOT(u->seen[i], mask); seen[j] != NULL; j = (j + 1) & mask)
+                    ;
+                seen[j] = u->seen[i];
+            }
+        if (u->seen != NULL)
+            a->free(a->ctx, (void*)u->seen);
+        u->seen = seen;
+        u->mask = mask;
+    }
+    for (i = LEPT_USAGE_SLOT(p, u->mask); u->seen[i] != NULL; i = (i + 1) & u->mask)
+        if (u->seen[i] == p)
+            return 0;
+    u->seen[i] = p;
+    u->count++;
+    return 1;
+}
+
+static size_t lept_usage_walk(lept_usage* u, const lept_value* v) {
+    size_t i, bytes = 0;
+    switch (v->type) {
+        case LEPT_NUMBER:
+            if (v->literal && lept_usage_first(u, v->l.t))
+                bytes = sizeof(lept_block) + v->l.len + 1;
+            break;
+        case LEPT_STRING:
+            if (lept_usage_first(u, v->s.s))
+                bytes = sizeof(lept_block) + v->s.len + 1;
+            break;
+        case LEPT_ARRAY:
+            /* an empty array may have no block, a shared one has had its elements counted */
+            if (v->a.capacity == 0 || !lept_usage_first(u, v->a.e))
+                break;
+            if (v->packed) {
+                u->slack += (v->a.capacity - v->a.size) * sizeof(double);
+                bytes = sizeof(lept_block) + v->a.capacity * sizeof(double);
+                break;
+            }
+            /* the whole capacity is allocated, the part beyond size is slack */
+            u->slack += (v->a.capacity - v->a.size) * sizeof(lept_value);
+            bytes = sizeof(lept_block) + v->a.capacity * sizeof(lept_value);
+            for (i = 0; i < v->a.size; i++)
+                bytes += lept_usage_walk(u, &v->a.e[i]);
             break;
         case LEPT_OBJECT:
-            /* free the memory of each member */
+            if (v->o.capacity == 0 || !lept_usage_first(u, v->o.m))
+                break;
+            u->slack += (v->o.capacity - v->o.size) * sizeof(lept_member);
+            bytes = sizeof(lept_block) + v->o.capacity * sizeof(lept_member);
             for (i = 0; i < v->o.size; i++) {
-                free(v->o.m[i].k);
-                lept_free(&v->o.m[i].v);
+                if (lept_usage_first(u, v->o.m[i].k))
+                    bytes += sizeof(lept_block) + v->o.m[i].klen + 1;
+                bytes += lept_usage_walk(u, &v->o.m[i].v);
             }
-            /* free the memory of the object */
-            free(v->o.m);
             break;
         default: break;
     }
-    v->type = LEPT_NULL;
+    return bytes;
+}
+
+/* blocks shared by copies inside v are counted once */
+size_t lept_memory_usage(const lept_value* v, size_t* slack) {
+    lept_usage u;
+    size_t bytes;
+    assert(v != NULL);
+    u.seen = NULL;
+    u.count = u.mask = u.slack = 0;
+    u.alloc = CURRENT_ALLOCATOR();
+    bytes = lept_usage_walk(&u, v);
+    if (u.seen != NULL)
+        u.alloc->free(u.alloc->ctx, (void*)u.seen);
+    if (slack)
+        *slack = u.slack;
+    return bytes;
 }
 
 int lept_get_type(const lept_value* v) {
@@ -725,8 +3798,81 @@ int lept_get_type(const lept_value* v) {
     return v->type;
 }
 
-int lept_is_equal(const lept_value* lhs, const lept_value* rhs) {
+/* two containers compared slice by slice */
+typedef struct {
+    const lept_value* lhs, *rhs;
+    size_t differs; /* set by the first slice that finds a difference, the others stop early */
+} lept_equal_ctx;
+
+/* compare the elements or members [begin, end) of lhs with rhs, both of the same type and size */
+static int lept_equal_range(lept_equal_ctx* e, size_t begin, size_t end) {
+    const lept_value* lhs = e->lhs, *rhs = e->rhs;
+    lept_value ltmp, rtmp;
     size_t i, j;
+    for (i = begin; i < end; i++) {
+        if (REF_LOAD(e->differs))
+            return 0;
+        if (lhs->type == LEPT_ARRAY) {
+            if (!lept_is_equal(lept_array_at(lhs, i, &ltmp), lept_array_at(rhs, i, &rtmp)))
+                return 0;
+            continue;
+        }
+        /* find the member in rhs according to the key of lhs */
+        for (j = 0; j < rhs->o.size; j++)
+            if (lhs->o.m[i].klen == rhs->o.m[j].klen &&
+                memcmp(lhs->o.m[i].k, rhs->o.m[j].k, lhs->o.m[i].klen) == 0)
+                break;
+        /* if the member is not found, or the values differ, return false */
+        if (j == rhs->o.size || !lept_is_equal(&lhs->o.m[i].v, &rhs->o.m[j].v))
+            return 0;
+    }
+    return 1;
+}
+
+static void lept_equal_task(lept_task* t) {
+    lept_equal_ctx* e = (lept_equal_ctx*)t->ctx;
+    if (!lept_equal_range(e, t->begin, t->end)) {
+        t->result = 1;
+        REF_INC(e->differs);
+    }
+}
+
+/* compare the elements or members of two containers, in parallel when they are large */
+static int lept_equal_children(const lept_value* lhs, const lept_value* rhs, size_t n) {
+    lept_equal_ctx e;
+    lept_task* tasks;
+    size_t count;
+    e.lhs = lhs;
+    e.rhs = rhs;
+    e.differs = 0;
+    if ((tasks = lept_parallel_for(n, lept_equal_task, &e, &count)) == NULL)
+        return lept_equal_range(&e, 0, n);
+    lept_block_free(tasks);
+    return e.differs == 0;
+}
+
+/* block of a string or container, NULL for other values and empty containers */
+static lept_block* lept_value_block(const lept_value* v) {
+    void* p = v->type == LEPT_STRING ? (void*)v->s.s : v->type == LEPT_ARRAY ? (void*)v->a.e :
+              v->type == LEPT_OBJECT ? (void*)v->o.m : NULL;
+    return p != NULL ? BLOCK_OF(p) : NULL;
+}
+
+/* hash kept by the block of v, 0 if it has not been computed since the block was last written
+   or it is never kept */
+static uint64_t lept_cached_hash(const lept_value* v) {
+    lept_block* b = lept_value_block(v);
+    uint64_t h = b != NULL ? HASH_LOAD(b->hash) : 0;
+    return h != LEPT_HASH_OPEN ? h : 0;
+}
+
+/* both containers have a cached hash and they differ, so the containers do */
+static int lept_hashes_differ(const lept_value* lhs, const lept_value* rhs) {
+    uint64_t a = lept_cached_hash(lhs), b = lept_cached_hash(rhs);
+    return a != 0 && b != 0 && a != b;
+}
+
+int lept_is_equal(const lept_value* lhs, const lept_value* rhs) {
     assert(lhs != NULL && rhs != NULL);
     /* if the types are different, return false */
     if (lhs->type != rhs->type)
@@ -735,44 +3881,343 @@ int lept_is_equal(const lept_value* lhs, const lept_value* rhs) {
     switch (lhs->type) {
         case LEPT_NUMBER:
             /* compare the values of the numbers */
-            return lhs->n == rhs->n;
+            return lept_get_number(lhs) == lept_get_number(rhs);
         case LEPT_STRING:
             /* compare the length and content of the string */
             return lhs->s.len == rhs->s.len &&
-                memcmp(lhs->s.s, rhs->s.s, lhs->s.len) == 0;
+                (lhs->s.s == rhs->s.s || memcmp(lhs->s.s, rhs->s.s, lhs->s.len) == 0);
         case LEPT_ARRAY:
             /* compare the size of the array */
             if (lhs->a.size != rhs->a.size)
                 return 0;
+            /* copies sharing a block are equal */
+            if (lhs->a.e == rhs->a.e)
+                return 1;
+            if (lept_hashes_differ(lhs, rhs))
+                return 0;
             /* compare the elements of the array */
-            for (i = 0; i < lhs->a.size; i++)
-                if (!lept_is_equal(&lhs->a.e[i], &rhs->a.e[i]))
-                    return 0;
-            return 1;
+            return lept_equal_children(lhs, rhs, lhs->a.size);
         case LEPT_OBJECT:
             /* compare the size of the object */
             if (lhs->o.size != rhs->o.size)
                 return 0;
+            if (lhs->o.m == rhs->o.m)
+                return 1;
+            if (lept_hashes_differ(lhs, rhs))
+                return 0;
             /* compare the members of the object */
-            for (i = 0; i < lhs->o.size; i++) {
-                /* find the member in rhs according to the key of lhs */
-                for (j = 0; j < rhs->o.size; j++)
-                    if (lhs->o.m[i].klen == rhs->o.m[j].klen &&
-                        memcmp(lhs->o.m[i].k, rhs->o.m[j].k, lhs->o.m[i].klen) == 0)
-                        break;
-                /* if the member is not found, return false */
-                if (j == rhs->o.size)
-                    return 0;
-                /* compare the value of the member */
-                if (!lept_is_equal(&lhs->o.m[i].v, &rhs->o.m[j].v))
-                    return 0;
-            }
-            return 1;
+            return lept_equal_children(lhs, rhs, lhs->o.size);
         default:
             return 1;
     }
 }
 
+/* 64-bit finalizer of splitmix64 */
+static uint64_t lept_hash_mix(uint64_t x) {
+    x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27; x *= 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/* FNV-1a, continued over more bytes */
+#define LEPT_FNV_BASIS 0xCBF29CE484222325ULL
+static uint64_t lept_hash_update(uint64_t h, const char* s, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 0x100000001B3ULL;
+    return h;
+}
+
+/* FNV-1a of a string */
+static uint64_t lept_hash_bytes(const char* s, size_t len) {
+    return lept_hash_update(LEPT_FNV_BASIS, s, len);
+}
+
+/* sum of the hashes of the elements or members [begin, end), the sum keeps slices independent */
+static uint64_t lept_hash_range(const lept_value* v, size_t begin, size_t end) {
+    lept_value tmp;
+    uint64_t h = 0;
+    size_t i;
+    if (v->type == LEPT_ARRAY)
+        /* elements are mixed with their index, order matters */
+        for (i = begin; i < end; i++)
+            h += lept_hash_mix(lept_hash(lept_array_at(v, i, &tmp)) + i * 0x9E3779B97F4A7C15ULL);
+    else
+        /* members are not, order does not matter just like in lept_is_equal() */
+        for (i = begin; i < end; i++)
+            h += lept_hash_mix(lept_hash_bytes(v->o.m[i].k, v->o.m[i].klen) ^ lept_hash_mix(lept_hash(&v->o.m[i].v)));
+    return h;
+}
+
+static void lept_hash_task(lept_task* t) {
+    t->result = lept_hash_range((const lept_value*)t->ctx, t->begin, t->end);
+}
+
+/* hash the elements or members of a container, in parallel when it is large */
+static uint64_t lept_hash_children(const lept_value* v, size_t n) {
+    lept_task* tasks;
+    size_t count, i;
+    uint64_t h = 0;
+    if ((tasks = lept_parallel_for(n, lept_hash_task, (void*)v, &count)) == NULL)
+        return lept_hash_range(v, 0, n);
+    for (i = 0; i < count; i++)
+        h += tasks[i].result;
+    lept_block_free(tasks);
+    return h;
+}
+
+uint64_t lept_hash(const lept_value* v) {
+    lept_block* b;
+    double n;
+    uint64_t bits, h;
+    assert(v != NULL);
+    switch (v->type) {
+        case LEPT_NUMBER:
+            /* 0.0 and -0.0 are equal, so they must hash alike */
+            n = lept_get_number(v);
+            n = n == 0.0 ? 0.0 : n;
+            memcpy(&bits, &n, sizeof(bits));
+            return lept_hash_mix(bits ^ LEPT_NUMBER);
+        case LEPT_STRING:
+        case LEPT_ARRAY:
+        case LEPT_OBJECT:
+            /* the hash of a block is kept until a writer unshares it */
+            if ((h = lept_cached_hash(v)) != 0)
+                return h;
+            if (v->type == LEPT_STRING)
+                h = lept_hash_mix(lept_hash_bytes(v->s.s, v->s.len) ^ LEPT_STRING);
+            else if (v->type == LEPT_ARRAY)
+                h = lept_hash_mix(lept_hash_children(v, v->a.size) + v->a.size) ^ LEPT_ARRAY;
+            else
+                h = lept_hash_mix(lept_hash_children(v, v->o.size) + v->o.size) ^ LEPT_OBJECT;
+            /* not kept in a block element pointers were handed out of, nor when it reads as a mark */
+            if ((b = lept_value_block(v)) != NULL && h > LEPT_HASH_OPEN && HASH_LOAD(b->hash) != LEPT_HASH_OPEN)
+                HASH_STORE(b->hash, h);
+            return h;
+        default:
+            return lept_hash_mix((uint64_t)v->type + 1);
+    }
+}
+
+/**************************************************************
+Canonical JSON (RFC 8785)
+    no whitespace, members sorted by the UTF-16 code units of their keys
+    numbers in the shortest form that reads back the same, as ECMAScript prints them
+    only '"', '\\' and control characters escaped, \b \t \n \f \r or \u00xx
+****************************************************************/
+typedef struct {
+    lept_context out;    /* the canonical text, or the part of it not hashed yet */
+    lept_context order;  /* sorted members of the open objects */
+    int hashing;
+    uint64_t hash;
+} lept_canonical;
+
+/* decode one code point, a byte that does not start a sequence stands for itself */
+static unsigned lept_utf8_next(const unsigned char** p, const unsigned char* end) {
+    const unsigned char* s = *p;
+    unsigned u = *s;
+    size_t n = u >= 0xF0 ? 3 : u >= 0xE0 ? 2 : u >= 0xC0 ? 1 : 0, i;
+    if ((size_t)(end - s) <= n)
+        n = 0;
+    if (n) {
+        u &= 0x3F >> n;
+        for (i = 1; i <= n; i++)
+            u = (u << 6) | (s[i] & 0x3F);
+    }
+    *p = s + n + 1;
+    return u;
+}
+
+/* member order of RFC 8785: keys compared as UTF-16 code units, not as code points */
+static int lept_canonical_compare(const void* lhs, const void* rhs) {
+    const lept_member* a = *(const lept_member* const*)lhs, *b = *(const lept_member* const*)rhs;
+    const unsigned char* p = (const unsigned char*)a->k, *pe = p + a->klen;
+    const unsigned char* q = (const unsigned char*)b->k, *qe = q + b->klen;
+    unsigned u, w;
+    while (p < pe && q < qe) {
+        if (*p < 0x80 && *q < 0x80) {
+            if (*p != *q)
+                return *p < *q ? -1 : 1;
+            p++, q++;
+            continue;
+        }
+        u = lept_utf8_next(&p, pe);
+        w = lept_utf8_next(&q, qe);
+        if (u == w)
+            continue;
+        /* code points above the BMP start with a high surrogate, below U+E000 */
+        if ((u >= 0x10000) != (w >= 0x10000)) {
+            int above = u >= 0x10000;
+            u = above ? 0xD800 + ((u - 0x10000) >> 10) : u;
+            w = above ? w : 0xD800 + ((w - 0x10000) >> 10);
+            /* an encoded lone high surrogate: its string has fewer code units so far */
+            if (u == w)
+                return above ? 1 : -1;
+        }
+        return u < w ? -1 : 1;
+    }
+    return (p < pe) - (q < qe);
+}
+
+/* shortest number that reads back as n, formatted as ECMAScript Number::toString, returns the length */
+static size_t lept_canonical_number(char* buffer, double n) {
+    char tmp[32], digits[20];
+    char* p = buffer;
+    size_t count = 0, i;
+    int precision, point;
+    /* non-finite numbers cannot be written as JSON */
+    if (n != n || n - n != 0.0) {
+        memcpy(buffer, "null", 4);
+        return 4;
+    }
+    if (n == 0.0) {
+        *buffer = '0';
+        return 1;
+    }
+    for (precision = 1; precision < 17; precision++) {
+        sprintf(tmp, "%.*e", precision - 1, n);
+        if (strtod(tmp, NULL) == n)
+            break;
+    }
+    sprintf(tmp, "%.*e", precision - 1, n);
+    /* [-]d[.ddd]e(+|-)xx, with the decimal point after digit number point */
+    for (i = n < 0; tmp[i] != 'e'; i++)
+        if (ISDIGIT(tmp[i]))
+            digits[count++] = tmp[i];
+    point = atoi(tmp + i + 1) + 1;
+    while (count > 1 && digits[count - 1] == '0')
+        count--;
+    if (n < 0)
+        *p++ = '-';
+    if ((int)count <= point && point <= 21) {
+        memcpy(p, digits, count);
+        memset(p + count, '0', point - count);
+        p += point;
+    }
+    else if (0 < point && point <= 21) {
+        memcpy(p, digits, point);
+        p[point] = '.';
+        memcpy(p + point + 1, digits + point, count - point);
+        p += count + 1;
+    }
+    else if (-6 < point && point <= 0) {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -point);
+        memcpy(p - point, digits, count);
+        p += count - point;
+    }
+    else {
+        *p++ = digits[0];
+        if (count > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, count - 1);
+            p += count - 1;
+        }
+        p += sprintf(p, "e%c%d", point > 0 ? '+' : '-', point > 0 ? point - 1 : 1 - point);
+    }
+    return (size_t)(p - buffer);
+}
+
+static void lept_canonical_value(lept_canonical* w, const lept_value* v) {
+    lept_context* c = &w->out;
+    lept_value tmp;
+    size_t i, base;
+    /* hash what has been written so far instead of keeping it */
+    if (w->hashing && c->top >= LEPT_PARSE_STRINGIFY_INIT_SIZE) {
+        w->hash = lept_hash_update(w->hash, c->stack, c->top);
+        c->top = 0;
+    }
+    switch (v->type) {
+        case LEPT_NULL:  PUTS(c, "null", 4); break;
+        case LEPT_FALSE: PUTS(c, "false", 5); break;
+        case LEPT_TRUE:  PUTS(c, "true", 4); break;
+        case LEPT_NUMBER: {
+            char* buffer = (char*)lept_context_push(c, 32);
+            if (buffer != NULL)
+                c->top -= 32 - lept_canonical_number(buffer, lept_get_number(v));
+            break;
+        }
+        case LEPT_STRING:
+            lept_stringify_string(c, v->s.s, v->s.len, 1);
+            break;
+        case LEPT_ARRAY:
+            PUTC(c, '[');
+            for (i = 0; i < v->a.size; i++) {
+                if (i > 0)
+                    PUTC(c, ',');
+                lept_canonical_value(w, lept_array_at(v, i, &tmp));
+            }
+            PUTC(c, ']');
+            break;
+        case LEPT_OBJECT: {
+            const lept_member** order;
+            PUTC(c, '{');
+            if (v->o.size == 0) {
+                PUTC(c, '}');
+                break;
+            }
+            /* sort pointers to the members, the object itself is left as it is */
+            base = w->order.top;
+            if ((order = (const lept_member**)lept_context_push(&w->order, v->o.size * sizeof(lept_member*))) == NULL) {
+                c->oom = 1;
+                break;
+            }
+            for (i = 0; i < v->o.size; i++)
+                order[i] = &v->o.m[i];
+            qsort(order, v->o.size, sizeof(lept_member*), lept_canonical_compare);
+            for (i = 0; i < v->o.size; i++) {
+                /* nested objects may move the order stack */
+                const lept_member* m = ((const lept_member**)(w->order.stack + base))[i];
+                if (i > 0)
+                    PUTC(c, ',');
+                lept_stringify_string(c, m->k, m->klen, 1);
+                PUTC(c, ':');
+                lept_canonical_value(w, &m->v);
+            }
+            w->order.top = base;
+            PUTC(c, '}');
+            break;
+        }
+        default:
+            assert(0 && "invalid type");
+    }
+}
+
+static void lept_canonical_run(lept_canonical* w, const lept_value* v, int hashing) {
+    const lept_allocator* a = CURRENT_ALLOCATOR();
+    lept_context_init(&w->out, a);
+    lept_context_init(&w->order, a);
+    w->hashing = hashing;
+    w->hash = LEPT_FNV_BASIS;
+    lept_canonical_value(w, v);
+    if (w->order.oom)
+        w->out.oom = 1;
+    if (w->order.stack != NULL)
+        a->free(a->ctx, w->order.stack);
+}
+
+char* lept_stringify_canonical(const lept_value* v, size_t* length) {
+    lept_canonical w;
+    assert(v != NULL);
+    lept_canonical_run(&w, v, 0);
+    if (length)
+        *length = w.out.top;
+    PUTC(&w.out, '\0');
+    return lept_context_finish(&w.out);
+}
+
+uint64_t lept_canonical_hash(const lept_value* v) {
+    lept_canonical w;
+    uint64_t h;
+    assert(v != NULL);
+    lept_canonical_run(&w, v, 1);
+    h = w.out.oom ? 0 : lept_hash_update(w.hash, w.out.stack, w.out.top);
+    if (w.out.stack != NULL)
+        w.out.alloc->free(w.out.alloc->ctx, w.out.stack);
+    return h;
+}
+
 int lept_get_boolean(const lept_value* v) {
     assert(v != NULL && (v->type == LEPT_TRUE || v->type == LEPT_FALSE));
     /* return 1 if the value is true, otherwise return 0 */
@@ -781,23 +4226,53 @@ int lept_get_boolean(const lept_value* v) {
 
 void lept_set_boolean(lept_value* v, int boolean) {
     assert(v != NULL);
+    /* free the memory */
+    lept_free(v);
     /* set the value's type */
     v->type = boolean ? LEPT_TRUE : LEPT_FALSE;
 }
 
 double lept_get_number(const lept_value* v) {
+    lept_block* b;
+    uint64_t bits;
+    double n;
     assert(v != NULL && v->type == LEPT_NUMBER);
+    /* convert a literal once, out of range ones give HUGE_VAL or 0 like strtod(); the block shared by
+       copies keeps the result, so only literals of +0 are converted again */
+    if (v->literal) {
+        b = BLOCK_OF(v->l.t);
+        if ((bits = HASH_LOAD(b->hash)) != 0) {
+            memcpy(&n, &bits, sizeof(n));
+            return n;
+        }
+        n = strtod(v->l.t, NULL);
+        memcpy(&bits, &n, sizeof(n));
+        HASH_STORE(b->hash, bits);
+        return n;
+    }
     /* return the number */
     return v->n;
 }
 void lept_set_number(lept_value* v, double number) {
     assert(v != NULL);
+    /* free the memory */
+    lept_free(v);
     /* set the value's type */
     v->type = LEPT_NUMBER;
+    v->literal = 0;
     /* set the number */
     v->n = number;
 }
 
+const char* lept_get_number_literal(const lept_value* v, size_t* len) {
+    assert(v != NULL && v->type == LEPT_NUMBER);
+    if (!v->literal)
+        return NULL;
+    if (len)
+        *len = v->l.len;
+    return v->l.t;
+}
+
 const char* lept_get_string(const lept_value* v) {
     assert(v != NULL && v->type == LEPT_STRING);
     /* return the string */
@@ -810,27 +4285,32 @@ size_t lept_get_string_length(const lept_value* v) {
     return v->s.len;
 }
 
-void lept_set_string(lept_value* v, const char* s, size_t len) {
+int lept_set_string(lept_value* v, const char* s, size_t len) {
     assert(v != NULL && (s != NULL || len == 0));
     /* free the memory */
     lept_free(v);
-    /* set the value's type */
-    /* set the string */
-    v->s.s = (char*)malloc(len + 1);
-    memcpy(v->s.s, s, len);
-    v->s.s[len] = '\0';
+    /* copy the string, the value stays null when out of memory */
+    if ((v->s.s = lept_block_strdup(CURRENT_ALLOCATOR(), s, len)) == NULL)
+        return -1;
     /* set the length of the string */
     v->s.len = len;
     v->type = LEPT_STRING;
+    return 0;
 }
 
-void lept_set_array(lept_value* v, size_t capacity) {
+int lept_set_array(lept_value* v, size_t capacity) {
+    lept_value* e = NULL;
     assert(v != NULL);
     lept_free(v);
+    /* the value stays null when out of memory */
+    if (capacity > 0 && (e = (lept_value*)lept_block_alloc(CURRENT_ALLOCATOR(), capacity * sizeof(lept_value))) == NULL)
+        return -1;
     v->type = LEPT_ARRAY;
+    v->packed = 0;
+    v->a.e = e;
     v->a.size = 0;
     v->a.capacity = capacity;
-    v->a.e = capacity > 0 ? (lept_value*)malloc(capacity * sizeof(lept_value)) : NULL;
+    return 0;
 }
 
 size_t lept_get_array_size(const lept_value* v) {
@@ -845,23 +4325,40 @@ size_t lept_get_array_capacity(const lept_value* v) {
 
 void lept_reserve_array(lept_value* v, size_t capacity) {
     assert(v != NULL && v->type == LEPT_ARRAY);
+    if (!lept_unshare(v))
+        return;
     /* if the capacity is more than the current capacity, reserve the memory */
     if (v->a.capacity < capacity) {
-        /* set the capacity */
+        /* grow with the allocator of the block, the capacity is kept when out of memory */
+        lept_value* e = v->a.e != NULL ?
+            (lept_value*)lept_block_realloc(v->a.e, capacity * sizeof(lept_value)) :
+            (lept_value*)lept_block_alloc(CURRENT_ALLOCATOR(), capacity * sizeof(lept_value));
+        if (e == NULL)
+            return;
+        v->a.e = e;
         v->a.capacity = capacity;
-        /* allocate the memory */
-        v->a.e = (lept_value*)realloc(v->a.e, capacity * sizeof(lept_value));
     }
 }
 
 void lept_shrink_array(lept_value* v) {
     assert(v != NULL && v->type == LEPT_ARRAY);
+    if (!lept_unshare(v))
+        return;
     /* if the size is less than the current capacity, shrink the memory */
     if (v->a.size < v->a.capacity) {
+        if (v->a.size == 0) {
+            lept_block_free(v->a.e);
+            v->a.e = NULL;
+        }
+        else {
+            /* reallocate the memory, a failed shrink keeps the old block */
+            lept_value* e = (lept_value*)lept_block_realloc(v->a.e, v->a.size * sizeof(lept_value));
+            if (e == NULL)
+                return;
+            v->a.e = e;
+        }
         /* set the capacity */
         v->a.capacity = v->a.size;
-        /* reallocate the memory */
-        v->a.e = (lept_value*)realloc(v->a.e, v->a.size * sizeof(lept_value));
     }
 }
 
@@ -874,34 +4371,70 @@ void lept_clear_array(lept_value* v) {
 lept_value* lept_get_array_element(lept_value* v, size_t index) {
     assert(v != NULL && v->type == LEPT_ARRAY);
     assert(index < v->a.size);
-    return &v->a.e[index];
+    /* the element may be written through the pointer */
+    if (!lept_unshare(v))
+        return NULL;
+    return lept_handed_out(v, &v->a.e[index]);
 }
 
-lept_value* lept_pushback_array_element(lept_value* v) {
+const lept_value* lept_peek_array_element(const lept_value* v, size_t index, lept_value* tmp) {
+    assert(v != NULL && v->type == LEPT_ARRAY && tmp != NULL);
+    assert(index < v->a.size);
+    return lept_array_at(v, index, tmp);
+}
+
+int lept_get_number_array(const lept_value* v, const double** numbers, size_t* size) {
+    assert(v != NULL && v->type == LEPT_ARRAY && numbers != NULL && size != NULL);
+    if (!v->packed)
+        return 0;
+    *numbers = v->p.d;
+    *size = v->a.size;
+    return 1;
+}
+
+/* append a null element for the library itself to write at once */
+static lept_value* lept_array_push(lept_value* v) {
     assert(v != NULL && v->type == LEPT_ARRAY);
+    if (!lept_unshare(v))
+        return NULL;
     /* if the size is equal to the capacity, reserve the memory */
     if (v->a.size == v->a.capacity)
         /* if the capacity is 0, set the capacity to 1, otherwise double the capacity */
         lept_reserve_array(v, v->a.capacity == 0 ? 1 : v->a.capacity * 2);
+    /* out of memory */
+    if (v->a.size == v->a.capacity)
+        return NULL;
     /* initialize the element */
     lept_init(&v->a.e[v->a.size]);
     /* returns the memory address of the added element and set size + 1 */
     return &v->a.e[v->a.size++];
 }
 
+lept_value* lept_pushback_array_element(lept_value* v) {
+    return lept_handed_out(v, lept_array_push(v));
+}
+
 void lept_popback_array_element(lept_value* v) {
     assert(v != NULL && v->type == LEPT_ARRAY && v->a.size > 0);
+    if (!lept_unshare(v))
+        return;
     /* free the memory and set size - 1 */
     lept_free(&v->a.e[--v->a.size]);
 }
 
-lept_value* lept_insert_array_element(lept_value* v, size_t index) {
+/* insert a null element for the library itself to write at once */
+static lept_value* lept_array_insert(lept_value* v, size_t index) {
     assert(v != NULL && v->type == LEPT_ARRAY && index <= v->a.size);
     size_t i;
+    if (!lept_unshare(v))
+        return NULL;
     /* if the size is equal to the capacity, reserve the memory */
     if (v->a.size == v->a.capacity) {
         /* if the capacity is 0, set the capacity to 1, otherwise double the capacity */
         lept_reserve_array(v, v->a.capacity == 0 ? 1 : v->a.capacity * 2);
+        /* out of memory */
+        if (v->a.size == v->a.capacity)
+            return NULL;
     }
     /* move the elements after the index to the right */
     for (i = v->a.size; i > index; i--)
@@ -914,9 +4447,15 @@ lept_value* lept_insert_array_element(lept_value* v, size_t index) {
     return &v->a.e[index];
 }
 
+lept_value* lept_insert_array_element(lept_value* v, size_t index) {
+    return lept_handed_out(v, lept_array_insert(v, index));
+}
+
 void lept_erase_array_element(lept_value* v, size_t index, size_t count) {
     assert(v != NULL && v->type == LEPT_ARRAY && index + count <= v->a.size);
     size_t i;
+    if (!lept_unshare(v))
+        return;
     /* free the elements */
     for (i = 0; i < count; i++)
         lept_free(&v->a.e[index + i]);
@@ -927,13 +4466,18 @@ void lept_erase_array_element(lept_value* v, size_t index, size_t count) {
     v->a.size -= count;
 }
 
-void lept_set_object(lept_value* v, size_t capacity) {
+int lept_set_object(lept_value* v, size_t capacity) {
+    lept_member* m = NULL;
     assert(v != NULL);
     lept_free(v);
+    /* the value stays null when out of memory */
+    if (capacity > 0 && (m = (lept_member*)lept_block_alloc(CURRENT_ALLOCATOR(), capacity * sizeof(lept_member))) == NULL)
+        return -1;
     v->type = LEPT_OBJECT;
+    v->o.m = m;
     v->o.size = 0;
     v->o.capacity = capacity;
-    v->o.m = capacity > 0 ? (lept_member*)malloc(capacity * sizeof(lept_member)) : NULL;
+    return 0;
 }
 
 size_t lept_get_object_size(const lept_value* v) {
@@ -947,32 +4491,49 @@ size_t lept_get_object_capacity(const lept_value* v) {
 
 void lept_reserve_object(lept_value* v, size_t capacity) {
     assert(v != NULL && v->type == LEPT_OBJECT);
+    if (!lept_unshare(v))
+        return;
     /* if the capacity is more than the current capacity, reserve the memory */
     if (capacity > v->o.capacity) {
-        /* set the capacity */
+        /* grow with the allocator of the block, the capacity is kept when out of memory */
+        lept_member* m = v->o.m != NULL ?
+            (lept_member*)lept_block_realloc(v->o.m, capacity * sizeof(lept_member)) :
+            (lept_member*)lept_block_alloc(CURRENT_ALLOCATOR(), capacity * sizeof(lept_member));
+        if (m == NULL)
+            return;
+        v->o.m = m;
         v->o.capacity = capacity;
-        /* reallocate the memory */
-        v->o.m = (lept_member*)realloc(v->o.m, capacity * sizeof(lept_member));
     }
 }
 void lept_shrink_object(lept_value* v) {
     assert(v != NULL && v->type == LEPT_OBJECT);
+    if (!lept_unshare(v))
+        return;
     /* if the capacity is more than the current size, shrink the memory */
     if (v->o.capacity > v->o.size) {
+        if (v->o.size == 0) {
+            lept_block_free(v->o.m);
+            v->o.m = NULL;
+        }
+        else {
+            /* reallocate the memory, a failed shrink keeps the old block */
+            lept_member* m = (lept_member*)lept_block_realloc(v->o.m, v->o.size * sizeof(lept_member));
+            if (m == NULL)
+                return;
+            v->o.m = m;
+        }
         /* set the capacity */
         v->o.capacity = v->o.size;
-        /* reallocate the memory */
-        v->o.m = (lept_member*)realloc(v->o.m, v->o.size * sizeof(lept_member));
     }
 }
 void lept_clear_object(lept_value* v) {
     assert(v != NULL && v->type == LEPT_OBJECT);
-    if (v->o.m != NULL) {
+    if (v->o.m != NULL && lept_unshare(v)) {
         size_t i;
         /* free the elements */
         for (i = 0; i < v->o.size; i++) {
             lept_free(&v->o.m[i].v);
-            free(v->o.m[i].k);
+            lept_block_drop(v->o.m[i].k);
         }
         /* set the size to 0 */
         v->o.size = 0;
@@ -994,7 +4555,10 @@ size_t lept_get_object_key_length(const lept_value* v, size_t index) {
 lept_value* lept_get_object_value(lept_value* v, size_t index) {
     assert(v != NULL && v->type == LEPT_OBJECT);
     assert(index < v->o.size);
-    return &v->o.m[index].v;
+    /* the value may be written through the pointer */
+    if (!lept_unshare(v))
+        return NULL;
+    return lept_handed_out(v, &v->o.m[index].v);
 }
 
 size_t lept_find_object_index(const lept_value* v, const char* key, size_t klen) {
@@ -1012,23 +4576,37 @@ lept_value* lept_find_object_value(lept_value* v, const char* key, size_t klen)
     assert(v != NULL && v->type == LEPT_OBJECT && key != NULL);
     size_t index = lept_find_object_index(v, key, klen);
     /* if the key is found return the value, else return NULL */
+    return index != LEPT_KEY_NOT_EXIST ? lept_get_object_value(v, index) : NULL;
+}
+
+const lept_value* lept_peek_object_value(const lept_value* v, size_t index) {
+    assert(v != NULL && v->type == LEPT_OBJECT);
+    assert(index < v->o.size);
+    return &v->o.m[index].v;
+}
+
+const lept_value* lept_peek_find_object_value(const lept_value* v, const char* key, size_t klen) {
+    size_t index = lept_find_object_index(v, key, klen);
     return index != LEPT_KEY_NOT_EXIST ? &v->o.m[index].v : NULL;
 }
 
-lept_value* lept_set_object_value(lept_value* v, const char* key, size_t klen) {
+/* the value of key, added as null when missing, for the library itself to write at once */
+static lept_value* lept_object_slot(lept_value* v, const char* key, size_t klen) {
     assert(v != NULL && v->type == LEPT_OBJECT && key != NULL);
-    /* find key */
-    lept_value* temp = lept_find_object_value(v, key, klen);
-    if (temp != NULL) {
-        return temp;
+    if (!lept_unshare(v))
+        return NULL;
+    /* find key, v is unshared already */
+    size_t index = lept_find_object_index(v, key, klen);
+    if (index != LEPT_KEY_NOT_EXIST) {
+        return &v->o.m[index].v;
     }
     /* if the size is equal to the capacity, reserve more memory */
     if (v->o.size == v->o.capacity)
         lept_reserve_object(v, v->o.capacity == 0 ? 1 : v->o.capacity * 2);
-    /* initialize the key */
-    v->o.m[v->o.size].k = (char*)malloc(klen + 1);
-    memcpy(v->o.m[v->o.size].k, key, klen);
-    v->o.m[v->o.size].k[klen] = '\0';
+    /* initialize the key with the allocator of the members, NULL when out of memory */
+    if (v->o.size == v->o.capacity ||
+        (v->o.m[v->o.size].k = lept_block_strdup(BLOCK_OF(v->o.m)->alloc, key, klen)) == NULL)
+        return NULL;
     v->o.m[v->o.size].klen = klen;
     /* initialize the value */
     lept_init(&v->o.m[v->o.size].v);
@@ -1038,13 +4616,18 @@ lept_value* lept_set_object_value(lept_value* v, const char* key, size_t klen) {
     return &v->o.m[v->o.size - 1].v;
 }
 
+lept_value* lept_set_object_value(lept_value* v, const char* key, size_t klen) {
+    return lept_handed_out(v, lept_object_slot(v, key, klen));
+}
+
 void lept_remove_object_value(lept_value* v, size_t index) {
     assert(v != NULL && v->type == LEPT_OBJECT && index < v->o.size);
+    if (!lept_unshare(v))
+        return;
     /* free the value */
-    lept_value* temp = lept_find_object_value(v, v->o.m[index].k, v->o.m[index].klen);
-    lept_free(temp);
+    lept_free(&v->o.m[index].v);
     /* free the key */
-    free(v->o.m[index].k);
+    lept_block_drop(v->o.m[index].k);
     /* move the elements */
     for (size_t i = index; i < v->o.size - 1; i++) {
         v->o.m[i] = v->o.m[i + 1];
@@ -1052,3 +4635,394 @@ void lept_remove_object_value(lept_value* v, size_t index) {
     /* decrease the size */
     v->o.size--;
 }
+
+/* decode a JSON pointer reference token (RFC 6901), returns the key in place when it has no escape,
+   otherwise a copy in *buf to be released with lept_block_free(); NULL when the token is malformed */
+static const char* lept_pointer_key(const char* tok, size_t n, size_t* klen, char** buf) {
+    size_t i, j;
+    *buf = NULL;
+    if (memchr(tok, '~', n) == NULL) {
+        *klen = n;
+        return tok;
+    }
+    if ((*buf = (char*)lept_block_alloc(CURRENT_ALLOCATOR(), n)) == NULL)
+        return NULL;
+    for (i = j = 0; i < n; i++, j++) {
+        if (tok[i] != '~')
+            (*buf)[j] = tok[i];
+        else if (i + 1 < n && (tok[i + 1] == '0' || tok[i + 1] == '1'))
+            (*buf)[j] = tok[++i] == '0' ? '~' : '/';
+        else {
+            lept_block_free(*buf);
+            return *buf = NULL;
+        }
+    }
+    *klen = j;
+    return *buf;
+}
+
+/* array index of a reference token, LEPT_KEY_NOT_EXIST when it is not a canonical decimal */
+static size_t lept_pointer_index(const char* tok, size_t n) {
+    size_t i, index = 0;
+    if (n == 0 || (n > 1 && tok[0] == '0'))
+        return LEPT_KEY_NOT_EXIST;
+    for (i = 0; i < n; i++) {
+        if (!ISDIGIT(tok[i]) || index > (LEPT_KEY_NOT_EXIST - 10) / 10)
+            return LEPT_KEY_NOT_EXIST;
+        index = index * 10 + (size_t)(tok[i] - '0');
+    }
+    return index;
+}
+
+/* the child of v named by one reference token and its index, NULL if there is none;
+   a child to be written is reached through the unsharing accessors, one only read of a
+   packed array is made up in *tmp */
+static lept_value* lept_pointer_step(lept_value* v, const char* tok, size_t n, int write, size_t* index, lept_value* tmp) {
+    const char* key;
+    char* buf;
+    size_t klen;
+    if (v->type == LEPT_ARRAY) {
+        if ((*index = lept_pointer_index(tok, n)) >= v->a.size)
+            return NULL;
+        /* written at once, so the block is only unshared */
+        if (write)
+            return lept_unshare(v) ? &v->a.e[*index] : NULL;
+        /* a number made up from a packed array is never written, and has no children to step into */
+        return (lept_value*)lept_array_at(v, *index, tmp);
+    }
+    if (v->type != LEPT_OBJECT || (key = lept_pointer_key(tok, n, &klen, &buf)) == NULL)
+        return NULL;
+    *index = lept_find_object_index(v, key, klen);
+    lept_block_free(buf);
+    if (*index == LEPT_KEY_NOT_EXIST)
+        return NULL;
+    if (write && !lept_unshare(v))
+        return NULL;
+    return &v->o.m[*index].v;
+}
+
+/* resolve the JSON pointer path[0, len) from v, NULL if it does not exist; tmp holds the
+   result read from a packed array */
+static lept_value* lept_pointer_find(lept_value* v, const char* path, size_t len, int write, lept_value* tmp) {
+    const char* end = path + len, *tok;
+    size_t index;
+    while (path < end && v != NULL) {
+        if (*path != '/')
+            return NULL;
+        tok = ++path;
+        while (path < end && *path != '/')
+            path++;
+        v = lept_pointer_step(v, tok, (size_t)(path - tok), write, &index, tmp);
+    }
+    return v;
+}
+
+/* split a non-empty path at its last token, returns the container it names or NULL */
+static lept_value* lept_pointer_parent(lept_value* doc, const char* path, size_t len, const char** tok, size_t* n) {
+    size_t i = len;
+    lept_value* parent;
+    while (i > 0 && path[i - 1] != '/')
+        i--;
+    if (i == 0)
+        return NULL;
+    *tok = path + i;
+    *n = len - i;
+    parent = lept_pointer_find(doc, path, i - 1, 1, NULL);
+    return parent != NULL && (parent->type == LEPT_ARRAY || parent->type == LEPT_OBJECT) ? parent : NULL;
+}
+
+/* add: move value to path, replacing the member of an object or shifting the elements of an array */
+static int lept_patch_add(lept_value* doc, const char* path, size_t len, lept_value* value) {
+    lept_value* parent, *slot;
+    const char* tok, *key;
+    char* buf;
+    size_t n, index;
+    if (len == 0) {
+        lept_move(doc, value);
+        return LEPT_PATCH_OK;
+    }
+    if ((parent = lept_pointer_parent(doc, path, len, &tok, &n)) == NULL)
+        return LEPT_PATCH_PATH_NOT_FOUND;
+    if (parent->type == LEPT_ARRAY) {
+        /* "-" appends */
+        if (n == 1 && *tok == '-')
+            slot = lept_array_push(parent);
+        else if ((index = lept_pointer_index(tok, n)) > parent->a.size)
+            return LEPT_PATCH_PATH_NOT_FOUND;
+        else
+            slot = lept_array_insert(parent, index);
+    }
+    else {
+        if ((key = lept_pointer_key(tok, n, &index, &buf)) == NULL)
+            return LEPT_PATCH_PATH_NOT_FOUND;
+        slot = lept_object_slot(parent, key, index);
+        lept_block_free(buf);
+    }
+    if (slot == NULL)
+        return LEPT_PATCH_OUT_OF_MEMORY;
+    lept_move(slot, value);
+    return LEPT_PATCH_OK;
+}
+
+/* remove: detach the value at path into removed */
+static int lept_patch_remove(lept_value* doc, const char* path, size_t len, lept_value* removed) {
+    lept_value* parent, *target;
+    const char* tok;
+    size_t n, index;
+    if (len == 0 || (parent = lept_pointer_parent(doc, path, len, &tok, &n)) == NULL ||
+        (target = lept_pointer_step(parent, tok, n, 1, &index, NULL)) == NULL)
+        return LEPT_PATCH_PATH_NOT_FOUND;
+    /* the parent is unshared now, so the target can be moved out and its slot dropped */
+    lept_move(removed, target);
+    if (parent->type == LEPT_ARRAY)
+        lept_erase_array_element(parent, index, 1);
+    else
+        lept_remove_object_value(parent, index);
+    return LEPT_PATCH_OK;
+}
+
+/* member of a patch operation, NULL if absent or not of the given type (-1 for any) */
+static const lept_value* lept_patch_member(const lept_value* op, const char* key, int type) {
+    size_t i = lept_find_object_index(op, key, strlen(key));
+    if (i == LEPT_KEY_NOT_EXIST || (type >= 0 && op->o.m[i].v.type != (lept_type)type))
+        return NULL;
+    return &op->o.m[i].v;
+}
+
+#define OP_IS(name, lit) ((name)->s.len == sizeof(lit) - 1 && memcmp((name)->s.s, lit, sizeof(lit) - 1) == 0)
+
+static int lept_patch_apply_op(lept_value* doc, const lept_value* op) {
+    const lept_value* name, *path, *from = NULL, *value = NULL;
+    lept_value temp, found, *target;
+    int ret;
+    if (op->type != LEPT_OBJECT ||
+        (name = lept_patch_member(op, "op", LEPT_STRING)) == NULL ||
+        (path = lept_patch_member(op, "path", LEPT_STRING)) == NULL)
+        return LEPT_PATCH_INVALID_OPERATION;
+    if (OP_IS(name, "add") || OP_IS(name, "replace") || OP_IS(name, "test")) {
+        if ((value = lept_patch_member(op, "value", -1)) == NULL)
+            return LEPT_PATCH_INVALID_OPERATION;
+    }
+    else if (OP_IS(name, "move") || OP_IS(name, "copy")) {
+        if ((from = lept_patch_member(op, "from", LEPT_STRING)) == NULL)
+            return LEPT_PATCH_INVALID_OPERATION;
+    }
+    else if (!OP_IS(name, "remove"))
+        return LEPT_PATCH_INVALID_OPERATION;
+
+    lept_init(&temp);
+    if (OP_IS(name, "test")) {
+        target = lept_pointer_find(doc, path->s.s, path->s.len, 0, &temp);
+        if (target == NULL)
+            return LEPT_PATCH_PATH_NOT_FOUND;
+        return lept_is_equal(target, value) ? LEPT_PATCH_OK : LEPT_PATCH_TEST_FAILED;
+    }
+    if (OP_IS(name, "add")) {
+        /* values are shared with the patch, not duplicated */
+        lept_copy(&temp, value);
+        ret = lept_patch_add(doc, path->s.s, path->s.len, &temp);
+    }
+    else if (OP_IS(name, "replace")) {
+        target = lept_pointer_find(doc, path->s.s, path->s.len, 1, NULL);
+        if (target == NULL)
+            return LEPT_PATCH_PATH_NOT_FOUND;
+        lept_copy(target, value);
+        return LEPT_PATCH_OK;
+    }
+    else if (OP_IS(name, "remove"))
+        ret = lept_patch_remove(doc, path->s.s, path->s.len, &temp);
+    else if (OP_IS(name, "copy")) {
+        if ((target = lept_pointer_find(doc, from->s.s, from->s.len, 0, &found)) == NULL)
+            return LEPT_PATCH_PATH_NOT_FOUND;
+        lept_copy(&temp, target);
+        ret = lept_patch_add(doc, path->s.s, path->s.len, &temp);
+    }
+    else {
+        /* move: the subtree is relocated, never copied */
+        if (from->s.len == path->s.len && memcmp(from->s.s, path->s.s, from->s.len) == 0)
+            return lept_pointer_find(doc, from->s.s, from->s.len, 0, &temp) ? LEPT_PATCH_OK : LEPT_PATCH_PATH_NOT_FOUND;
+        /* a value cannot be moved into one of its children */
+        if (from->s.len < path->s.len && memcmp(from->s.s, path->s.s, from->s.len) == 0 && path->s.s[from->s.len] == '/')
+            return LEPT_PATCH_INVALID_OPERATION;
+        if ((ret = lept_patch_remove(doc, from->s.s, from->s.len, &temp)) == LEPT_PATCH_OK)
+            ret = lept_patch_add(doc, path->s.s, path->s.len, &temp);
+    }
+    lept_free(&temp);
+    return ret;
+}
+
+int lept_patch_apply(lept_value* doc, const lept_value* patch, size_t* failed_index) {
+    lept_value backup, tmp;
+    size_t i;
+    int ret = LEPT_PATCH_OK;
+    assert(doc != NULL && patch != NULL);
+    if (patch->type != LEPT_ARRAY)
+        return LEPT_PATCH_INVALID_OPERATION;
+    /* an O(1) copy-on-write backup, the operations only copy the paths they write */
+    lept_init(&backup);
+    lept_copy(&backup, doc);
+    for (i = 0; i < patch->a.size; i++)
+        if ((ret = lept_patch_apply_op(doc, lept_array_at(patch, i, &tmp))) != LEPT_PATCH_OK)
+            break;
+    if (ret != LEPT_PATCH_OK) {
+        /* roll back */
+        lept_move(doc, &backup);
+        if (failed_index)
+            *failed_index = i;
+    }
+    lept_free(&backup);
+    return ret;
+}
+
+/* append one escaped reference token to the JSON pointer on the stack */
+static void lept_diff_push_token(lept_context* c, const char* tok, size_t n) {
+    size_t i;
+    PUTC(c, '/');
+    for (i = 0; i < n; i++) {
+        if (tok[i] == '~')
+            PUTS(c, "~0", 2);
+        else if (tok[i] == '/')
+            PUTS(c, "~1", 2);
+        else
+            PUTC(c, tok[i]);
+    }
+}
+
+static void lept_diff_push_index(lept_context* c, size_t index) {
+    char buffer[32];
+    PUTS(c, buffer, (size_t)sprintf(buffer, "/%lu", (unsigned long)index));
+}
+
+/* append {"op":op,"path":<stack>,"value":value} to patch, value is shared not duplicated */
+static void lept_diff_op(lept_context* c, lept_value* patch, const char* op, const lept_value* value) {
+    lept_value* o, *m;
+    if (c->oom || (o = lept_array_push(patch)) == NULL) {
+        c->oom = 1;
+        return;
+    }
+    if (lept_set_object(o, value ? 3 : 2) != 0) {
+        c->oom = 1;
+        return;
+    }
+    if ((m = lept_object_slot(o, "op", 2)) != NULL)
+        lept_set_string(m, op, strlen(op));
+    if ((m = lept_object_slot(o, "path", 4)) != NULL)
+        lept_set_string(m, c->stack, c->top);
+    if (value != NULL && (m = lept_object_slot(o, "value", 5)) != NULL)
+        lept_copy(m, value);
+    if (lept_get_object_size(o) != (value ? 3u : 2u))
+        c->oom = 1;
+}
+
+static void lept_diff_value(lept_context* c, lept_value* patch, const lept_value* a, const lept_value* b);
+
+/* the common prefix and suffix of two arrays are skipped, the rest is diffed pairwise and the
+   surplus removed or added, so one insertion or deletion costs one operation */
+static void lept_diff_array(lept_context* c, lept_value* patch, const lept_value* a, const lept_value* b) {
+    size_t head = c->top, pre = 0, suf = 0, i, na = a->a.size, nb = b->a.size;
+    lept_value at, bt;
+    while (pre < na && pre < nb && lept_is_equal(lept_array_at(a, pre, &at), lept_array_at(b, pre, &bt)))
+        pre++;
+    while (suf < na - pre && suf < nb - pre && lept_is_equal(lept_array_at(a, na - 1 - suf, &at), lept_array_at(b, nb - 1 - suf, &bt)))
+        suf++;
+    na -= pre + suf;
+    nb -= pre + suf;
+    for (i = 0; i < na && i < nb; i++) {
+        lept_diff_push_index(c, pre + i);
+        lept_diff_value(c, patch, lept_array_at(a, pre + i, &at), lept_array_at(b, pre + i, &bt));
+        c->top = head;
+    }
+    /* every removal happens at the same index as the following elements shift left */
+    for (; i < na; i++) {
+        lept_diff_push_index(c, pre + nb);
+        lept_diff_op(c, patch, "remove", NULL);
+        c->top = head;
+    }
+    for (; i < nb; i++) {
+        lept_diff_push_index(c, pre + i);
+        lept_diff_op(c, patch, "add", lept_array_at(b, pre + i, &bt));
+        c->top = head;
+    }
+}
+
+/* members are matched through a hash table of the keys of b instead of nested loops */
+static void lept_diff_object(lept_context* c, lept_value* patch, const lept_value* a, const lept_value* b) {
+    size_t head = c->top, mask, i, j, *table;
+    char* matched;
+    for (mask = 7; mask < b->o.size * 2; mask = mask * 2 + 1)
+        ;
+    table = (size_t*)c->alloc->malloc(c->alloc->ctx, (mask + 1) * sizeof(size_t) + b->o.size);
+    if (table == NULL) {
+        c->oom = 1;
+        return;
+    }
+    matched = (char*)(table + mask + 1);
+    memset(matched, 0, b->o.size);
+    for (i = 0; i <= mask; i++)
+        table[i] = LEPT_KEY_NOT_EXIST;
+    for (i = 0; i < b->o.size; i++) {
+        for (j = lept_hash_bytes(b->o.m[i].k, b->o.m[i].klen) & mask; table[j] != LEPT_KEY_NOT_EXIST; j = (j + 1) & mask)
+            ;
+        table[j] = i;
+    }
+    for (i = 0; i < a->o.size; i++) {
+        const lept_member* m = &a->o.m[i], *n = NULL;
+        for (j = lept_hash_bytes(m->k, m->klen) & mask; table[j] != LEPT_KEY_NOT_EXIST; j = (j + 1) & mask) {
+            n = &b->o.m[table[j]];
+            if (n->klen == m->klen && memcmp(n->k, m->k, m->klen) == 0)
+                break;
+        }
+        lept_diff_push_token(c, m->k, m->klen);
+        if (table[j] == LEPT_KEY_NOT_EXIST)
+            lept_diff_op(c, patch, "remove", NULL);
+        else {
+            matched[table[j]] = 1;
+            lept_diff_value(c, patch, &m->v, &n->v);
+        }
+        c->top = head;
+    }
+    for (i = 0; i < b->o.size; i++)
+        if (!matched[i]) {
+            lept_diff_push_token(c, b->o.m[i].k, b->o.m[i].klen);
+            lept_diff_op(c, patch, "add", &b->o.m[i].v);
+            c->top = head;
+        }
+    c->alloc->free(c->alloc->ctx, table);
+}
+
+static void lept_diff_value(lept_context* c, lept_value* patch, const lept_value* a, const lept_value* b) {
+    if (a->type != b->type) {
+        lept_diff_op(c, patch, "replace", b);
+        return;
+    }
+    switch (a->type) {
+        case LEPT_ARRAY:
+            /* identical subtrees shared by copy-on-write are skipped without a walk */
+            if (a->a.e != b->a.e || a->a.size != b->a.size)
+                lept_diff_array(c, patch, a, b);
+            break;
+        case LEPT_OBJECT:
+            if (a->o.m != b->o.m || a->o.size != b->o.size)
+                lept_diff_object(c, patch, a, b);
+            break;
+        default:
+            if (!lept_is_equal(a, b))
+                lept_diff_op(c, patch, "replace", b);
+    }
+}
+
+int lept_diff(const lept_value* a, const lept_value* b, lept_value* patch) {
+    lept_context c;
+    assert(a != NULL && b != NULL && patch != NULL);
+    lept_set_array(patch, 0);
+    /* the stack holds the JSON pointer of the value being compared */
+    lept_context_init(&c, CURRENT_ALLOCATOR());
+    lept_diff_value(&c, patch, a, b);
+    if (c.stack != NULL)
+        c.alloc->free(c.alloc->ctx, c.stack);
+    if (c.oom) {
+        lept_free(patch);
+        return LEPT_PATCH_OUT_OF_MEMORY;
+    }
+    return LEPT_PATCH_OK;
+}
@@ -4,6 +4,7 @@
 #define LEPTJSON_STUDY_LEPTJSON_H
 
 #include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
 
 #define LEPT_KEY_NOT_EXIST ((size_t)-1)
 
@@ -38,7 +39,28 @@ enum {
     /* object error */
     LEPT_PARSE_MISS_KEY, /* miss key in object. */
     LEPT_PARSE_MISS_COLON, /* miss colon(':') in object. */
-    LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET /* miss comma(',') or curly bracket('{' or '}') */
+    LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, /* miss comma(',') or curly bracket('{' or '}') */
+
+    /* limit error */
+    LEPT_PARSE_TOO_DEEP, /* arrays/objects nested deeper than max_depth. */
+    LEPT_PARSE_STRING_TOO_LONG, /* string or key longer than max_string_length. */
+    LEPT_PARSE_TOO_MANY_NODES, /* more values than max_nodes. */
+    LEPT_PARSE_INPUT_TOO_LARGE, /* JSON text longer than max_input_bytes. */
+
+    /* binary error */
+    LEPT_PARSE_INVALID_CBOR, /* malformed or truncated CBOR data item. */
+
+    /* resource error */
+    LEPT_PARSE_OUT_OF_MEMORY, /* the allocator returned NULL. */
+
+    /* schema error */
+    LEPT_PARSE_SCHEMA_VIOLATION, /* a value does not match the schema of the options. */
+
+    /* encoding error */
+    LEPT_PARSE_INVALID_UTF8, /* ill-formed UTF-8 in a string or key, only checked with strict_utf8. */
+
+    /* duplicate error */
+    LEPT_PARSE_DUPLICATE_KEY /* a key repeated in one object, only with LEPT_DUPLICATE_REJECT; reported at its end. */
 };
 
 /* 3.json value struct */
@@ -64,8 +86,16 @@ different times Anonymous unions are a C11 extension. */
         struct { lept_member* m; size_t size, capacity; }o;
 
         double n; /* number */
+
+        /* number kept as its literal: t: NUL-terminated text */ /* len: text's length */
+        struct { char* t; size_t len; }l;
+
+        /* array packed from numbers only: d: numbers */ /* size and capacity are the ones of a */
+        struct { double* d; size_t size, capacity; }p;
     };
     lept_type type; /* value type */
+    unsigned char literal; /* a number held in l rather than n, only meaningful when type is LEPT_NUMBER */
+    unsigned char packed;  /* an array held in p rather than a, only meaningful when type is LEPT_ARRAY */
 };
 
 struct lept_member {
@@ -73,58 +103,271 @@ struct lept_member {
     lept_value v; /* member value */
 };
 
+/* memory allocator, ctx is passed back to every call */
+typedef struct {
+    void* (*malloc)(void* ctx, size_t size);
+    void* (*realloc)(void* ctx, void* ptr, size_t old_size, size_t size);
+    void (*free)(void* ctx, void* ptr);
+    void* ctx;
+} lept_allocator;
+
+/* parse statistics */
+typedef struct {
+    size_t allocations;         /* heap allocations made for the document */
+    size_t bytes_allocated;     /* bytes requested by those allocations */
+    size_t stack_high_water;    /* peak use of the scratch stack in bytes */
+    size_t max_depth;           /* deepest nesting of arrays/objects */
+    size_t nodes[LEPT_OBJECT + 1]; /* number of values, indexed by lept_type */
+    size_t string_bytes;        /* bytes of string values */
+    size_t key_bytes;           /* bytes of member keys */
+} lept_parse_stats;
+
+/* compiled JSON Schema, see lept_schema_compile() */
+typedef struct lept_schema lept_schema;
+
+/* compiled set of JSON pointers, see lept_field_mask_compile() */
+typedef struct lept_field_mask lept_field_mask;
+
+/* max length of the JSON pointer reported for a schema violation */
+#ifndef LEPT_SCHEMA_PATH_MAX
+#define LEPT_SCHEMA_PATH_MAX 256
+#endif
+
+/* first schema violation found by a parse */
+typedef struct {
+    const char* keyword;              /* "type", "enum", "minimum", "maximum", "maxLength" or "required" */
+    char path[LEPT_SCHEMA_PATH_MAX];  /* JSON pointer of the value, truncated if longer */
+} lept_schema_error;
+
+/* what the parser does with a key repeated in one object */
+enum {
+    LEPT_DUPLICATE_KEEP_ALL = 0, /* keep every member, lept_find_object_index() finds the first */
+    LEPT_DUPLICATE_REJECT,       /* fail with LEPT_PARSE_DUPLICATE_KEY */
+    LEPT_DUPLICATE_KEEP_FIRST,   /* drop the later members */
+    LEPT_DUPLICATE_KEEP_LAST     /* the last value replaces the first one, in its position */
+};
+
+/* parse options, limits of 0 mean unlimited */
+typedef struct {
+    size_t max_depth;         /* max nesting depth of arrays/objects, 1024 after lept_parse_options_init();
+                                 values are freed and written recursively, so lift it only for a large C stack */
+    size_t max_string_length; /* max length of a decoded string or key */
+    size_t max_nodes;         /* max number of values in the document */
+    size_t max_input_bytes;   /* max length of the JSON text */
+    lept_parse_stats* stats;  /* filled in when not NULL */
+    const lept_allocator* allocator; /* allocator of the document, NULL for the current one */
+    const lept_schema* schema;       /* validate values as they are parsed when not NULL */
+    lept_schema_error* schema_error; /* filled in on LEPT_PARSE_SCHEMA_VIOLATION when not NULL */
+    const lept_field_mask* fields;   /* build only the selected members when not NULL */
+    int strict_utf8;                 /* reject strings and keys that are not well-formed UTF-8 */
+    int duplicate_keys;              /* LEPT_DUPLICATE_* policy for keys repeated in one object */
+    int lazy_numbers;                /* keep numbers as their literal: converted when read, written back verbatim,
+                                        never LEPT_PARSE_NUMBER_TOO_BIG */
+    int pack_numbers;                /* store arrays of numbers only as one double[], see lept_get_number_array() */
+} lept_parse_options;
+
+/* reusable parser, keeps its scratch stack between parses */
+typedef struct {
+    char* stack; size_t size; /* scratch stack, capacity of the scratch stack */
+    const lept_allocator* alloc; /* allocator of the scratch stack, set by the first parse */
+} lept_parser;
+
+/* streaming writer, compact json text written straight into a buffer without building values */
+typedef struct {
+    char* buffer; size_t size, length; /* output, its capacity and the bytes written */
+    const lept_allocator* alloc;       /* grows the buffer, NULL for a fixed buffer */
+    size_t depth;                      /* open arrays/objects */
+    uint64_t objects;                  /* bit d set when level d is an object, checked by asserts up to 64 levels */
+    int comma, key, error;             /* a value was written at this level, a key waits for its value, overflow or out of memory */
+} lept_writer;
+
 /* init */
 #define lept_init(v) do { (v)->type = LEPT_NULL; } while(0)
+/* init parser */
+#define lept_parser_init(p) do { (p)->stack = NULL; (p)->size = 0; (p)->alloc = NULL; } while(0)
 /* set null */
 #define lept_set_null(v) lept_free(v)
 
+/* read-only document image, see lept_snapshot_write() */
+typedef struct lept_snapshot lept_snapshot;
+/* value inside a snapshot, only valid while the snapshot is open */
+typedef struct lept_snapshot_node lept_snapshot_node;
+/* holder of a document that is replaced while other threads read it, see lept_atomic_doc_publish() */
+typedef struct lept_atomic_doc lept_atomic_doc;
+
 /* 4.API */
-/* parse json string to json value */
+/* set the allocator used by every thread (NULL for malloc/realloc/free), blocks remember the allocator that made them */
+void lept_set_allocator(const lept_allocator* a);
+/* get the allocator in effect on the calling thread */
+const lept_allocator* lept_get_allocator(void);
+/* parse json string to json value, using the scratch stack kept by the calling thread */
 int lept_parse(lept_value* v, const char* json);
+/* release the scratch stack kept by lept_parse() on the calling thread */
+void lept_parse_cleanup(void);
+/* parse json string to json value with options (NULL for defaults) */
+int lept_parse_ex(lept_value* v, const char* json, const lept_parse_options* opts);
+/* set every option to its default: no limits but max_depth, no stats */
+void lept_parse_options_init(lept_parse_options* opts);
+/* parse json string to json value, reusing the scratch stack of p */
+int lept_parser_parse(lept_parser* p, lept_value* v, const char* json, const lept_parse_options* opts);
+/* release the scratch stack of p */
+void lept_parser_free(lept_parser* p);
+/* compile a JSON Schema subset: type, properties, required, items, enum, minimum, maximum, maxLength
+   (other keywords are ignored); NULL if a supported keyword is malformed */
+lept_schema* lept_schema_compile(const lept_value* schema);
+/* free a compiled schema */
+void lept_schema_free(lept_schema* s);
+/* compile JSON pointers (RFC 6901) selecting members to build, a path selects the whole value it names;
+   arrays apply the selection to each element; NULL if a path is malformed */
+lept_field_mask* lept_field_mask_compile(const char* const* paths, size_t count);
+/* free a compiled field mask */
+void lept_field_mask_free(lept_field_mask* m);
+/* check that json[0, len) is one JSON text without building it or allocating, returns the
+   LEPT_PARSE_* code lept_parse() would (numbers are not converted, so never LEPT_PARSE_NUMBER_TOO_BIG)
+   and sets *err_offset to the byte where an error was found when it is not NULL */
+int lept_validate(const char* json, size_t len, size_t* err_offset);
+/* parse json, members not selected by fields are validated and skipped without being built */
+int lept_parse_projected(lept_value* v, const char* json, const lept_field_mask* fields);
 /* generate json string from json value */
 char* lept_stringify(const lept_value* v, size_t* length);
+/* generate the canonical json string of RFC 8785: sorted keys, no whitespace, shortest numbers */
+char* lept_stringify_canonical(const lept_value* v, size_t* length);
+/* FNV-1a of the canonical json string, computed without keeping the whole string; 0 if out of memory */
+uint64_t lept_canonical_hash(const lept_value* v);
+/* free a string from lept_stringify(), lept_stringify_canonical() or lept_encode_cbor(),
+   with the allocator that was in effect when it was made */
+void lept_free_string(char* s);
+
+/* writer: buffer NULL for one grown with the current allocator, else a fixed buffer of size bytes;
+   misuse (a value without a key, unbalanced ends) is caught by asserts, running out of room by the result */
+void lept_writer_init(lept_writer* w, char* buffer, size_t size);
+void lept_writer_reset(lept_writer* w);                            /* start over, keeping the buffer */
+void lept_writer_free(lept_writer* w);                             /* free a grown buffer */
+void lept_writer_begin_object(lept_writer* w);
+void lept_writer_end_object(lept_writer* w);
+void lept_writer_begin_array(lept_writer* w);
+void lept_writer_end_array(lept_writer* w);
+void lept_writer_key(lept_writer* w, const char* key, size_t len);
+void lept_writer_string(lept_writer* w, const char* s, size_t len);
+void lept_writer_number(lept_writer* w, double n);
+void lept_writer_int64(lept_writer* w, int64_t n);
+void lept_writer_bool(lept_writer* w, int b);
+void lept_writer_null(lept_writer* w);
+void lept_writer_raw(lept_writer* w, const char* json, size_t len); /* a complete json value, copied as is */
+/* NUL-terminated text written so far, NULL if the fixed buffer overflowed or the allocator failed */
+const char* lept_writer_result(lept_writer* w, size_t* length);
+
+/* encode json value as CBOR (RFC 8949), the result is not NUL-terminated */
+char* lept_encode_cbor(const lept_value* v, size_t* length);
+/* decode CBOR produced by lept_encode_cbor (or any definite-length CBOR) to json value */
+int lept_decode_cbor(lept_value* v, const char* data, size_t length);
 
-/* copy / move / swap */
-void lept_copy(lept_value* dst, const lept_value* src);
+/* snapshot: position-independent binary image of a json value, mapped read-only */
+int lept_snapshot_write(const lept_value* v, const char* path);  /* write image, 0 on success, -1 on I/O error */
+/* map image, NULL on failure; every offset is checked once here, so a corrupt or truncated file is refused */
+lept_snapshot* lept_snapshot_open(const char* path);
+/* frozen copy of v in one allocation, NULL when out of memory; the lept_snapshot_* getters only read it,
+   so any number of threads may use it at once without locking. free it with lept_snapshot_close() */
+lept_snapshot* lept_freeze(const lept_value* v);
+void lept_snapshot_close(lept_snapshot* s);                       /* unmap image or free a frozen copy */
+const lept_snapshot_node* lept_snapshot_root(const lept_snapshot* s);          /* get root value */
+int lept_snapshot_to_value(lept_value* v, const lept_snapshot_node* n);        /* copy to json value, 0 or -1 and null v when out of memory */
+int lept_snapshot_get_type(const lept_snapshot_node* n);                       /* get type */
+int lept_snapshot_get_boolean(const lept_snapshot_node* n);                    /* get boolean */
+double lept_snapshot_get_number(const lept_snapshot_node* n);                  /* get number */
+const char* lept_snapshot_get_string(const lept_snapshot_node* n);             /* get string */
+size_t lept_snapshot_get_string_length(const lept_snapshot_node* n);           /* get string's length */
+size_t lept_snapshot_get_array_size(const lept_snapshot_node* n);              /* get array's size */
+const lept_snapshot_node* lept_snapshot_get_array_element(const lept_snapshot_node* n, size_t index); /* get array's element */
+size_t lept_snapshot_get_object_size(const lept_snapshot_node* n);             /* get object's size */
+const char* lept_snapshot_get_object_key(const lept_snapshot_node* n, size_t index);      /* get object's key */
+size_t lept_snapshot_get_object_key_length(const lept_snapshot_node* n, size_t index);    /* get object's key's length */
+const lept_snapshot_node* lept_snapshot_get_object_value(const lept_snapshot_node* n, size_t index); /* get object's value */
+size_t lept_snapshot_find_object_index(const lept_snapshot_node* n, const char* key, size_t klen);   /* find object's index */
+const lept_snapshot_node* lept_snapshot_find_object_value(const lept_snapshot_node* n, const char* key, size_t klen); /* find object's value */
+
+/* copy / move / swap; the setters below that allocate return 0, or -1 with the value left null when out of memory */
+int lept_copy(lept_value* dst, const lept_value* src);   /* O(1), strings and containers are shared until written, never fails */
 void lept_move(lept_value* dst, lept_value* src);
 void lept_swap(lept_value* lhs, lept_value* rhs);
 
 /* free json value */
 void lept_free(lept_value* v);
+/* detach v in O(1) and let a background thread free it, waits while LEPT_RECLAIM_QUEUE_SIZE documents are queued;
+   the allocators of v must be usable from that thread */
+void lept_free_deferred(lept_value* v);
+/* wait until every document handed to lept_free_deferred() so far is freed */
+void lept_reclaim_flush(void);
+/* free the queued documents and stop the background thread, the next lept_free_deferred() starts it again */
+void lept_reclaim_shutdown(void);
+
+/* atomic document: readers never block, a publisher waits until the readers of the old document left */
+lept_atomic_doc* lept_atomic_doc_create(void);          /* holds null, NULL when out of memory */
+void lept_atomic_doc_destroy(lept_atomic_doc* d);       /* free d and its document, no reader may be inside */
+/* enter: the returned document stays valid and unchanged until lept_atomic_doc_release() with the same *slot;
+   read it with the const getters and lept_peek_*() only */
+const lept_value* lept_atomic_doc_acquire(lept_atomic_doc* d, int* slot);
+void lept_atomic_doc_release(lept_atomic_doc* d, int slot);
+/* move v in (v becomes null) and free the previous document once no reader holds it, 0 on success
+   or -1 when out of memory with v untouched; must not be called by a thread inside d */
+int lept_atomic_doc_publish(lept_atomic_doc* d, lept_value* v);
+
+/* heap bytes owned by v (capacity included), unused array/object capacity in *slack;
+   a block shared by several copies inside v is counted once */
+size_t lept_memory_usage(const lept_value* v, size_t* slack);
 
 /* get type */
 int lept_get_type(const lept_value* v);
 /* equal */
 int lept_is_equal(const lept_value* lhs, const lept_value* rhs);
+/* hash, equal values hash alike and objects ignore member order; kept in each string and container until
+   it is written, so lept_is_equal() rejects containers with different hashes at once. a container some
+   lept_value* to write through was taken from (lept_get_array_element() and the like) never keeps it
+   again, the ones of parsed or decoded documents do until then */
+uint64_t lept_hash(const lept_value* v);
+
+/* walk arrays/objects of at least LEPT_PARALLEL_GRAIN elements with count threads in lept_free(),
+   lept_is_equal(), lept_hash() and lept_stringify(); 0 or 1 for none. each thread queues the slices it
+   splits off in a deque of its own and idle ones steal from the others. Call while no other thread uses the library.
+   returns 0 on success, -1 if the threads could not be started */
+int lept_set_threads(size_t count);
 
 /* boolean */
 int lept_get_boolean(const lept_value* v);          /* get boolean */
 void lept_set_boolean(lept_value* v, int boolean);  /* set boolean */
 
 /* number */
-double lept_get_number(const lept_value* v);        /* get number */
+double lept_get_number(const lept_value* v);        /* get number, a literal is converted on the first call */
 void lept_set_number(lept_value* v, double number); /* set number */
+const char* lept_get_number_literal(const lept_value* v, size_t* len); /* get number's literal, NULL unless parsed with lazy_numbers */
 
 /* string */
 const char* lept_get_string(const lept_value* v);                /* get string */
 size_t lept_get_string_length(const lept_value* v);              /* get string's length */
-void lept_set_string(lept_value* v, const char* s, size_t len);  /* set string */
+int lept_set_string(lept_value* v, const char* s, size_t len);   /* set string */
 
 /* array */
-void lept_set_array(lept_value* v, size_t capacity);                        /* set array */
+int lept_set_array(lept_value* v, size_t capacity);                         /* set array */
 size_t lept_get_array_size(const lept_value* v);                            /* get array's size */
 size_t lept_get_array_capacity(const lept_value* v);                        /* get array's capacity */
 void lept_reserve_array(lept_value* v, size_t capacity);                    /* reserve array's capacity */
 void lept_shrink_array(lept_value* v);                                      /* shrink array's capacity */
 void lept_clear_array(lept_value* v);                                       /* clear array */
-lept_value* lept_get_array_element(lept_value* v, size_t index);            /* get array's element */
+/* get array's element to write through: elements shared with a copy are copied and a packed array
+   is unpacked first, use lept_peek_array_element() to only read */
+lept_value* lept_get_array_element(lept_value* v, size_t index);
+/* get array's element, read only; the element of a packed array is made up in *tmp and read from there */
+const lept_value* lept_peek_array_element(const lept_value* v, size_t index, lept_value* tmp);
+/* get the numbers of an array packed by pack_numbers, 0 if v is not packed; reads keep it packed,
+   the first write through any other array accessor turns it back into an array of values */
+int lept_get_number_array(const lept_value* v, const double** numbers, size_t* size);
 lept_value* lept_pushback_array_element(lept_value* v);                     /* pushback array's element */
 void lept_popback_array_element(lept_value* v);                             /* popback array's element */
 lept_value* lept_insert_array_element(lept_value* v, size_t index);         /* insert array's element */
 void lept_erase_array_element(lept_value* v, size_t index, size_t count);   /* erase array's element */
 
 /* object */
-void lept_set_object(lept_value* v, size_t capacity);                       /* set object */
+int lept_set_object(lept_value* v, size_t capacity);                        /* set object */
 size_t lept_get_object_size(const lept_value* v);                           /* get object's size */
 size_t lept_get_object_capacity(const lept_value* v);                       /* get object's capacity */
 void lept_reserve_object(lept_value* v, size_t capacity);                   /* reserve object's capacity */
@@ -132,11 +375,31 @@ void lept_shrink_object(lept_value* v);                                     /* s
 void lept_clear_object(lept_value* v);                                      /* clear object */
 const char* lept_get_object_key(const lept_value* v, size_t index);         /* get object's key */
 size_t lept_get_object_key_length(const lept_value* v, size_t index);       /* get object's key's length */
-lept_value* lept_get_object_value(lept_value* v, size_t index);             /* get object's value */
+/* get / find object's value to write through: members shared with a copy are copied first, use
+   lept_peek_object_value() / lept_peek_find_object_value() to only read */
+lept_value* lept_get_object_value(lept_value* v, size_t index);
 size_t lept_find_object_index(const lept_value* v, const char* key, size_t klen); /* find object's index */
-lept_value* lept_find_object_value(lept_value* v, const char* key, size_t klen); /* find object's value */
+lept_value* lept_find_object_value(lept_value* v, const char* key, size_t klen);
+/* read-only lookups: they never unshare or write v, so they keep copies sharing their members
+   and threads reading one document may use them at once */
+const lept_value* lept_peek_object_value(const lept_value* v, size_t index);                /* get object's value, read only */
+const lept_value* lept_peek_find_object_value(const lept_value* v, const char* key, size_t klen); /* find object's value, read only */
 lept_value* lept_set_object_value(lept_value* v, const char* key, size_t klen); /* set object's value */
 void lept_remove_object_value(lept_value* v, size_t index);                 /* remove object's value */
 
+/* JSON Patch (RFC 6902) result */
+enum {
+    LEPT_PATCH_OK = 0,
+    LEPT_PATCH_INVALID_OPERATION, /* not an array of operations, unknown op, missing member, move into a child. */
+    LEPT_PATCH_PATH_NOT_FOUND,    /* path or from does not name a value (or a place to add one). */
+    LEPT_PATCH_TEST_FAILED,       /* a test operation found a different value. */
+    LEPT_PATCH_OUT_OF_MEMORY      /* the allocator returned NULL. */
+};
+
+/* apply the operations of patch to doc in order; doc is left unchanged if one fails, its index in *failed_index */
+int lept_patch_apply(lept_value* doc, const lept_value* patch, size_t* failed_index);
+/* set patch to the operations turning a into b, values in it are shared with b; returns LEPT_PATCH_OK or LEPT_PATCH_OUT_OF_MEMORY */
+int lept_diff(const lept_value* a, const lept_value* b, lept_value* patch);
+
 
 #endif
@@ -30,6 +30,8 @@ static int test_pass = 0;
         v.type = LEPT_FALSE;\
         EXPECT_EQ_INT(error, lept_parse(&v, json));\
         EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+        /* the validator does not convert numbers */\
+        EXPECT_EQ_INT((error == LEPT_PARSE_NUMBER_TOO_BIG ? LEPT_PARSE_OK : error), lept_validate(json, strlen(json), NULL));\
         lept_free(&v);\
     } while(0)
 
@@ -360,6 +362,658 @@ static void test_parse_miss_comma_or_curly_bracket() {
     TEST_ERROR(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"a\":{}");
 }
 
+static void test_parser_reuse(void) {
+    lept_parser p;
+    lept_value v;
+    char* stack;
+    size_t size;
+    lept_parser_init(&p);
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parser_parse(&p, &v, "[\"abc\", {\"a\" : [1, 2]}]", NULL));
+    EXPECT_EQ_SIZE_T(2, lept_get_array_size(&v));
+    lept_free(&v);
+    stack = p.stack;
+    size = p.size;
+    EXPECT_TRUE(stack != NULL);
+    /* a document that fits in the retained stack must not reallocate it */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parser_parse(&p, &v, "{\"x\" : \"yz\"}", NULL));
+    EXPECT_TRUE(stack == p.stack);
+    EXPECT_EQ_SIZE_T(size, p.size);
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, lept_parser_parse(&p, &v, "[1", NULL));
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    lept_parser_free(&p);
+    EXPECT_TRUE(p.stack == NULL);
+}
+
+#define TEST_LIMIT(error, json, field, limit)\
+    do {\
+        lept_value v;\
+        lept_parse_options opts;\
+        lept_parse_options_init(&opts);\
+        opts.field = limit;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(error, lept_parse_ex(&v, json, &opts));\
+        lept_free(&v);\
+    } while(0)
+
+static void test_parse_limits(void) {
+    lept_value v;
+    char* deep;
+    size_t i, n = 100000;
+
+    TEST_LIMIT(LEPT_PARSE_OK, "[[1]]", max_depth, 2);
+    TEST_LIMIT(LEPT_PARSE_TOO_DEEP, "[[[1]]]", max_depth, 2);
+    TEST_LIMIT(LEPT_PARSE_TOO_DEEP, "[{\"a\":[]}]", max_depth, 2);
+    TEST_LIMIT(LEPT_PARSE_OK, "[\"abc\"]", max_string_length, 3);
+    TEST_LIMIT(LEPT_PARSE_STRING_TOO_LONG, "[\"abcd\"]", max_string_length, 3);
+    TEST_LIMIT(LEPT_PARSE_STRING_TOO_LONG, "{\"abcd\":1}", max_string_length, 3);
+    /* caught before the rest of the string is read */
+    TEST_LIMIT(LEPT_PARSE_STRING_TOO_LONG, "[\"abcdefgh", max_string_length, 3);
+    TEST_LIMIT(LEPT_PARSE_OK, "[1,2,3]", max_nodes, 4);
+    TEST_LIMIT(LEPT_PARSE_TOO_MANY_NODES, "[1,2,3,4]", max_nodes, 4);
+    TEST_LIMIT(LEPT_PARSE_OK, "[1,2]", max_input_bytes, 5);
+    TEST_LIMIT(LEPT_PARSE_INPUT_TOO_LARGE, "[1,2] ", max_input_bytes, 5);
+
+    /* deep nesting must not overflow the C stack */
+    deep = (char*)malloc(n * 2 + 1);
+    for (i = 0; i < n; i++) {
+        deep[i] = '[';
+        deep[n + i] = ']';
+    }
+    deep[n * 2] = '\0';
+    TEST_LIMIT(LEPT_PARSE_OK, deep, max_depth, 0);
+    TEST_LIMIT(LEPT_PARSE_TOO_DEEP, deep, max_depth, 64);
+    /* the default depth keeps lept_free() and lept_stringify() off the end of the C stack */
+    TEST_LIMIT(LEPT_PARSE_TOO_DEEP, deep, max_nodes, 0);
+    EXPECT_EQ_INT(LEPT_PARSE_TOO_DEEP, lept_parse(&v, deep));
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    deep[n * 2 - 1] = '\0';
+    TEST_LIMIT(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, deep, max_depth, 0);
+    free(deep);
+}
+
+#define TEST_DUPLICATE(policy, expect, json)\
+    do {\
+        lept_value v, e;\
+        lept_parse_options opts;\
+        char* s1, *s2;\
+        size_t len1, len2;\
+        lept_parse_options_init(&opts);\
+        opts.duplicate_keys = policy;\
+        lept_init(&v);\
+        lept_init(&e);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, json, &opts));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&e, expect));\
+        s1 = lept_stringify(&e, &len1);\
+        s2 = lept_stringify(&v, &len2);\
+        EXPECT_EQ_SIZE_T(len1, len2);\
+        EXPECT_TRUE(memcmp(s1, s2, len1) == 0);\
+        lept_free_string(s1);\
+        lept_free_string(s2);\
+        lept_free(&v);\
+        lept_free(&e);\
+    } while(0)
+
+static void test_parse_lazy_numbers(void) {
+    lept_parse_options opts;
+    lept_value v, w, tmp;
+    lept_field_mask* mask;
+    const char* paths[1];
+    const char* literal;
+    char* json;
+    size_t len;
+    lept_parse_options_init(&opts);
+    opts.lazy_numbers = 1;
+    lept_init(&v);
+    lept_init(&w);
+    /* the literal is kept, and written back as it came */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "12345678901234567890123", &opts));
+    literal = lept_get_number_literal(&v, &len);
+    EXPECT_EQ_STRING("12345678901234567890123", literal, len);
+    EXPECT_EQ_DOUBLE(12345678901234567890123.0, lept_get_number(&v));
+    json = lept_stringify(&v, &len);
+    EXPECT_EQ_STRING("12345678901234567890123", json, len);
+    lept_free_string(json);
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "-0.10", &opts));
+    json = lept_stringify_canonical(&v, &len);
+    EXPECT_EQ_STRING("-0.1", json, len);
+    lept_free_string(json);
+    lept_free(&v);
+    /* not converted while parsing, so never too big */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "1e400", &opts));
+    EXPECT_TRUE(lept_get_number(&v) > 1.7976931348623157e308);
+    lept_free(&v);
+    /* converted once, copies sharing the literal get the same number */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[-2.5e-3,0]", &opts));
+    EXPECT_EQ_DOUBLE(-2.5e-3, lept_get_number(lept_peek_array_element(&v, 0, &tmp)));
+    lept_copy(&w, &v);
+    EXPECT_EQ_DOUBLE(-2.5e-3, lept_get_number(lept_peek_array_element(&w, 0, &tmp)));
+    EXPECT_EQ_DOUBLE(-2.5e-3, lept_get_number(lept_peek_array_element(&v, 0, &tmp)));
+    EXPECT_EQ_DOUBLE(0.0, lept_get_number(lept_peek_array_element(&w, 1, &tmp)));
+    EXPECT_EQ_DOUBLE(0.0, lept_get_number(lept_peek_array_element(&v, 1, &tmp)));
+    lept_free(&w);
+    lept_free(&v);
+    /* the same values as converted numbers, copies share the literal */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":[1.0,-0,2.5e1],\"b\":3}", &opts));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "{\"b\":3,\"a\":[1,0,25]}"));
+    EXPECT_TRUE(lept_is_equal(&v, &w));
+    EXPECT_TRUE(lept_hash(&v) == lept_hash(&w));
+    EXPECT_TRUE(lept_get_number_literal(lept_find_object_value(&w, "b", 1), NULL) == NULL);
+    lept_copy(&w, &v);
+    lept_free(&v);
+    literal = lept_get_number_literal(lept_get_array_element(lept_find_object_value(&w, "a", 1), 2), &len);
+    EXPECT_EQ_STRING("2.5e1", literal, len);
+    /* setting a number drops the literal */
+    lept_set_number(lept_find_object_value(&w, "b", 1), 4.0);
+    EXPECT_TRUE(lept_get_number_literal(lept_find_object_value(&w, "b", 1), NULL) == NULL);
+    EXPECT_EQ_DOUBLE(4.0, lept_get_number(lept_find_object_value(&w, "b", 1)));
+    lept_free(&w);
+    /* numbers of skipped members are only checked, never copied */
+    paths[0] = "/a";
+    EXPECT_TRUE((mask = lept_field_mask_compile(paths, 1)) != NULL);
+    opts.fields = mask;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":1,\"b\":[2,3.5,{\"c\":4}],\"d\":5}", &opts));
+    EXPECT_EQ_SIZE_T(1, lept_get_object_size(&v));
+    literal = lept_get_number_literal(lept_find_object_value(&v, "a", 1), &len);
+    EXPECT_EQ_STRING("1", literal, len);
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_parse_ex(&v, "{\"a\":1,\"b\":[2,-]}", &opts));
+    lept_field_mask_free(mask);
+}
+
+static void test_parse_pack_numbers(void) {
+    lept_parse_options opts;
+    lept_value v, w, tmp, tmp2;
+    const lept_value* e1, *e2;
+    const double* d;
+    char* s1, *s2;
+    size_t size, len1, len2, packed, unpacked;
+    lept_parse_options_init(&opts);
+    opts.pack_numbers = 1;
+    lept_init(&v);
+    lept_init(&w);
+    /* numbers only, so one double[] */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[1,2.5,-3]", &opts));
+    EXPECT_EQ_INT(1, lept_get_number_array(&v, &d, &size));
+    EXPECT_EQ_SIZE_T(3, size);
+    EXPECT_EQ_DOUBLE(1.0, d[0]);
+    EXPECT_EQ_DOUBLE(2.5, d[1]);
+    EXPECT_EQ_DOUBLE(-3.0, d[2]);
+    EXPECT_EQ_SIZE_T(3, lept_get_array_size(&v));
+    EXPECT_EQ_DOUBLE(2.5, lept_get_number(lept_peek_array_element(&v, 1, &tmp)));
+    /* each read fills its own element, and leaves the array packed */
+    e1 = lept_peek_array_element(&v, 0, &tmp);
+    e2 = lept_peek_array_element(&v, 2, &tmp2);
+    EXPECT_EQ_DOUBLE(1.0, lept_get_number(e1));
+    EXPECT_EQ_DOUBLE(-3.0, lept_get_number(e2));
+    EXPECT_EQ_INT(1, lept_get_number_array(&v, &d, &size));
+    /* reads just like the unpacked array */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "[1,2.5,-3]"));
+    EXPECT_EQ_INT(0, lept_get_number_array(&w, &d, &size));
+    EXPECT_TRUE(lept_is_equal(&v, &w));
+    EXPECT_TRUE(lept_hash(&v) == lept_hash(&w));
+    s1 = lept_stringify(&v, &len1);
+    s2 = lept_stringify(&w, &len2);
+    EXPECT_EQ_SIZE_T(len2, len1);
+    EXPECT_TRUE(memcmp(s1, s2, len1) == 0);
+    lept_free_string(s1);
+    lept_free_string(s2);
+    packed = lept_memory_usage(&v, NULL);
+    unpacked = lept_memory_usage(&w, NULL);
+    EXPECT_TRUE(packed < unpacked);
+    /* a copy shares the numbers, writing through it unpacks only the copy */
+    lept_copy(&w, &v);
+    lept_set_number(lept_get_array_element(&w, 0), 7.0);
+    EXPECT_EQ_INT(0, lept_get_number_array(&w, &d, &size));
+    EXPECT_EQ_INT(1, lept_get_number_array(&v, &d, &size));
+    EXPECT_EQ_DOUBLE(1.0, d[0]);
+    EXPECT_EQ_DOUBLE(7.0, lept_get_number(lept_get_array_element(&w, 0)));
+    lept_set_number(lept_pushback_array_element(&v), 4.0);
+    EXPECT_EQ_INT(0, lept_get_number_array(&v, &d, &size));
+    EXPECT_EQ_SIZE_T(4, lept_get_array_size(&v));
+    EXPECT_EQ_DOUBLE(-3.0, lept_get_number(lept_get_array_element(&v, 2)));
+    lept_free(&v);
+    lept_free(&w);
+    /* anything else in the array, or nothing at all, keeps it unpacked; nested arrays pack on their own */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[1,\"a\"]", &opts));
+    EXPECT_EQ_INT(0, lept_get_number_array(&v, &d, &size));
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[]", &opts));
+    EXPECT_EQ_INT(0, lept_get_number_array(&v, &d, &size));
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "[[1,2],[3]]", &opts));
+    EXPECT_EQ_INT(0, lept_get_number_array(&v, &d, &size));
+    EXPECT_EQ_INT(1, lept_get_number_array(lept_peek_array_element(&v, 1, &tmp), &d, &size));
+    EXPECT_EQ_SIZE_T(1, size);
+    EXPECT_EQ_DOUBLE(3.0, d[0]);
+    /* JSON pointers reach into a packed array */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "[{\"op\":\"test\",\"path\":\"/0/1\",\"value\":2},{\"op\":\"replace\",\"path\":\"/1/0\",\"value\":5}]"));
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch_apply(&v, &w, NULL));
+    EXPECT_EQ_INT(1, lept_get_number_array(lept_peek_array_element(&v, 0, &tmp), &d, &size));
+    EXPECT_EQ_INT(0, lept_get_number_array(lept_peek_array_element(&v, 1, &tmp), &d, &size));
+    EXPECT_EQ_DOUBLE(5.0, lept_get_number(lept_peek_array_element(lept_peek_array_element(&v, 1, &tmp), 0, &tmp2)));
+    lept_free(&v);
+    lept_free(&w);
+}
+
+static void test_parse_duplicate_keys(void) {
+    char json[512], expect[512];
+    size_t i, len;
+    TEST_DUPLICATE(LEPT_DUPLICATE_KEEP_ALL, "{\"a\":1,\"b\":2,\"a\":3}", "{\"a\":1,\"b\":2,\"a\":3}");
+    TEST_DUPLICATE(LEPT_DUPLICATE_KEEP_FIRST, "{\"a\":1,\"b\":2}", "{\"a\":1,\"b\":2,\"a\":3}");
+    TEST_DUPLICATE(LEPT_DUPLICATE_KEEP_LAST, "{\"a\":3,\"b\":2}", "{\"a\":1,\"b\":2,\"a\":3}");
+    TEST_DUPLICATE(LEPT_DUPLICATE_KEEP_LAST, "{\"a\":{\"b\":\"c\"}}", "{\"a\":[1],\"a\":{\"b\":\"c\"}}");
+    TEST_DUPLICATE(LEPT_DUPLICATE_KEEP_FIRST, "[{\"a\":{\"a\":1}},{}]", "[{\"a\":{\"a\":1,\"a\":2},\"a\":null},{}]");
+    TEST_DUPLICATE(LEPT_DUPLICATE_REJECT, "{\"a\":{\"a\":1},\"\":2}", "{\"a\":{\"a\":1},\"\":2}");
+    TEST_LIMIT(LEPT_PARSE_DUPLICATE_KEY, "{\"a\":1,\"a\":1}", duplicate_keys, LEPT_DUPLICATE_REJECT);
+    TEST_LIMIT(LEPT_PARSE_DUPLICATE_KEY, "[1,{\"x\":{\"a\":\"s\",\"b\":[],\"a\":{}}}]", duplicate_keys, LEPT_DUPLICATE_REJECT);
+    /* objects past LEPT_DEDUPE_SCAN_MAX members are resolved through a hash table */
+    len = sprintf(json, "{");
+    for (i = 0; i < 40; i++)
+        len += sprintf(json + len, "%s\"k%u\":%u", i ? "," : "", (unsigned)(i % 20), (unsigned)i);
+    sprintf(json + len, "}");
+    len = sprintf(expect, "{");
+    for (i = 0; i < 20; i++)
+        len += sprintf(expect + len, "%s\"k%u\":%u", i ? "," : "", (unsigned)i, (unsigned)(i + 20));
+    sprintf(expect + len, "}");
+    TEST_DUPLICATE(LEPT_DUPLICATE_KEEP_LAST, expect, json);
+    TEST_LIMIT(LEPT_PARSE_DUPLICATE_KEY, json, duplicate_keys, LEPT_DUPLICATE_REJECT);
+    TEST_LIMIT(LEPT_PARSE_OK, expect, duplicate_keys, LEPT_DUPLICATE_REJECT);
+}
+
+static void test_parse_strict_utf8(void) {
+    TEST_LIMIT(LEPT_PARSE_OK, "[\"\xC3\xA9\xE2\x82\xAC\xF0\x9D\x84\x9E\", \"ascii only, longer than a word\"]", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_OK, "\"\xED\x9F\xBF\xEE\x80\x80\xF4\x8F\xBF\xBF\xE0\xA0\x80\xF0\x90\x80\x80\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_OK, "\"\\uD834\\uDD1E\"", strict_utf8, 1);
+    /* overlong forms */
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xC0\x80\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xC1\xBF\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xE0\x9F\xBF\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xF0\x8F\xBF\xBF\"", strict_utf8, 1);
+    /* surrogates, also when escaped alone */
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xED\xA0\x80\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\\uDC00\"", strict_utf8, 1);
+    /* above U+10FFFF */
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xF4\x90\x80\x80\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xF8\x88\x80\x80\x80\"", strict_utf8, 1);
+    /* truncated sequences and stray continuation bytes */
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xE2\x82\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xE2\x82" "a\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"12345678\x80\"", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "\"\xFF\"", strict_utf8, 1);
+    /* keys are strings too */
+    TEST_LIMIT(LEPT_PARSE_INVALID_UTF8, "{\"\xC3\":1}", strict_utf8, 1);
+    TEST_LIMIT(LEPT_PARSE_OK, "{\"\xC3\":1}", strict_utf8, 0);
+}
+
+static void test_parse_stats(void) {
+    lept_value v, *a;
+    lept_parse_options opts;
+    lept_parse_stats stats;
+    size_t bytes, slack, raw;
+    lept_parse_options_init(&opts);
+    opts.stats = &stats;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"a\":[1,2],\"bc\":\"xyz\"}", &opts));
+    EXPECT_EQ_SIZE_T(1, stats.nodes[LEPT_OBJECT]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[LEPT_ARRAY]);
+    EXPECT_EQ_SIZE_T(2, stats.nodes[LEPT_NUMBER]);
+    EXPECT_EQ_SIZE_T(1, stats.nodes[LEPT_STRING]);
+    EXPECT_EQ_SIZE_T(0, stats.nodes[LEPT_NULL]);
+    EXPECT_EQ_SIZE_T(2, stats.max_depth);
+    EXPECT_EQ_SIZE_T(3, stats.string_bytes);
+    EXPECT_EQ_SIZE_T(3, stats.key_bytes);
+    /* object, 2 keys, array, string */
+    EXPECT_EQ_SIZE_T(5, stats.allocations);
+    /* every block carries the same bookkeeping header on top of the bytes it holds */
+    raw = 2 * sizeof(lept_member) + 2 + 2 * sizeof(lept_value) + 3 + 4;
+    EXPECT_TRUE(stats.bytes_allocated >= raw && (stats.bytes_allocated - raw) % stats.allocations == 0);
+    EXPECT_TRUE(stats.stack_high_water >= 2 * sizeof(lept_value));
+
+    /* a freshly parsed document has no slack */
+    bytes = lept_memory_usage(&v, &slack);
+    EXPECT_EQ_SIZE_T(stats.bytes_allocated, bytes);
+    EXPECT_EQ_SIZE_T(0, slack);
+    a = lept_find_object_value(&v, "a", 1);
+    lept_set_number(lept_pushback_array_element(a), 3.0);
+    bytes = lept_memory_usage(&v, &slack);
+    EXPECT_EQ_SIZE_T(stats.bytes_allocated + 2 * sizeof(lept_value), bytes);
+    EXPECT_EQ_SIZE_T(sizeof(lept_value), slack);
+    lept_free(&v);
+}
+
+#define TEST_VALIDATE(error, offset, json)\
+    do {\
+        size_t off = (size_t)-1;\
+        EXPECT_EQ_INT(error, lept_validate(json, sizeof(json) - 1, &off));\
+        if (error != LEPT_PARSE_OK)\
+            EXPECT_EQ_SIZE_T((size_t)offset, off);\
+    } while(0)
+
+static void test_validate(void) {
+    char* deep;
+    size_t i, off, n = 100000;
+
+    TEST_VALIDATE(LEPT_PARSE_OK, 0, " [ null , false , true , 123 , \"abc\" , [ ] , { } ] ");
+    TEST_VALIDATE(LEPT_PARSE_OK, 0, "{\"n\":null,\"s\":\"long enough for a word \\u00e9 \\uD834\\uDD1E \\\\ \\/ end\",\"a\":[1e3,-0.5,0]}");
+    TEST_VALIDATE(LEPT_PARSE_OK, 0, "1e309");
+    TEST_VALIDATE(LEPT_PARSE_EXPECT_VALUE, 0, "");
+    TEST_VALIDATE(LEPT_PARSE_EXPECT_VALUE, 3, "[1,");
+    /* a NUL byte inside the text is an error, as it ends the text for lept_parse() */
+    TEST_VALIDATE(LEPT_PARSE_INVALID_VALUE, 0, "\0");
+    TEST_VALIDATE(LEPT_PARSE_ROOT_NOT_SINGULAR, 3, "[1]\0");
+    TEST_VALIDATE(LEPT_PARSE_INVALID_STRING_CHAR, 2, "\"a\0\"");
+    /* the offset is where the error was found */
+    TEST_VALIDATE(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, 5, "[1, 2tru]");
+    TEST_VALIDATE(LEPT_PARSE_INVALID_VALUE, 4, "[1, nul]");
+    TEST_VALIDATE(LEPT_PARSE_ROOT_NOT_SINGULAR, 8, "{\"a\":1} x");
+    TEST_VALIDATE(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, 9, "{\"a\":[1] \"b\":2}");
+    TEST_VALIDATE(LEPT_PARSE_MISS_COLON, 6, "{\"ab\" 1}");
+    TEST_VALIDATE(LEPT_PARSE_INVALID_STRING_ESCAPE, 12, "[\"0123456789\\x\"]");
+    TEST_VALIDATE(LEPT_PARSE_INVALID_UNICODE_SURROGATE, 8, "[\"\\uD800\\u0041\"]");
+
+    /* bytes past len are not read */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_validate("[1,2]xyz", 5, NULL));
+    EXPECT_EQ_INT(LEPT_PARSE_INVALID_VALUE, lept_validate("true", 3, NULL));
+    EXPECT_EQ_INT(LEPT_PARSE_MISS_QUOTATION_MARK, lept_validate("\"abc\"", 4, &off));
+    EXPECT_EQ_SIZE_T(4, off);
+
+    /* nesting deeper than the bits kept on the C stack */
+    deep = (char*)malloc(n * 2);
+    for (i = 0; i < n; i++) {
+        deep[i] = '[';
+        deep[n + i] = ']';
+    }
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_validate(deep, n * 2, NULL));
+    EXPECT_EQ_INT(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, lept_validate(deep, n * 2 - 1, &off));
+    EXPECT_EQ_SIZE_T(n * 2 - 1, off);
+    free(deep);
+}
+
+#define TEST_PROJECTED(expect, json)\
+    do {\
+        lept_value v, e;\
+        lept_init(&v);\
+        lept_init(&e);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_projected(&v, json, mask));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&e, expect));\
+        EXPECT_TRUE(lept_is_equal(&e, &v));\
+        lept_free(&v);\
+        lept_free(&e);\
+    } while(0)
+
+#define TEST_PROJECTED_ERROR(error, json)\
+    do {\
+        lept_value v;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(error, lept_parse_projected(&v, json, mask));\
+        EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+    } while(0)
+
+static void test_parse_projected(void) {
+    static const char* const paths[] = { "/id", "/user/name", "/items/price", "/user/name", "/a~1b", "/meta" };
+    static const char* const bad[] = { "/id", "user" };
+    static const char* const root[] = { "/x", "" };
+    lept_field_mask* mask;
+    lept_parse_options opts;
+    lept_parse_stats stats;
+    lept_value v;
+
+    mask = lept_field_mask_compile(paths, sizeof(paths) / sizeof(paths[0]));
+    EXPECT_TRUE(mask != NULL);
+    TEST_PROJECTED("{}", "{}");
+    TEST_PROJECTED("{}", "{\"x\":1}");
+    TEST_PROJECTED("{}", "{\"x\":[1,{\"y\":[{},[]]},\"\\u00e9\"],\"z\":{\"id\":1}}");
+    TEST_PROJECTED("{\"id\":7}", "{\"skip\":{\"id\":1},\"id\":7,\"more\":[true,false,null]}");
+    TEST_PROJECTED("{\"a/b\":1,\"meta\":{\"k\":[1,2]}}", "{\"a/b\":1,\"a\":{\"b\":2},\"meta\":{\"k\":[1,2]}}");
+    TEST_PROJECTED("{\"user\":{\"name\":\"n\"}}", "{\"user\":{\"age\":3,\"name\":\"n\",\"tags\":[\"a\"]}}");
+    TEST_PROJECTED("{\"user\":{}}", "{\"user\":{\"age\":3}}");
+    /* a path stops at the first value that is not an object */
+    TEST_PROJECTED("{\"user\":\"n\"}", "{\"user\":\"n\"}");
+    /* arrays apply the selection to each element */
+    TEST_PROJECTED("{\"items\":[{\"price\":1},{},{\"price\":[2]},3]}",
+        "{\"items\":[{\"price\":1,\"sku\":\"a\"},{\"sku\":\"b\"},{\"price\":[2]},3]}");
+    TEST_PROJECTED("[{\"id\":1},{\"id\":2}]", "[{\"id\":1,\"x\":0},{\"x\":[],\"id\":2}]");
+    TEST_PROJECTED("1.5", " 1.5 ");
+
+    /* skipped members are still validated */
+    TEST_PROJECTED_ERROR(LEPT_PARSE_INVALID_VALUE, "{\"x\":[1,tru]}");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_INVALID_STRING_ESCAPE, "{\"id\":1,\"x\":{\"y\":\"\\q\"}}");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "{\"x\":[1 2]}");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"x\":{\"y\":1]}");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_MISS_COMMA_OR_CURLY_BRACKET, "{\"x\":1 \"id\":2}");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_MISS_KEY, "{\"x\":{1:2}}");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_MISS_COLON, "{\"x\" 1}");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_EXPECT_VALUE, "{\"x\":[");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_NUMBER_TOO_BIG, "{\"x\":1e309}");
+    TEST_PROJECTED_ERROR(LEPT_PARSE_ROOT_NOT_SINGULAR, "{\"x\":1} 2");
+
+    /* skipped members are neither counted nor allocated, but obey the depth limit */
+    lept_parse_options_init(&opts);
+    opts.fields = mask;
+    opts.stats = &stats;
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"x\":[[\"long string\"],{\"y\":2}],\"id\":1}", &opts));
+    EXPECT_EQ_SIZE_T(2, stats.nodes[LEPT_OBJECT] + stats.nodes[LEPT_NUMBER]);
+    EXPECT_EQ_SIZE_T(0, stats.string_bytes);
+    EXPECT_EQ_SIZE_T(2, stats.key_bytes);
+    lept_free(&v);
+    opts.stats = NULL;
+    opts.max_depth = 3;
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, "{\"x\":[[1]]}", &opts));
+    lept_free(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_TOO_DEEP, lept_parse_ex(&v, "{\"x\":[[[1]]]}", &opts));
+    lept_field_mask_free(mask);
+
+    /* the empty path selects the whole document */
+    mask = lept_field_mask_compile(root, 2);
+    EXPECT_TRUE(mask != NULL);
+    TEST_PROJECTED("{\"x\":1,\"y\":[2]}", "{\"x\":1,\"y\":[2]}");
+    lept_field_mask_free(mask);
+    mask = lept_field_mask_compile(NULL, 0);
+    TEST_PROJECTED("{}", "{\"x\":1,\"y\":[2]}");
+    lept_field_mask_free(mask);
+    EXPECT_TRUE(lept_field_mask_compile(bad, 2) == NULL);
+}
+
+#define TEST_SCHEMA(error, expect_keyword, expect_path, json)\
+    do {\
+        lept_value v;\
+        lept_parse_options opts;\
+        lept_schema_error err;\
+        lept_parse_options_init(&opts);\
+        opts.schema = schema;\
+        opts.schema_error = &err;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(error, lept_parse_ex(&v, json, &opts));\
+        if (error == LEPT_PARSE_SCHEMA_VIOLATION) {\
+            EXPECT_EQ_STRING(expect_keyword, err.keyword, strlen(err.keyword));\
+            EXPECT_EQ_STRING(expect_path, err.path, strlen(err.path));\
+            EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+        }\
+        lept_free(&v);\
+    } while(0)
+
+static void test_schema(void) {
+    lept_schema* schema;
+    lept_value s;
+
+    lept_init(&s);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&s,
+        "{\"type\":\"object\",\"required\":[\"id\",\"items\"],\"properties\":{"
+        "\"id\":{\"type\":\"integer\",\"minimum\":1},"
+        "\"kind\":{\"enum\":[\"a\",\"b\",null]},"
+        "\"a/b\":{\"type\":[\"string\",\"null\"],\"maxLength\":2},"
+        "\"items\":{\"type\":\"array\",\"items\":{\"type\":\"object\",\"required\":[\"name\"],"
+        "\"properties\":{\"name\":{\"type\":\"string\",\"maxLength\":3},\"price\":{\"type\":\"number\",\"maximum\":10}}}}}}"));
+    schema = lept_schema_compile(&s);
+    lept_free(&s);
+    EXPECT_TRUE(schema != NULL);
+
+    TEST_SCHEMA(LEPT_PARSE_OK, "", "", "{\"id\":1,\"items\":[]}");
+    TEST_SCHEMA(LEPT_PARSE_OK, "", "", "{\"id\":2,\"kind\":null,\"extra\":[{}],\"items\":[{\"name\":\"\\u00e9\\u00e9\\u00e9\",\"price\":10}]}");
+    TEST_SCHEMA(LEPT_PARSE_OK, "", "", "{\"items\":[{\"name\":\"x\"}],\"a/b\":null,\"id\":3}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "type", "", "[]");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "type", "", "1");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "required", "", "{}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "required", "", "{\"id\":1,\"id\":2}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "type", "/id", "{\"id\":1.5,\"items\":[]}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "minimum", "/id", "{\"id\":0,\"items\":[]}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "enum", "/kind", "{\"id\":1,\"kind\":\"c\",\"items\":[]}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "maxLength", "/a~1b", "{\"a/b\":\"abc\",\"id\":1,\"items\":[]}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "type", "/items", "{\"id\":1,\"items\":{}}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "type", "/items/1", "{\"id\":1,\"items\":[{\"name\":\"a\"},[1,2,3]]}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "maxLength", "/items/2/name", "{\"id\":1,\"items\":[{\"name\":\"a\"},{\"name\":\"b\"},{\"name\":\"abcd\"}]}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "maximum", "/items/0/price", "{\"id\":1,\"items\":[{\"name\":\"a\",\"price\":11}]}");
+    TEST_SCHEMA(LEPT_PARSE_SCHEMA_VIOLATION, "required", "/items/0", "{\"id\":1,\"items\":[{\"price\":1}]}");
+    /* syntax errors are still reported as such */
+    TEST_SCHEMA(LEPT_PARSE_MISS_COMMA_OR_SQUARE_BRACKET, "", "", "{\"id\":1,\"items\":[{\"name\":\"a\"}");
+    lept_schema_free(schema);
+
+    /* unknown types and malformed keywords are rejected at compile time */
+    lept_init(&s);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&s, "{\"type\":\"date\"}"));
+    EXPECT_TRUE(lept_schema_compile(&s) == NULL);
+    lept_free(&s);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&s, "{\"properties\":{\"a\":{\"minimum\":\"1\"}}}"));
+    EXPECT_TRUE(lept_schema_compile(&s) == NULL);
+    lept_free(&s);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&s, "[]"));
+    EXPECT_TRUE(lept_schema_compile(&s) == NULL);
+    lept_free(&s);
+}
+
+/* allocator counting live blocks, failing once budget allocations have been made */
+typedef struct {
+    size_t live, calls, budget;
+} test_heap;
+
+static void* test_malloc(void* ctx, size_t size) {
+    test_heap* h = (test_heap*)ctx;
+    void* p;
+    if (h->calls++ >= h->budget || (p = malloc(size)) == NULL)
+        return NULL;
+    h->live++;
+    return p;
+}
+
+static void* test_realloc(void* ctx, void* ptr, size_t old_size, size_t size) {
+    test_heap* h = (test_heap*)ctx;
+    if (h->calls++ >= h->budget)
+        return NULL;
+    return realloc(ptr, size);
+}
+
+static void test_free(void* ctx, void* ptr) {
+    ((test_heap*)ctx)->live--;
+    free(ptr);
+}
+
+static void test_allocator(void) {
+    const char* json = "{\"a\":[1,\"two\",{\"three\":[]}],\"b\":\"c\"}";
+    test_heap h = { 0, 0, (size_t)-1 };
+    lept_allocator a = { test_malloc, test_realloc, test_free, NULL };
+    lept_parse_options opts;
+    lept_parser p;
+    lept_value v, w, patch;
+    lept_snapshot* s;
+    size_t n;
+    int ret;
+    a.ctx = &h;
+    lept_parse_options_init(&opts);
+    opts.allocator = &a;
+
+    /* the document comes from the allocator of the options */
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v, json, &opts));
+    EXPECT_TRUE(h.live > 0);
+    /* values added later use the current allocator, so they are freed by theirs */
+    lept_set_string(lept_set_object_value(&v, "d", 1), "e", 1);
+    lept_free(&v);
+    EXPECT_EQ_SIZE_T(0, h.live);
+
+    /* a parser keeps the allocator of its first parse */
+    lept_parser_init(&p);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parser_parse(&p, &v, json, &opts));
+    lept_free(&v);
+    EXPECT_TRUE(h.live == 1);
+    lept_parser_free(&p);
+    EXPECT_EQ_SIZE_T(0, h.live);
+
+    /* the global allocator serves every value API */
+    lept_set_allocator(&a);
+    EXPECT_TRUE(lept_get_allocator() == &a);
+    lept_init(&v);
+    lept_init(&w);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, json));
+    lept_copy(&w, &v);
+    EXPECT_TRUE(lept_is_equal(&v, &w));
+    /* so do returned strings and the scratch memory of diff and JSON pointers */
+    lept_free_string(lept_stringify(&v, NULL));
+    lept_free_string(lept_encode_cbor(&v, &n));
+    lept_set_string(lept_set_object_value(&w, "~/", 2), "x", 1);
+    lept_init(&patch);
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_diff(&v, &w, &patch));
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch_apply(&v, &patch, NULL));
+    EXPECT_TRUE(lept_is_equal(&v, &w));
+    lept_free(&patch);
+    lept_free(&v);
+    lept_free(&w);
+    lept_set_allocator(NULL);
+    EXPECT_TRUE(lept_get_allocator() != &a);
+    EXPECT_EQ_SIZE_T(0, h.live);
+
+    /* every allocation failure is reported and leaks nothing */
+    for (n = 0; ; n++) {
+        lept_parser_init(&p);
+        h.calls = 0;
+        h.budget = n;
+        ret = lept_parser_parse(&p, &v, json, &opts);
+        lept_free(&v);
+        lept_parser_free(&p);
+        EXPECT_EQ_SIZE_T(0, h.live);
+        if (ret == LEPT_PARSE_OK)
+            break;
+        EXPECT_EQ_INT(LEPT_PARSE_OUT_OF_MEMORY, ret);
+    }
+    EXPECT_TRUE(n > 0);
+
+    /* so is every failure of the setters and of copying a snapshot, which leave null behind */
+    lept_init(&w);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, json));
+    s = lept_freeze(&w);
+    lept_set_allocator(&a);
+    for (n = 0; ; n++) {
+        h.calls = 0;
+        h.budget = n;
+        if ((ret = lept_snapshot_to_value(&v, lept_snapshot_root(s))) == 0)
+            break;
+        EXPECT_EQ_INT(-1, ret);
+        EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+        EXPECT_EQ_SIZE_T(0, h.live);
+    }
+    EXPECT_TRUE(n > 0);
+    EXPECT_TRUE(lept_is_equal(&v, &w));
+    lept_free(&v);
+    h.calls = 0;
+    h.budget = 0;
+    EXPECT_EQ_INT(-1, lept_set_array(&v, 4));
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    EXPECT_EQ_INT(-1, lept_set_object(&v, 4));
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    EXPECT_EQ_INT(-1, lept_set_string(&v, "a", 1));
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    EXPECT_EQ_INT(0, lept_set_array(&v, 0));
+    lept_free(&v);
+    h.budget = (size_t)-1;
+    lept_set_allocator(NULL);
+    lept_snapshot_close(s);
+    lept_free(&w);
+    EXPECT_EQ_SIZE_T(0, h.live);
+}
+
 #define TEST_ROUNDTRIP(json)\
     do {\
         lept_value v;\
@@ -370,7 +1024,7 @@ static void test_parse_miss_comma_or_curly_bracket() {
         json2 = lept_stringify(&v, &length);\
         EXPECT_EQ_STRING(json, json2, length);\
         lept_free(&v);\
-        free(json2);\
+        lept_free_string(json2);\
     } while(0)
 
 static void test_stringify_number() {
@@ -424,6 +1078,307 @@ static void test_stringify() {
     test_stringify_object();
 }
 
+#define TEST_CANONICAL(expect, json)\
+    do {\
+        lept_value v;\
+        char* json2;\
+        size_t length;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, json));\
+        json2 = lept_stringify_canonical(&v, &length);\
+        EXPECT_EQ_STRING(expect, json2, length);\
+        lept_free(&v);\
+        lept_free_string(json2);\
+    } while(0)
+
+static void test_writer(void) {
+    lept_writer w;
+    char fixed[16];
+    const char* out;
+    size_t len;
+    lept_writer_init(&w, NULL, 0);
+    lept_writer_begin_object(&w);
+    lept_writer_key(&w, "id", 2);
+    lept_writer_int64(&w, -9007199254740993LL);
+    lept_writer_key(&w, "name", 4);
+    lept_writer_string(&w, "a\"b\n\x01", 5);
+    lept_writer_key(&w, "tags", 4);
+    lept_writer_begin_array(&w);
+    lept_writer_string(&w, "x", 1);
+    lept_writer_bool(&w, 1);
+    lept_writer_bool(&w, 0);
+    lept_writer_null(&w);
+    lept_writer_number(&w, 1.5);
+    lept_writer_begin_object(&w);
+    lept_writer_end_object(&w);
+    lept_writer_begin_array(&w);
+    lept_writer_end_array(&w);
+    lept_writer_end_array(&w);
+    lept_writer_key(&w, "raw", 3);
+    lept_writer_raw(&w, "{\"k\":[1]}", 9);
+    lept_writer_end_object(&w);
+    out = lept_writer_result(&w, &len);
+    EXPECT_EQ_STRING("{\"id\":-9007199254740993,\"name\":\"a\\\"b\\n\\u0001\",\"tags\":[\"x\",true,false,null,1.5,{},[]],\"raw\":{\"k\":[1]}}", out, len);
+    /* the buffer is kept for the next document */
+    lept_writer_reset(&w);
+    lept_writer_string(&w, "", 0);
+    out = lept_writer_result(&w, &len);
+    EXPECT_EQ_STRING("\"\"", out, len);
+    lept_writer_free(&w);
+
+    /* a fixed buffer takes a string shorter than its worst case escaping */
+    lept_writer_init(&w, fixed, sizeof(fixed));
+    lept_writer_begin_array(&w);
+    lept_writer_string(&w, "abcdefgh", 8);
+    lept_writer_end_array(&w);
+    out = lept_writer_result(&w, &len);
+    EXPECT_EQ_STRING("[\"abcdefgh\"]", out, len);
+    EXPECT_TRUE(out == fixed);
+    /* and reports running out of it */
+    lept_writer_reset(&w);
+    lept_writer_begin_array(&w);
+    lept_writer_number(&w, 0.1);
+    lept_writer_end_array(&w);
+    EXPECT_TRUE(lept_writer_result(&w, &len) == NULL);
+}
+
+static void test_stringify_canonical(void) {
+    lept_value v, w;
+    char* json;
+    size_t i, length;
+    uint64_t h;
+
+    TEST_CANONICAL("{}", " { } ");
+    TEST_CANONICAL("[null,false,true,\"\",[],{}]", "[ null , false , true , \"\" , [ ] , { } ]");
+    TEST_CANONICAL("{\"a\":{\"x\":[1,{\"p\":2,\"q\":1}],\"y\":0},\"b\":1}", "{\"b\":1,\"a\":{\"y\":0,\"x\":[1,{\"q\":1,\"p\":2}]}}");
+    /* numbers as ECMAScript prints them */
+    TEST_CANONICAL("[0,0,1,-1.5,0.1,123.456,4.5e-7,0.000001]", "[0,-0,1.0,-1.5e0,0.1,123.456,0.00000045,1e-6]");
+    TEST_CANONICAL("[100000000000000000000,1e+21,1.5e+300,5e-324,1.7976931348623157e+308]", "[1e20,1e21,15e299,4.9406564584124654e-324,1.7976931348623157e308]");
+    TEST_CANONICAL("[333333333.3333333,9007199254740992,-0.25]", "[333333333.33333329,9007199254740992,-25E-2]");
+    /* only '"', '\\' and control characters are escaped, in lower case */
+    TEST_CANONICAL("\"\\u001f\\b\\t\\n\\f\\r\\\"\\\\/\x7F\xC3\xA9\"", "\"\\u001F\\b\\t\\n\\f\\r\\\"\\\\\\/\x7F\\u00e9\"");
+    /* keys in UTF-16 code unit order, U+1F600 sorts before U+FB33 */
+    TEST_CANONICAL("{\"\\r\":1,\"1\":2,\"\xC2\x80\":3,\"\xC3\xB6\":4,\"\xE2\x82\xAC\":5,\"\xF0\x9F\x98\x80\":6,\"\xEF\xAC\xB3\":7}",
+        "{\"\\u20ac\":5,\"\\r\":1,\"\\ufb33\":7,\"1\":2,\"\\ud83d\\ude00\":6,\"\\u0080\":3,\"\\u00f6\":4}");
+    TEST_CANONICAL("{\"\":0,\"a\":1,\"ab\":2,\"b\":3}", "{\"b\":3,\"ab\":2,\"\":0,\"a\":1}");
+
+    /* the members are not reordered in place, and equal documents hash alike */
+    lept_init(&v);
+    lept_init(&w);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "{\"b\":[1,2],\"a\":{\"y\":\"z\",\"x\":null}}"));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "{ \"a\" : { \"x\" : null , \"y\" : \"z\" } , \"b\" : [ 1.0 , 2 ] }"));
+    lept_free_string(lept_stringify_canonical(&v, NULL));
+    EXPECT_EQ_STRING("b", lept_get_object_key(&v, 0), lept_get_object_key_length(&v, 0));
+    EXPECT_TRUE(lept_canonical_hash(&v) == lept_canonical_hash(&w));
+    lept_set_number(lept_get_array_element(lept_find_object_value(&w, "b", 1), 1), 3.0);
+    EXPECT_TRUE(lept_canonical_hash(&v) != lept_canonical_hash(&w));
+    lept_free(&v);
+    lept_free(&w);
+
+    /* the streaming hash is the FNV-1a of the whole canonical text */
+    lept_set_object(&v, 0);
+    for (i = 0; i < 500; i++) {
+        char key[16];
+        sprintf(key, "k%lu", (unsigned long)(i * 7919 % 500));
+        lept_set_object(lept_set_object_value(&v, key, strlen(key)), 0);
+        lept_set_string(lept_set_object_value(lept_find_object_value(&v, key, strlen(key)), "e", 1), key, strlen(key));
+    }
+    json = lept_stringify_canonical(&v, &length);
+    for (h = 0xCBF29CE484222325ULL, i = 0; i < length; i++)
+        h = (h ^ (unsigned char)json[i]) * 0x100000001B3ULL;
+    EXPECT_TRUE(length > 4096);
+    EXPECT_TRUE(h == lept_canonical_hash(&v));
+    lept_free_string(json);
+    lept_free(&v);
+}
+
+#define TEST_CBOR_ROUNDTRIP(json)\
+    do {\
+        lept_value v1, v2;\
+        char* cbor;\
+        size_t length;\
+        lept_init(&v1);\
+        lept_init(&v2);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v1, json));\
+        cbor = lept_encode_cbor(&v1, &length);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_decode_cbor(&v2, cbor, length));\
+        EXPECT_TRUE(lept_is_equal(&v1, &v2));\
+        lept_free(&v1);\
+        lept_free(&v2);\
+        lept_free_string(cbor);\
+    } while(0)
+
+#define TEST_CBOR_ERROR(error, cbor)\
+    do {\
+        lept_value v;\
+        lept_init(&v);\
+        EXPECT_EQ_INT(error, lept_decode_cbor(&v, cbor, sizeof(cbor) - 1));\
+        EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));\
+    } while(0)
+
+static void test_cbor(void) {
+    lept_value v;
+    char* cbor;
+    size_t length;
+
+    TEST_CBOR_ROUNDTRIP("null");
+    TEST_CBOR_ROUNDTRIP("[true,false]");
+    TEST_CBOR_ROUNDTRIP("[0,1,23,24,255,256,65535,65536,4294967296,-1,-24,-25,-4294967297]");
+    TEST_CBOR_ROUNDTRIP("[1.5,-0.0,0.1,1e300,-1e-300,4.9406564584124654e-324,1.7976931348623157e+308]");
+    TEST_CBOR_ROUNDTRIP("[-18446744073709549568,-18446744073709551616,18446744073709549568,-0.5,-1.5]");
+    TEST_CBOR_ROUNDTRIP("\"Hello\\u0000World\"");
+    TEST_CBOR_ROUNDTRIP("{\"n\":null,\"f\":false,\"t\":true,\"i\":123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"\":[]}}");
+
+    /* [1, "a", true] */
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "[1, \"a\", true]"));
+    cbor = lept_encode_cbor(&v, &length);
+    EXPECT_EQ_STRING("\x83\x01\x61\x61\xF5", cbor, length);
+    lept_free(&v);
+    lept_free_string(cbor);
+
+    /* -2^64 is out of the range of a negative integer */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "-18446744073709551616"));
+    cbor = lept_encode_cbor(&v, &length);
+    EXPECT_EQ_STRING("\xFA\xDF\x80\x00\x00", cbor, length);
+    lept_free(&v);
+    lept_free_string(cbor);
+
+    /* half precision 1.5 */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_decode_cbor(&v, "\xF9\x3E\x00", 3));
+    EXPECT_EQ_DOUBLE(1.5, lept_get_number(&v));
+
+    TEST_CBOR_ERROR(LEPT_PARSE_INVALID_CBOR, "");
+    TEST_CBOR_ERROR(LEPT_PARSE_INVALID_CBOR, "\x62\x61");         /* truncated string */
+    TEST_CBOR_ERROR(LEPT_PARSE_INVALID_CBOR, "\x83\x01\x02");     /* truncated array */
+    TEST_CBOR_ERROR(LEPT_PARSE_INVALID_CBOR, "\xA1\x01\x02");     /* non-string key */
+    TEST_CBOR_ERROR(LEPT_PARSE_INVALID_CBOR, "\x9F\x01\xFF");     /* indefinite length */
+    TEST_CBOR_ERROR(LEPT_PARSE_INVALID_CBOR, "\x9B\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01"); /* huge count */
+    TEST_CBOR_ERROR(LEPT_PARSE_ROOT_NOT_SINGULAR, "\x01\x02");
+}
+
+static void test_snapshot(void) {
+    lept_value v, v2;
+    lept_snapshot* s;
+    const lept_snapshot_node* n, *a;
+    size_t i;
+    lept_init(&v);
+    lept_init(&v2);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "{\"n\":null,\"f\":false,\"t\":true,\"i\":123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"\":[]}}"));
+    EXPECT_EQ_INT(0, lept_snapshot_write(&v, "test_snapshot.bin"));
+    s = lept_snapshot_open("test_snapshot.bin");
+    EXPECT_TRUE(s != NULL);
+    if (s != NULL) {
+        n = lept_snapshot_root(s);
+        EXPECT_EQ_INT(LEPT_OBJECT, lept_snapshot_get_type(n));
+        EXPECT_EQ_SIZE_T(7, lept_snapshot_get_object_size(n));
+        EXPECT_EQ_STRING("t", lept_snapshot_get_object_key(n, 2), lept_snapshot_get_object_key_length(n, 2));
+        EXPECT_TRUE(lept_snapshot_get_boolean(lept_snapshot_get_object_value(n, 2)));
+        EXPECT_EQ_DOUBLE(123.0, lept_snapshot_get_number(lept_snapshot_find_object_value(n, "i", 1)));
+        a = lept_snapshot_find_object_value(n, "s", 1);
+        EXPECT_EQ_STRING("abc", lept_snapshot_get_string(a), lept_snapshot_get_string_length(a));
+        a = lept_snapshot_find_object_value(n, "a", 1);
+        EXPECT_EQ_SIZE_T(3, lept_snapshot_get_array_size(a));
+        for (i = 0; i < 3; i++)
+            EXPECT_EQ_DOUBLE(i + 1.0, lept_snapshot_get_number(lept_snapshot_get_array_element(a, i)));
+        EXPECT_TRUE(lept_snapshot_find_object_value(n, "x", 1) == NULL);
+        lept_snapshot_to_value(&v2, n);
+        EXPECT_TRUE(lept_is_equal(&v, &v2));
+        lept_snapshot_close(s);
+    }
+    remove("test_snapshot.bin");
+    EXPECT_TRUE(lept_snapshot_open("test_snapshot.bin") == NULL);
+    lept_free(&v);
+    lept_free(&v2);
+}
+
+/* write image with the 8 bytes at pos replaced by value, then try to open it */
+static lept_snapshot* open_corrupt_snapshot(const char* image, size_t length, size_t pos, long long value) {
+    char buffer[256];
+    FILE* fp;
+    memcpy(buffer, image, length);
+    memcpy(buffer + pos, &value, sizeof(value));
+    fp = fopen("test_snapshot.bin", "wb");
+    fwrite(buffer, 1, length, fp);
+    fclose(fp);
+    return lept_snapshot_open("test_snapshot.bin");
+}
+
+static void test_snapshot_corrupt(void) {
+    lept_value v;
+    lept_snapshot* s;
+    char image[256];
+    size_t length;
+    FILE* fp;
+    lept_init(&v);
+    /* header 0-48 with the root at 24, elements 48-96, "abc" 96-104, [1] 104-128 */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "[\"abc\",[1]]"));
+    EXPECT_EQ_INT(0, lept_snapshot_write(&v, "test_snapshot.bin"));
+    fp = fopen("test_snapshot.bin", "rb");
+    length = fread(image, 1, sizeof(image), fp);
+    fclose(fp);
+    EXPECT_EQ_SIZE_T(128, length);
+    s = open_corrupt_snapshot(image, length, 96, 0x636261LL);
+    EXPECT_TRUE(s != NULL);
+    lept_snapshot_close(s);
+    EXPECT_TRUE(open_corrupt_snapshot(image, length, 32, 0x7FFFFFFFFFFFFFFFLL) == NULL); /* root size */
+    EXPECT_TRUE(open_corrupt_snapshot(image, length, 56, 64) == NULL);                   /* string past the end */
+    EXPECT_TRUE(open_corrupt_snapshot(image, length, 96, 0x64636261LL) == NULL);         /* string not terminated */
+    EXPECT_TRUE(open_corrupt_snapshot(image, length, 88, -72) == NULL);                  /* offset into the header */
+    EXPECT_TRUE(open_corrupt_snapshot(image, length, 48, 9) == NULL);                    /* unknown type */
+    EXPECT_TRUE(open_corrupt_snapshot(image, 120, 16, 120) == NULL);                     /* truncated */
+    remove("test_snapshot.bin");
+    lept_free(&v);
+}
+
+static void test_freeze(void) {
+    lept_value v, v2;
+    lept_snapshot* s;
+    const lept_snapshot_node* n;
+    char json[1024], key[8], *expect, *out;
+    size_t i, outlen, len = 0;
+    lept_init(&v);
+    lept_init(&v2);
+    /* enough members to be indexed, keys of mixed lengths and one duplicate */
+    len += sprintf(json + len, "{\"dup\":-1");
+    for (i = 0; i < 40; i++)
+        len += sprintf(json + len, ",\"%s%u\":%u", i % 2 ? "key" : "k", (unsigned)i, (unsigned)i);
+    sprintf(json + len, ",\"dup\":-2,\"\":[{\"a\":1}]}");
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, json));
+    s = lept_freeze(&v);
+    EXPECT_TRUE(s != NULL);
+    if (s != NULL) {
+        n = lept_snapshot_root(s);
+        EXPECT_EQ_SIZE_T(43, lept_snapshot_get_object_size(n));
+        for (i = 0; i < 40; i++) {
+            size_t klen = (size_t)sprintf(key, "%s%u", i % 2 ? "key" : "k", (unsigned)i);
+            EXPECT_EQ_SIZE_T(i + 1, lept_snapshot_find_object_index(n, key, klen));
+        }
+        EXPECT_EQ_DOUBLE(-1.0, lept_snapshot_get_number(lept_snapshot_find_object_value(n, "dup", 3)));
+        EXPECT_EQ_SIZE_T(42, lept_snapshot_find_object_index(n, "", 0));
+        EXPECT_EQ_SIZE_T(LEPT_KEY_NOT_EXIST, lept_snapshot_find_object_index(n, "k1", 2));
+        EXPECT_EQ_SIZE_T(LEPT_KEY_NOT_EXIST, lept_snapshot_find_object_index(n, "zzzzzz", 6));
+        /* members keep their order, duplicates included */
+        lept_snapshot_to_value(&v2, n);
+        expect = lept_stringify(&v, &len);
+        out = lept_stringify(&v2, &outlen);
+        EXPECT_EQ_SIZE_T(len, outlen);
+        EXPECT_TRUE(memcmp(expect, out, len) == 0);
+        lept_free_string(expect);
+        lept_free_string(out);
+        lept_snapshot_close(s);
+    }
+    /* the frozen copy does not depend on the source */
+    s = lept_freeze(&v);
+    lept_free(&v);
+    EXPECT_TRUE(s != NULL);
+    if (s != NULL) {
+        EXPECT_EQ_DOUBLE(39.0, lept_snapshot_get_number(lept_snapshot_find_object_value(lept_snapshot_root(s), "key39", 5)));
+        lept_snapshot_close(s);
+    }
+    lept_free(&v2);
+}
+
 #define TEST_EQUAL(json1, json2, equality) \
     do {\
         lept_value v1, v2;\
@@ -432,6 +1387,8 @@ static void test_stringify() {
         EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v1, json1));\
         EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v2, json2));\
         EXPECT_EQ_INT(equality, lept_is_equal(&v1, &v2));\
+        if (equality)\
+            EXPECT_TRUE(lept_hash(&v1) == lept_hash(&v2));\
         lept_free(&v1);\
         lept_free(&v2);\
     } while(0)
@@ -462,6 +1419,354 @@ static void test_equal() {
     TEST_EQUAL("{\"a\":{\"b\":{\"c\":{}}}}", "{\"a\":{\"b\":{\"c\":[]}}}", 0);
 }
 
+#define TEST_HASH_DIFFERS(json1, json2) \
+    do {\
+        lept_value v1, v2;\
+        lept_init(&v1);\
+        lept_init(&v2);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v1, json1));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v2, json2));\
+        EXPECT_TRUE(lept_hash(&v1) != lept_hash(&v2));\
+        lept_free(&v1);\
+        lept_free(&v2);\
+    } while(0)
+
+static void test_hash() {
+    TEST_EQUAL("0", "-0", 1);
+    TEST_EQUAL("{\"a\":1,\"b\":[2,3]}", "{\"b\":[2,3],\"a\":1}", 1);
+    TEST_HASH_DIFFERS("null", "false");
+    TEST_HASH_DIFFERS("1", "\"1\"");
+    TEST_HASH_DIFFERS("[1,2]", "[2,1]");
+    TEST_HASH_DIFFERS("[]", "{}");
+    TEST_HASH_DIFFERS("[[]]", "[]");
+    TEST_HASH_DIFFERS("{\"a\":1,\"b\":2}", "{\"a\":2,\"b\":1}");
+}
+
+static void test_hash_cache(void) {
+    lept_value v, w, c, *e;
+    uint64_t h, hv;
+    lept_init(&v);
+    lept_init(&w);
+    lept_init(&c);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "{\"a\":[1,{\"b\":[true,\"x\"]}],\"c\":\"d\"}"));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "{\"a\":[1,{\"b\":[true,\"y\"]}],\"c\":\"d\"}"));
+    h = lept_hash(&v);
+    EXPECT_TRUE(lept_hash(&v) == h);
+    lept_copy(&c, &v);
+
+    /* writing deep inside drops the cached hashes along the path */
+    lept_set_string(lept_get_array_element(lept_find_object_value(lept_get_array_element(lept_find_object_value(&v, "a", 1), 1), "b", 1), 1), "y", 1);
+    hv = lept_hash(&v);
+    EXPECT_TRUE(hv != h);
+    EXPECT_TRUE(hv == lept_hash(&w));
+    EXPECT_TRUE(lept_is_equal(&v, &w));
+    /* the copy keeps the hash of the blocks it still shares */
+    EXPECT_TRUE(lept_hash(&c) == h);
+    EXPECT_FALSE(lept_is_equal(&c, &v));
+
+    /* every mutator invalidates */
+    lept_popback_array_element(lept_find_object_value(&v, "a", 1));
+    EXPECT_TRUE(lept_hash(&v) != hv);
+    lept_pushback_array_element(lept_find_object_value(&v, "a", 1));
+    lept_set_number(lept_get_array_element(lept_find_object_value(&v, "a", 1), 1), 2.0);
+    EXPECT_TRUE(lept_hash(&v) != hv);
+    lept_remove_object_value(&v, lept_find_object_index(&v, "c", 1));
+    lept_set_string(lept_set_object_value(&v, "c", 1), "d", 1);
+    lept_free(&w);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "{\"a\":[1,2],\"c\":\"d\"}"));
+    EXPECT_TRUE(lept_hash(&v) == lept_hash(&w));
+    EXPECT_TRUE(lept_is_equal(&v, &w));
+    lept_erase_array_element(lept_find_object_value(&v, "a", 1), 0, 1);
+    lept_insert_array_element(lept_find_object_value(&v, "a", 1), 0);
+    EXPECT_TRUE(lept_hash(&v) != lept_hash(&w));
+    EXPECT_FALSE(lept_is_equal(&v, &w));
+    lept_clear_object(&v);
+    lept_set_object(&w, 0);
+    EXPECT_TRUE(lept_hash(&v) == lept_hash(&w));
+
+    /* an element pointer fetched before lept_hash() may still be written through */
+    lept_free(&w);
+    lept_free(&c);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&c, "[1,2,3]"));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "[1,2,9]"));
+    e = lept_get_array_element(&c, 2);
+    EXPECT_TRUE(lept_hash(&c) != lept_hash(&w));
+    lept_set_number(e, 9.0);
+    EXPECT_TRUE(lept_hash(&c) == lept_hash(&w));
+    EXPECT_TRUE(lept_is_equal(&c, &w));
+    /* so may the ones added for the caller to fill */
+    lept_set_array(&c, 0);
+    e = lept_pushback_array_element(&c);
+    lept_free(&w);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "[1]"));
+    EXPECT_TRUE(lept_hash(&c) != lept_hash(&w));
+    lept_set_number(e, 1.0);
+    EXPECT_TRUE(lept_hash(&c) == lept_hash(&w));
+    EXPECT_TRUE(lept_is_equal(&c, &w));
+    lept_set_object(&c, 0);
+    e = lept_set_object_value(&c, "k", 1);
+    lept_free(&w);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&w, "{\"k\":\"v\"}"));
+    EXPECT_FALSE(lept_is_equal(&c, &w));
+    lept_set_string(e, "v", 1);
+    EXPECT_TRUE(lept_is_equal(&c, &w));
+    EXPECT_TRUE(lept_hash(&c) == lept_hash(&w));
+
+    lept_free(&v);
+    lept_free(&w);
+    lept_free(&c);
+}
+
+/* large enough to be split over the threads at every level */
+static void test_parallel_build(lept_value* v, int seed) {
+    size_t i, j;
+    char key[16];
+    lept_set_array(v, 0);
+    for (i = 0; i < 3 * 4096; i++) {
+        lept_value* e = lept_pushback_array_element(v);
+        if (i % 1000 != 0) {
+            lept_set_number(e, (double)i);
+            continue;
+        }
+        lept_set_object(e, 0);
+        for (j = 0; j < 5000; j++) {
+            sprintf(key, "k%lu", (unsigned long)j);
+            lept_set_string(lept_set_object_value(e, key, strlen(key)), key, strlen(key));
+        }
+    }
+    /* the seed decides one member deep inside */
+    lept_set_number(lept_find_object_value(lept_get_array_element(v, 5000), "k4999", 5), (double)seed);
+}
+
+static void test_parallel() {
+    lept_value v1, v2;
+    uint64_t h;
+    char* json, *json2;
+    size_t len, len2;
+    lept_init(&v1);
+    lept_init(&v2);
+    test_parallel_build(&v1, 1);
+    test_parallel_build(&v2, 1);
+    h = lept_hash(&v1);
+    json = lept_stringify(&v1, &len);
+    EXPECT_EQ_INT(0, lept_set_threads(4));
+    EXPECT_TRUE(lept_is_equal(&v1, &v2));
+    EXPECT_TRUE(lept_hash(&v1) == h);
+    EXPECT_TRUE(lept_hash(&v2) == h);
+    /* the slices are joined in order */
+    json2 = lept_stringify(&v2, &len2);
+    EXPECT_EQ_SIZE_T(len, len2);
+    EXPECT_TRUE(json != NULL && json2 != NULL && memcmp(json, json2, len) == 0);
+    lept_free_string(json);
+    lept_free_string(json2);
+    lept_free(&v2);
+    test_parallel_build(&v2, 2);
+    EXPECT_FALSE(lept_is_equal(&v1, &v2));
+    EXPECT_TRUE(lept_hash(&v2) != h);
+    lept_free(&v1);
+    lept_free(&v2);
+    EXPECT_EQ_INT(0, lept_set_threads(0));
+}
+
+static void test_free_deferred() {
+    test_heap h = { 0, 0, (size_t)-1 };
+    lept_allocator a = { test_malloc, test_realloc, test_free, NULL };
+    lept_parse_options opts;
+    lept_value v[8], w;
+    size_t i;
+    a.ctx = &h;
+    lept_parse_options_init(&opts);
+    opts.allocator = &a;
+    for (i = 0; i < 8; i++) {
+        lept_init(&v[i]);
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse_ex(&v[i], "{\"a\":[1,\"b\",{\"c\":null}]}", &opts));
+    }
+    /* a copy keeps its shared blocks alive */
+    lept_init(&w);
+    lept_copy(&w, &v[0]);
+    for (i = 0; i < 8; i++) {
+        lept_free_deferred(&v[i]);
+        EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v[i]));
+    }
+    lept_reclaim_flush();
+    EXPECT_TRUE(h.live > 0);
+    EXPECT_EQ_SIZE_T(3, lept_get_array_size(lept_find_object_value(&w, "a", 1)));
+    lept_free_deferred(&w);
+    lept_reclaim_shutdown();
+    EXPECT_EQ_SIZE_T(0, h.live);
+    /* scalars are freed right away, the thread starts again when needed */
+    lept_set_string(&w, "abc", 3);
+    lept_free_deferred(&w);
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&w));
+    lept_set_array(&w, 4);
+    lept_free_deferred(&w);
+    lept_reclaim_shutdown();
+}
+
+static void test_atomic_doc() {
+    test_heap h = { 0, 0, (size_t)-1 };
+    lept_allocator a = { test_malloc, test_realloc, test_free, NULL };
+    lept_atomic_doc* d;
+    const lept_value* r1, *r2;
+    lept_value v, tmp;
+    int s1, s2;
+    a.ctx = &h;
+    lept_set_allocator(&a);
+    d = lept_atomic_doc_create();
+    EXPECT_TRUE(d != NULL);
+    r1 = lept_atomic_doc_acquire(d, &s1);
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(r1));
+    lept_atomic_doc_release(d, s1);
+    /* publish moves the document in */
+    lept_init(&v);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "{\"version\":1}"));
+    EXPECT_EQ_INT(0, lept_atomic_doc_publish(d, &v));
+    EXPECT_EQ_INT(LEPT_NULL, lept_get_type(&v));
+    r1 = lept_atomic_doc_acquire(d, &s1);
+    r2 = lept_atomic_doc_acquire(d, &s2);
+    EXPECT_TRUE(r1 == r2);
+    EXPECT_TRUE(lept_peek_object_value(r1, 0) == lept_peek_find_object_value(r2, "version", 7));
+    EXPECT_EQ_DOUBLE(1.0, lept_get_number(lept_peek_find_object_value(r1, "version", 7)));
+    lept_atomic_doc_release(d, s2);
+    lept_atomic_doc_release(d, s1);
+    /* the old document is gone once published over */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "{\"version\":2,\"hosts\":[\"a\",\"b\"]}"));
+    EXPECT_EQ_INT(0, lept_atomic_doc_publish(d, &v));
+    r1 = lept_atomic_doc_acquire(d, &s1);
+    EXPECT_EQ_DOUBLE(2.0, lept_get_number(lept_peek_find_object_value(r1, "version", 7)));
+    EXPECT_EQ_STRING("b", lept_get_string(lept_peek_array_element(lept_peek_find_object_value(r1, "hosts", 5), 1, &tmp)), 1);
+    lept_atomic_doc_release(d, s1);
+    /* out of memory leaves v to the caller */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v, "[3]"));
+    h.budget = h.calls;
+    EXPECT_EQ_INT(-1, lept_atomic_doc_publish(d, &v));
+    h.budget = (size_t)-1;
+    EXPECT_EQ_INT(LEPT_ARRAY, lept_get_type(&v));
+    lept_free(&v);
+    lept_atomic_doc_destroy(d);
+    lept_set_allocator(NULL);
+    EXPECT_EQ_SIZE_T(0, h.live);
+}
+
+#define TEST_PATCH(expect, doc, patch, result) \
+    do {\
+        lept_value d, p, r;\
+        lept_init(&d);\
+        lept_init(&p);\
+        lept_init(&r);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&d, doc));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, patch));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&r, result));\
+        EXPECT_EQ_INT(expect, lept_patch_apply(&d, &p, NULL));\
+        EXPECT_TRUE(lept_is_equal(&d, &r));\
+        lept_free(&d);\
+        lept_free(&p);\
+        lept_free(&r);\
+    } while(0)
+
+static void test_patch() {
+    lept_value d, p, *a;
+    size_t failed = 0;
+    /* examples of RFC 6902 appendix A */
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz\",\"value\":\"qux\"}]", "{\"baz\":\"qux\",\"foo\":\"bar\"}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":[\"bar\",\"baz\"]}", "[{\"op\":\"add\",\"path\":\"/foo/1\",\"value\":\"qux\"}]", "{\"foo\":[\"bar\",\"qux\",\"baz\"]}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"remove\",\"path\":\"/baz\"}]", "{\"foo\":\"bar\"}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":[\"bar\",\"qux\",\"baz\"]}", "[{\"op\":\"remove\",\"path\":\"/foo/1\"}]", "{\"foo\":[\"bar\",\"baz\"]}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"baz\":\"qux\",\"foo\":\"bar\"}", "[{\"op\":\"replace\",\"path\":\"/baz\",\"value\":\"boo\"}]", "{\"baz\":\"boo\",\"foo\":\"bar\"}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":{\"bar\":\"baz\",\"waldo\":\"fred\"},\"qux\":{\"corge\":\"grault\"}}",
+        "[{\"op\":\"move\",\"from\":\"/foo/waldo\",\"path\":\"/qux/thud\"}]",
+        "{\"foo\":{\"bar\":\"baz\"},\"qux\":{\"corge\":\"grault\",\"thud\":\"fred\"}}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":[\"all\",\"grass\",\"cows\",\"eat\"]}", "[{\"op\":\"move\",\"from\":\"/foo/1\",\"path\":\"/foo/3\"}]",
+        "{\"foo\":[\"all\",\"cows\",\"eat\",\"grass\"]}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}",
+        "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"qux\"},{\"op\":\"test\",\"path\":\"/foo/1\",\"value\":2}]",
+        "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/child\",\"value\":{\"grandchild\":{}}}]",
+        "{\"foo\":\"bar\",\"child\":{\"grandchild\":{}}}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"foo\":[\"bar\"]}", "[{\"op\":\"add\",\"path\":\"/foo/-\",\"value\":[\"abc\",\"def\"]}]", "{\"foo\":[\"bar\",[\"abc\",\"def\"]]}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"/\":0,\"m~n\":1}", "[{\"op\":\"copy\",\"from\":\"/m~0n\",\"path\":\"/a~1b\"}]", "{\"/\":0,\"m~n\":1,\"a/b\":1}");
+    TEST_PATCH(LEPT_PATCH_OK, "{\"a\":1}", "[{\"op\":\"replace\",\"path\":\"\",\"value\":[1]}]", "[1]");
+
+    /* a failure anywhere rolls the whole patch back */
+    TEST_PATCH(LEPT_PATCH_TEST_FAILED, "{\"baz\":\"qux\"}",
+        "[{\"op\":\"add\",\"path\":\"/x\",\"value\":1},{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"bar\"}]", "{\"baz\":\"qux\"}");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "{\"foo\":\"bar\"}", "[{\"op\":\"add\",\"path\":\"/baz/bat\",\"value\":\"qux\"}]", "{\"foo\":\"bar\"}");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "{\"foo\":[1]}", "[{\"op\":\"add\",\"path\":\"/foo/2\",\"value\":2}]", "{\"foo\":[1]}");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "{\"foo\":[1,2]}", "[{\"op\":\"remove\",\"path\":\"/foo/01\"}]", "{\"foo\":[1,2]}");
+    TEST_PATCH(LEPT_PATCH_PATH_NOT_FOUND, "{\"foo\":1}", "[{\"op\":\"replace\",\"path\":\"/bar\",\"value\":2}]", "{\"foo\":1}");
+    TEST_PATCH(LEPT_PATCH_INVALID_OPERATION, "{\"foo\":1}", "[{\"op\":\"move\",\"from\":\"/foo\",\"path\":\"/foo/bar\"}]", "{\"foo\":1}");
+    TEST_PATCH(LEPT_PATCH_INVALID_OPERATION, "{\"foo\":1}", "[{\"op\":\"remove\",\"path\":\"/foo\"},{\"op\":\"frobnicate\",\"path\":\"\"}]", "{\"foo\":1}");
+    TEST_PATCH(LEPT_PATCH_INVALID_OPERATION, "{\"foo\":1}", "[{\"op\":\"add\",\"path\":\"/bar\"}]", "{\"foo\":1}");
+
+    /* the failed index is reported and the rolled back document stays writable */
+    lept_init(&d);
+    lept_init(&p);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&d, "{\"a\":[1,2,3],\"b\":{\"c\":\"d\"}}"));
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&p, "[{\"op\":\"remove\",\"path\":\"/a/0\"},{\"op\":\"test\",\"path\":\"/b/c\",\"value\":\"e\"}]"));
+    EXPECT_EQ_INT(LEPT_PATCH_TEST_FAILED, lept_patch_apply(&d, &p, &failed));
+    EXPECT_EQ_SIZE_T(1, failed);
+    a = lept_find_object_value(&d, "a", 1);
+    EXPECT_EQ_SIZE_T(3, lept_get_array_size(a));
+    lept_set_number(lept_get_array_element(a, 0), 9.0);
+    EXPECT_EQ_DOUBLE(9.0, lept_get_number(lept_get_array_element(a, 0)));
+    lept_free(&d);
+    lept_free(&p);
+}
+
+#define TEST_DIFF(json1, json2, ops) \
+    do {\
+        lept_value a, b, p;\
+        lept_init(&a);\
+        lept_init(&b);\
+        lept_init(&p);\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&a, json1));\
+        EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&b, json2));\
+        EXPECT_EQ_INT(LEPT_PATCH_OK, lept_diff(&a, &b, &p));\
+        EXPECT_EQ_SIZE_T(ops, lept_get_array_size(&p));\
+        EXPECT_EQ_INT(LEPT_PATCH_OK, lept_patch_apply(&a, &p, NULL));\
+        EXPECT_TRUE(lept_is_equal(&a, &b));\
+        lept_free(&a);\
+        lept_free(&b);\
+        lept_free(&p);\
+    } while(0)
+
+static void test_diff() {
+    lept_value a, b, p;
+    size_t i;
+    TEST_DIFF("null", "null", 0);
+    TEST_DIFF("1", "2", 1);
+    TEST_DIFF("{\"a\":1}", "[1]", 1);
+    TEST_DIFF("{\"a\":1,\"b\":[1,2],\"c\":\"x\"}", "{\"c\":\"x\",\"b\":[1,2],\"a\":1}", 0);
+    TEST_DIFF("{\"a\":1,\"b\":2}", "{\"b\":3,\"c\":4}", 3);
+    TEST_DIFF("{\"a/b\":1,\"m~n\":2}", "{\"a/b\":2,\"m~n\":3}", 2);
+    TEST_DIFF("{\"a\":{\"b\":{\"c\":[1,2,3]}}}", "{\"a\":{\"b\":{\"c\":[1,2,4]}}}", 1);
+    TEST_DIFF("[1,2,3,4,5]", "[1,2,9,3,4,5]", 1);
+    TEST_DIFF("[1,2,3,4,5]", "[1,2,4,5]", 1);
+    TEST_DIFF("[1,2,3]", "[]", 3);
+    TEST_DIFF("[]", "[1,[2],{\"3\":4}]", 3);
+    TEST_DIFF("[1,2,3]", "[3,2,1]", 2);
+    TEST_DIFF("[{\"id\":1,\"v\":\"a\"},{\"id\":2,\"v\":\"b\"}]", "[{\"id\":1,\"v\":\"a\"},{\"id\":2,\"v\":\"c\"},{\"id\":3}]", 2);
+
+    /* a copy edited in one place diffs to one operation, the shared rest is not walked */
+    lept_init(&a);
+    lept_init(&b);
+    lept_init(&p);
+    lept_set_array(&a, 0);
+    for (i = 0; i < 1000; i++) {
+        lept_value* e = lept_pushback_array_element(&a);
+        lept_set_object(e, 1);
+        lept_set_string(lept_set_object_value(e, "k", 1), "v", 1);
+    }
+    lept_copy(&b, &a);
+    lept_set_number(lept_find_object_value(lept_get_array_element(&b, 500), "k", 1), 1.0);
+    EXPECT_EQ_INT(LEPT_PATCH_OK, lept_diff(&a, &b, &p));
+    EXPECT_EQ_SIZE_T(1, lept_get_array_size(&p));
+    EXPECT_EQ_STRING("/500/k", lept_get_string(lept_find_object_value(lept_get_array_element(&p, 0), "path", 4)), 6);
+    lept_free(&a);
+    lept_free(&b);
+    lept_free(&p);
+}
+
 static void test_copy() {
     lept_value v1, v2;
     lept_init(&v1);
@@ -473,6 +1778,62 @@ static void test_copy() {
     lept_free(&v2);
 }
 
+static void test_copy_on_write(void) {
+    lept_value v1, v2, tmp, *a1, *a2;
+    const char* json = "{\"s\":\"abc\",\"a\":[1,{\"k\":\"x\"}],\"o\":{\"p\":\"q\"}}";
+    char* json1;
+    size_t length;
+    lept_init(&v1);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v1, json));
+    lept_init(&v2);
+    lept_copy(&v2, &v1);
+    /* nothing is duplicated by the copy */
+    EXPECT_TRUE(lept_get_string(lept_peek_find_object_value(&v1, "s", 1)) == lept_get_string(lept_peek_find_object_value(&v2, "s", 1)));
+
+    /* a write deep in the copy leaves the original alone */
+    a2 = lept_find_object_value(&v2, "a", 1);
+    lept_set_string(lept_set_object_value(lept_get_array_element(a2, 1), "k", 1), "y", 1);
+    lept_set_number(lept_pushback_array_element(a2), 2.0);
+    lept_remove_object_value(lept_find_object_value(&v2, "o", 1), 0);
+    json1 = lept_stringify(&v1, &length);
+    lept_free(&v1);
+    lept_init(&v1);
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v1, json1));
+    lept_free_string(json1);
+    a1 = lept_find_object_value(&v1, "a", 1);
+    EXPECT_EQ_SIZE_T(2, lept_get_array_size(a1));
+    EXPECT_EQ_STRING("x", lept_get_string(lept_find_object_value(lept_get_array_element(a1, 1), "k", 1)), 1);
+    EXPECT_EQ_SIZE_T(1, lept_get_object_size(lept_find_object_value(&v1, "o", 1)));
+    EXPECT_EQ_SIZE_T(3, lept_get_array_size(a2));
+    EXPECT_EQ_STRING("y", lept_get_string(lept_find_object_value(lept_get_array_element(a2, 1), "k", 1)), 1);
+    EXPECT_EQ_SIZE_T(0, lept_get_object_size(lept_find_object_value(&v2, "o", 1)));
+    lept_free(&v1);
+
+    /* the copy outlives the original, siblings off the written path stay shared */
+    lept_init(&v1);
+    lept_copy(&v1, &v2);
+    lept_set_number(lept_find_object_value(&v1, "s", 1), 0.0);
+    EXPECT_TRUE(lept_get_array_element(lept_find_object_value(&v1, "a", 1), 0) != lept_get_array_element(lept_find_object_value(&v2, "a", 1), 0));
+    EXPECT_EQ_STRING("abc", lept_get_string(lept_find_object_value(&v2, "s", 1)), 3);
+    lept_free(&v2);
+    EXPECT_EQ_SIZE_T(3, lept_get_array_size(lept_find_object_value(&v1, "a", 1)));
+    lept_free(&v1);
+
+    /* copies inside one document are counted once, reading them keeps them shared */
+    EXPECT_EQ_INT(LEPT_PARSE_OK, lept_parse(&v1, json));
+    lept_set_array(&v2, 2);
+    length = lept_memory_usage(&v2, NULL) + lept_memory_usage(&v1, NULL);
+    lept_copy(lept_pushback_array_element(&v2), &v1);
+    lept_copy(lept_pushback_array_element(&v2), &v1);
+    lept_free(&v1);
+    EXPECT_EQ_SIZE_T(length, lept_memory_usage(&v2, NULL));
+    EXPECT_EQ_STRING("abc", lept_get_string(lept_peek_find_object_value(lept_peek_array_element(&v2, 0, &tmp), "s", 1)), 3);
+    EXPECT_EQ_SIZE_T(length, lept_memory_usage(&v2, NULL));
+    lept_find_object_value(lept_get_array_element(&v2, 0), "s", 1);
+    EXPECT_TRUE(lept_memory_usage(&v2, NULL) > length);
+    lept_free(&v2);
+}
+
 static void test_move() {
     lept_value v1, v2, v3;
     lept_init(&v1);
@@ -704,9 +2065,21 @@ static void test_access(void) {
 static int test(void) {
     test_access();
     test_move();
+    test_hash();
+    test_hash_cache();
+    test_parallel();
+    test_free_deferred();
+    test_atomic_doc();
+    test_patch();
+    test_diff();
     test_copy();
+    test_copy_on_write();
     test_swap();
     test_equal();
+    test_cbor();
+    test_snapshot();
+    test_snapshot_corrupt();
+    test_freeze();
 
     test_parse_null();
     test_parse_true();
@@ -716,6 +2089,8 @@ static int test(void) {
     test_parse_array();
     test_parse_object();
     test_stringify();
+    test_stringify_canonical();
+    test_writer();
 
     test_parse_expect_value();
     test_parse_invalid_value();
@@ -730,6 +2105,17 @@ static int test(void) {
     test_parse_miss_key();
     test_parse_miss_colon();
     test_parse_miss_comma_or_curly_bracket();
+    test_parser_reuse();
+    test_parse_limits();
+    test_parse_strict_utf8();
+    test_parse_duplicate_keys();
+    test_parse_lazy_numbers();
+    test_parse_pack_numbers();
+    test_parse_stats();
+    test_schema();
+    test_parse_projected();
+    test_validate();
+    test_allocator();
     printf("%d/%d (%3.2f%%) passed\n", test_pass, test_count, test_pass * 100.0 / test_count);
     return main_ret;
 }
@@ -759,7 +2145,7 @@ int main(void) {
     fwrite(result, length, 1, fp);
     fclose(fp);
     lept_free(&v);
-    free(result);
+    lept_free_string(result);
     free(jsonData);
     return 0;
 }